@@ -0,0 +1,544 @@
+#include "ts-generator.h"
+#include "ts-analyzer.h"
+#include "ts-sync.h"
+#include "ts-scheduler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Largest chunk with random chunk sizes. */
+#define TS_BENCH_RANDOM_CHUNK_MAX 1500
+/* Garbage insertions per million packets for the sync recovery benchmark. */
+#define TS_BENCH_GARBAGE 5000
+#define TS_BENCH_ITERATIONS_MAX 100
+/* Streams hosted by the scheduler benchmark, fed in pieces of seven packets like UDP datagrams. */
+#define TS_BENCH_SCHEDULER_STREAMS 32
+#define TS_BENCH_SCHEDULER_PUSH (7 * 188)
+
+typedef struct {
+    TsGenConfig generator;
+    size_t chunk_size;
+    unsigned int iterations;
+    const char *ts_analyze; /* path of ts-analyze, NULL to skip the full run */
+    const char *filter; /* run only benchmarks whose name starts with this */
+} TsBenchOptions;
+
+typedef struct {
+    const char *name;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t resyncs;
+    double seconds[TS_BENCH_ITERATIONS_MAX];
+    unsigned int iterations;
+} TsBenchResult;
+
+typedef struct {
+    uint64_t packets;
+    uint32_t client_id;
+} TsBenchCounter;
+
+static bool ts_bench_first = true;
+
+static double ts_bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int ts_bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Print one result as an element of the benchmarks array, with the best and median time. */
+static void ts_bench_report(TsBenchResult *result)
+{
+    if (result->iterations == 0)
+        return;
+    qsort(result->seconds, result->iterations, sizeof(double), ts_bench_compare);
+    double best = result->seconds[0];
+    double median = result->seconds[result->iterations / 2];
+    fprintf(stdout, "%s\n    {\"name\": \"%s\", \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+                    "\"seconds\": %.6f, \"median_seconds\": %.6f, "
+                    "\"packets_per_second\": %.0f, \"ns_per_packet\": %.2f, \"resyncs\": %" PRIu64 "}",
+            ts_bench_first ? "" : ",", result->name, result->packets, result->bytes, best, median,
+            best > 0 ? result->packets / best : 0.0,
+            result->packets ? best * 1e9 / result->packets : 0.0,
+            result->resyncs);
+    ts_bench_first = false;
+    fflush(stdout);
+}
+
+static bool ts_bench_selected(TsBenchOptions *options, const char *name)
+{
+    return options->filter == NULL || strncmp(name, options->filter, strlen(options->filter)) == 0;
+}
+
+static bool ts_bench_count_packets(const TsPacketDesc *packets, const size_t count, TsBenchCounter *counter)
+{
+    counter->packets += count;
+    return true;
+}
+
+static TsAnalyzerClass ts_bench_class = {
+    .handle_packets = (TsHandlePacketsFunc)ts_bench_count_packets,
+};
+
+/* Chunk lengths for pushing len bytes, fixed or random between 1 and TS_BENCH_RANDOM_CHUNK_MAX. */
+static size_t *ts_bench_chunks(size_t len, size_t chunk_size, uint64_t seed, size_t *count)
+{
+    size_t allocated = chunk_size ? len / chunk_size + 1 : len + 1;
+    size_t *chunks = malloc(allocated * sizeof(size_t));
+    size_t offset = 0;
+    uint64_t random = seed | 1;
+    *count = 0;
+    while (offset < len) {
+        size_t chunk = chunk_size;
+        if (!chunk) {
+            random ^= random >> 12;
+            random ^= random << 25;
+            random ^= random >> 27;
+            chunk = 1 + (random * UINT64_C(0x2545f4914f6cdd1d)) % TS_BENCH_RANDOM_CHUNK_MAX;
+        }
+        if (chunk > len - offset)
+            chunk = len - offset;
+        chunks[(*count)++] = chunk;
+        offset += chunk;
+    }
+    return chunks;
+}
+
+/* Count the packets found in a buffer pushed at once, as expected for any split into chunks. */
+static uint64_t ts_bench_count(const uint8_t *buffer, size_t len)
+{
+    PidInfoManager *pmgr = pid_info_manager_new();
+    TsAnalyzer *analyzer = ts_analyzer_new(NULL, NULL);
+    TsPidCounters counters = { 0 };
+    ts_analyzer_set_pid_info_manager(analyzer, pmgr);
+    ts_analyzer_enable_counters(analyzer, true);
+    ts_analyzer_push_buffer(analyzer, buffer, len);
+    ts_analyzer_get_counters(analyzer, &counters);
+    ts_analyzer_free(analyzer);
+    pid_info_manager_free(pmgr);
+    return counters.packets;
+}
+
+/* Push a buffer through a fresh analyzer per iteration. chunk_size 0 uses random chunk sizes.
+ * With counters the analyzer has no handler and counts the packets itself. The number of packets found
+ * is checked against expected. */
+static void ts_bench_push(TsBenchOptions *options, const char *name, const uint8_t *buffer, size_t len,
+                          size_t chunk_size, bool checks, bool counters, uint64_t expected)
+{
+    if (!ts_bench_selected(options, name))
+        return;
+    TsBenchResult result = { .name = name, .bytes = len };
+    size_t chunk_count;
+    size_t *chunks = ts_bench_chunks(len, chunk_size, options->generator.seed, &chunk_count);
+    unsigned int iteration;
+    size_t j;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        TsBenchCounter counter = { 0, 0 };
+        PidInfoManager *pmgr = pid_info_manager_new();
+        TsAnalyzer *analyzer = ts_analyzer_new(counters ? NULL : &ts_bench_class, &counter);
+        ts_analyzer_set_pid_info_manager(analyzer, pmgr);
+        ts_analyzer_enable_counters(analyzer, counters);
+        ts_analyzer_enable_checks(analyzer, checks);
+        ts_analyzer_enable_timing(analyzer, checks);
+
+        const uint8_t *data = buffer;
+        double start = ts_bench_now();
+        for (j = 0; j < chunk_count; ++j) {
+            ts_analyzer_push_buffer(analyzer, data, chunks[j]);
+            data += chunks[j];
+        }
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+
+        TsAnalyzerStats stats;
+        TsPidCounters pid_counters;
+        ts_analyzer_get_stats(analyzer, &stats);
+        result.packets = counter.packets;
+        if (ts_analyzer_get_counters(analyzer, &pid_counters))
+            result.packets = pid_counters.packets;
+        result.resyncs = stats.resyncs;
+        ts_analyzer_free(analyzer);
+        pid_info_manager_free(pmgr);
+    }
+    free(chunks);
+    if (result.packets != expected)
+        fprintf(stderr, "%s: %" PRIu64 " packets, expected %" PRIu64 "\n", name, result.packets, expected);
+    ts_bench_report(&result);
+}
+
+/* Look up the pid info and private data of every packet, as a handler counting packets does. */
+static void ts_bench_pid_lookup(TsBenchOptions *options, const uint8_t *buffer, size_t len, size_t packet_length)
+{
+    if (!ts_bench_selected(options, "pid_lookup"))
+        return;
+    TsBenchResult result = { .name = "pid_lookup", .bytes = len };
+    size_t count = len / packet_length;
+    uint16_t *pids = malloc(count * sizeof(uint16_t));
+    unsigned int iteration;
+    size_t j;
+
+    for (j = 0; j < count; ++j)
+        pids[j] = ((buffer[j * packet_length + 1] & 0x1f) << 8) | buffer[j * packet_length + 2];
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        PidInfoManager *pmgr = pid_info_manager_new();
+        uint16_t client_id = pid_info_manager_register_client(pmgr);
+        uint64_t *counts = calloc(8192, sizeof(uint64_t));
+        for (j = 0; j < count; ++j)
+            pid_info_set_private_data(pid_info_manager_add_pid(pmgr, pids[j]), client_id, &counts[pids[j]], NULL);
+
+        double start = ts_bench_now();
+        for (j = 0; j < count; ++j) {
+            uint64_t *data = pid_info_get_private_data(pid_info_manager_add_pid(pmgr, pids[j]), client_id);
+            ++*data;
+        }
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+        result.packets = count;
+
+        pid_info_manager_free(pmgr);
+        free(counts);
+    }
+    free(pids);
+    ts_bench_report(&result);
+}
+
+/* Update a record of every packet in the flat per-pid array of a client. */
+static void ts_bench_pid_records(TsBenchOptions *options, const uint8_t *buffer, size_t len, size_t packet_length)
+{
+    if (!ts_bench_selected(options, "pid_records"))
+        return;
+    TsBenchResult result = { .name = "pid_records", .bytes = len };
+    size_t count = len / packet_length;
+    uint16_t *pids = malloc(count * sizeof(uint16_t));
+    unsigned int iteration;
+    size_t j;
+
+    for (j = 0; j < count; ++j)
+        pids[j] = ((buffer[j * packet_length + 1] & 0x1f) << 8) | buffer[j * packet_length + 2];
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        PidInfoManager *pmgr = pid_info_manager_new();
+        uint16_t client_id = pid_info_manager_register_client_records(pmgr, sizeof(uint64_t));
+        for (j = 0; j < count; ++j)
+            pid_info_manager_add_pid(pmgr, pids[j]);
+
+        double start = ts_bench_now();
+        uint64_t *counts = pid_info_manager_get_client_records(pmgr, client_id);
+        for (j = 0; j < count; ++j)
+            ++counts[pid_info_manager_add_pid(pmgr, pids[j])->pid];
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+        result.packets = count;
+
+        pid_info_manager_free(pmgr);
+    }
+    free(pids);
+    ts_bench_report(&result);
+}
+
+static bool ts_bench_count_pes(const TsPesPacket *pes, uint64_t *count)
+{
+    ++*count;
+    return true;
+}
+
+/* Reassemble the PES packets of all elementary stream pids. */
+static void ts_bench_pes(TsBenchOptions *options, const uint8_t *buffer, size_t len)
+{
+    if (!ts_bench_selected(options, "pes_reassembly"))
+        return;
+    TsBenchResult result = { .name = "pes_reassembly", .bytes = len };
+    unsigned int iteration;
+    unsigned int j;
+    size_t offset;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        TsBenchCounter counter = { 0, 0 };
+        uint64_t pes_count = 0;
+        PidInfoManager *pmgr = pid_info_manager_new();
+        TsAnalyzer *analyzer = ts_analyzer_new(&ts_bench_class, &counter);
+        ts_analyzer_set_pid_info_manager(analyzer, pmgr);
+        for (j = 0; j < options->generator.pid_count; ++j)
+            ts_analyzer_enable_pes(analyzer, ts_gen_es_pid(j), (TsHandlePesFunc)ts_bench_count_pes, &pes_count);
+
+        double start = ts_bench_now();
+        for (offset = 0; offset < len; offset += options->chunk_size)
+            ts_analyzer_push_buffer(analyzer, &buffer[offset],
+                                    len - offset < options->chunk_size ? len - offset : options->chunk_size);
+        ts_analyzer_flush_pes(analyzer);
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+
+        result.packets = counter.packets;
+        ts_analyzer_free(analyzer);
+        pid_info_manager_free(pmgr);
+    }
+    ts_bench_report(&result);
+}
+
+/* Write program 1 with a rewritten PAT to /dev/null while parsing. */
+static void ts_bench_filter(TsBenchOptions *options, const uint8_t *buffer, size_t len)
+{
+    if (!ts_bench_selected(options, "filter"))
+        return;
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+        return;
+    TsBenchResult result = { .name = "filter", .bytes = len };
+    unsigned int iteration;
+    size_t offset;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        PidInfoManager *pmgr = pid_info_manager_new();
+        TsAnalyzer *analyzer = ts_analyzer_new(NULL, NULL);
+        TsFilter *filter = ts_filter_new(fd);
+        ts_filter_add_program(filter, 1);
+        ts_filter_enable_pat_rewrite(filter, true);
+        ts_analyzer_set_pid_info_manager(analyzer, pmgr);
+        ts_analyzer_set_filter(analyzer, filter);
+
+        double start = ts_bench_now();
+        for (offset = 0; offset < len; offset += options->chunk_size)
+            ts_analyzer_push_buffer(analyzer, &buffer[offset],
+                                    len - offset < options->chunk_size ? len - offset : options->chunk_size);
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+
+        TsAnalyzerStats stats;
+        ts_analyzer_get_stats(analyzer, &stats);
+        result.packets = stats.packets;
+        ts_analyzer_free(analyzer);
+        ts_filter_free(filter);
+        pid_info_manager_free(pmgr);
+    }
+    close(fd);
+    ts_bench_report(&result);
+}
+
+/* Analyze many copies of the stream on a scheduler with one worker per cpu, pushed round robin. */
+static void ts_bench_scheduler(TsBenchOptions *options, const uint8_t *buffer, size_t len)
+{
+    if (!ts_bench_selected(options, "scheduler"))
+        return;
+    TsBenchResult result = { .name = "scheduler", .bytes = len * TS_BENCH_SCHEDULER_STREAMS };
+    TsSchedulerStream *streams[TS_BENCH_SCHEDULER_STREAMS];
+    TsBenchCounter counters[TS_BENCH_SCHEDULER_STREAMS];
+    unsigned int iteration;
+    size_t offset;
+    size_t j;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        TsScheduler *scheduler = ts_scheduler_new(0);
+        memset(counters, 0, sizeof(counters));
+        for (j = 0; j < TS_BENCH_SCHEDULER_STREAMS; ++j)
+            streams[j] = ts_scheduler_add_stream(scheduler, &ts_bench_class, &counters[j], 0);
+
+        double start = ts_bench_now();
+        for (offset = 0; offset < len; offset += TS_BENCH_SCHEDULER_PUSH) {
+            for (j = 0; j < TS_BENCH_SCHEDULER_STREAMS; ++j)
+                ts_scheduler_push(streams[j], &buffer[offset], len - offset < TS_BENCH_SCHEDULER_PUSH ?
+                                  len - offset : TS_BENCH_SCHEDULER_PUSH, true);
+        }
+        for (j = 0; j < TS_BENCH_SCHEDULER_STREAMS; ++j)
+            ts_scheduler_stream_drain(streams[j]);
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+
+        result.packets = 0;
+        for (j = 0; j < TS_BENCH_SCHEDULER_STREAMS; ++j)
+            result.packets += counters[j].packets;
+        ts_scheduler_free(scheduler);
+    }
+    ts_bench_report(&result);
+}
+
+/* Search for sync in data without any, the worst case of a resync. */
+static void ts_bench_sync_find(TsBenchOptions *options, size_t len)
+{
+    if (!ts_bench_selected(options, "sync_find"))
+        return;
+    TsBenchResult result = { .name = "sync_find", .bytes = len, .packets = len / 188 };
+    uint8_t *buffer = malloc(len);
+    unsigned int iteration;
+    size_t j;
+    for (j = 0; j < len; ++j)
+        buffer[j] = j % 251 == 0 ? 0x47 : (uint8_t)(j * 7 + 1) | 0x80;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        double start = ts_bench_now();
+        size_t offset = ts_sync_find(buffer, len, 188, TS_SYNC_CONFIRM_COUNT);
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+        if (offset != len)
+            fprintf(stderr, "sync_find: unexpected sync at %zu\n", offset);
+    }
+    free(buffer);
+    ts_bench_report(&result);
+}
+
+/* Run the ts-analyze binary on the stream written to a temporary file. */
+static void ts_bench_ts_analyze(TsBenchOptions *options, const uint8_t *buffer, size_t len, uint64_t packets)
+{
+    if (options->ts_analyze == NULL || !ts_bench_selected(options, "ts_analyze"))
+        return;
+    TsBenchResult result = { .name = "ts_analyze", .bytes = len, .packets = packets };
+    char filename[] = "/tmp/ts-bench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("Could not create temporary file");
+        return;
+    }
+    if (write(fd, buffer, len) != (ssize_t)len) {
+        perror("Could not write temporary file");
+        goto out;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *argv[] = { (char *)options->ts_analyze, filename, NULL };
+    unsigned int iteration;
+    pid_t pid;
+    int status;
+    extern char **environ;
+
+    for (iteration = 0; iteration < options->iterations; ++iteration) {
+        double start = ts_bench_now();
+        if ((errno = posix_spawn(&pid, options->ts_analyze, &actions, NULL, argv, environ)) != 0) {
+            perror("Could not run ts-analyze");
+            break;
+        }
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "ts-analyze failed\n");
+            break;
+        }
+        result.seconds[result.iterations++] = ts_bench_now() - start;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    ts_bench_report(&result);
+out:
+    close(fd);
+    unlink(filename);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n packets] [-p pids] [-P programs] [-s seed] [-c chunk] [-i iterations]\n"
+                    "       [-a ts-analyze] [-f filter]\n"
+                    "  -n  Number of packets in the generated streams (default 1000000).\n"
+                    "  -p  Number of elementary stream pids (default 16).\n"
+                    "  -P  Number of programs (default 4).\n"
+                    "  -s  Random seed of the generator (default 1).\n"
+                    "  -c  Bytes per ts_analyzer_push_buffer call (default 65536).\n"
+                    "  -i  Iterations per benchmark, the best and median time are reported (default 5).\n"
+                    "  -a  Path of ts-analyze for the full run (default ./ts-analyze, empty to skip).\n"
+                    "  -f  Run only the benchmarks whose name starts with filter.\n"
+                    "The results are written to stdout as JSON.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    TsBenchOptions options;
+    memset(&options, 0, sizeof(TsBenchOptions));
+    ts_gen_config_init(&options.generator);
+    options.generator.packets = 1000000;
+    options.chunk_size = 65536;
+    options.iterations = 5;
+    options.ts_analyze = "./ts-analyze";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:P:s:c:i:a:f:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.generator.packets = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                options.generator.pid_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                options.generator.program_count = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                options.generator.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.chunk_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                options.iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                options.ts_analyze = optarg[0] ? optarg : NULL;
+                break;
+            case 'f':
+                options.filter = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (!ts_gen_config_validate(&options.generator) || options.chunk_size == 0 ||
+            options.iterations == 0 || options.iterations > TS_BENCH_ITERATIONS_MAX) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (options.ts_analyze && access(options.ts_analyze, X_OK) != 0)
+        options.ts_analyze = NULL;
+
+    TsGenConfig config = options.generator;
+    size_t len_188;
+    size_t len_192;
+    size_t len_204;
+    size_t len_garbage;
+    uint8_t *stream_188 = ts_gen_buffer(&config, &len_188);
+    config.packet_length = 192;
+    uint8_t *stream_192 = ts_gen_buffer(&config, &len_192);
+    config.packet_length = 204;
+    uint8_t *stream_204 = ts_gen_buffer(&config, &len_204);
+    config.packet_length = 188;
+    config.garbage_per_million = TS_BENCH_GARBAGE;
+    uint8_t *stream_garbage = ts_gen_buffer(&config, &len_garbage);
+
+    fprintf(stdout, "{\n  \"generator\": {\"packets\": %" PRIu64 ", \"pids\": %u, \"programs\": %u, "
+                    "\"seed\": %" PRIu64 ", \"bitrate\": %" PRIu64 "},\n"
+                    "  \"chunk_size\": %zu,\n  \"iterations\": %u,\n  \"benchmarks\": [",
+            options.generator.packets, options.generator.pid_count, options.generator.program_count,
+            options.generator.seed, options.generator.bitrate, options.chunk_size, options.iterations);
+
+    uint64_t packets = options.generator.packets;
+    ts_bench_push(&options, "parse_188", stream_188, len_188, options.chunk_size, false, false, packets);
+    ts_bench_push(&options, "parse_192", stream_192, len_192, options.chunk_size, false, false, packets);
+    ts_bench_push(&options, "parse_204", stream_204, len_204, options.chunk_size, false, false, packets);
+    ts_bench_push(&options, "parse_counters", stream_188, len_188, options.chunk_size, false, true, packets);
+    ts_bench_push(&options, "parse_checks", stream_188, len_188, options.chunk_size, true, false, packets);
+    ts_bench_push(&options, "parse_random_chunks", stream_188, len_188, 0, false, false, packets);
+    ts_bench_pid_lookup(&options, stream_188, len_188, 188);
+    ts_bench_pid_records(&options, stream_188, len_188, 188);
+    ts_bench_pes(&options, stream_188, len_188);
+    ts_bench_filter(&options, stream_188, len_188);
+    ts_bench_scheduler(&options, stream_188, len_188);
+    ts_bench_push(&options, "sync_recovery", stream_garbage, len_garbage, options.chunk_size, false, false,
+                  ts_bench_count(stream_garbage, len_garbage));
+    ts_bench_sync_find(&options, len_188);
+    ts_bench_ts_analyze(&options, stream_188, len_188, packets);
+
+    fprintf(stdout, "\n  ]\n}\n");
+
+    free(stream_188);
+    free(stream_192);
+    free(stream_204);
+    free(stream_garbage);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "ts-generator.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void ts_gen_write_file(FILE *file, const uint8_t *data, size_t len)
+{
+    if (fwrite(data, 1, len, file) != len) {
+        perror("Error writing stream");
+        exit(1);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n packets] [-p pids] [-P programs] [-l 188|192|204] [-g garbage]\n"
+                    "       [-z null%%] [-b bitrate] [-s seed] [output]\n"
+                    "  -n  Number of packets (default 100000).\n"
+                    "  -p  Number of elementary stream pids (default 16).\n"
+                    "  -P  Number of programs (default 4), each in the PAT with its own PMT.\n"
+                    "  -l  Packet length, 192 adds a 4 byte arrival timestamp, 204 16 parity bytes (default 188).\n"
+                    "  -g  Garbage insertions per million packets (default 0).\n"
+                    "  -z  Percentage of null packets (default 5).\n"
+                    "  -b  Bitrate in bit/s for PCR and PSI intervals (default 10000000).\n"
+                    "  -s  Random seed (default 1).\n"
+                    "Writes to stdout without output file. The same options always yield the same stream.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    TsGenConfig config;
+    ts_gen_config_init(&config);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:P:l:g:z:b:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                config.packets = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                config.pid_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                config.program_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.packet_length = strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                config.garbage_per_million = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                config.null_percent = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.bitrate = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (!ts_gen_config_validate(&config)) {
+        fprintf(stderr, "Invalid configuration: 1-%d programs, at least one pid per program and at most %d pids, "
+                        "packet length 188, 192 or 204.\n", TS_GEN_PROGRAM_MAX, TS_GEN_PID_MAX);
+        exit(1);
+    }
+
+    FILE *file = stdout;
+    if (optind < argc && strcmp(argv[optind], "-") != 0 && (file = fopen(argv[optind], "wb")) == NULL) {
+        perror("Could not open output");
+        exit(1);
+    }
+
+    ts_gen_run(&config, (TsGenWriteFunc)ts_gen_write_file, file);
+
+    if (fclose(file) != 0) {
+        perror("Error writing stream");
+        exit(1);
+    }
+    return 0;
+}
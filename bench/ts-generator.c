@@ -0,0 +1,357 @@
+#include "ts-generator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TS_GEN_PACKET_SIZE 188
+#define TS_GEN_NULL_PID 0x1fff
+#define TS_GEN_CLOCK_RATE 27000000.0
+/* PAT/PMT repetition and PCR interval in 27 MHz ticks. */
+#define TS_GEN_PSI_INTERVAL (TS_GEN_CLOCK_RATE / 10)
+#define TS_GEN_PCR_INTERVAL (TS_GEN_CLOCK_RATE / 25)
+/* Share of elementary stream packets starting a PES packet. */
+#define TS_GEN_PES_PERCENT 2
+#define TS_GEN_GARBAGE_MAX 400
+/* Packets collected before calling the write function. */
+#define TS_GEN_BATCH 256
+
+static const uint8_t ts_gen_stream_types[] = { 0x02, 0x04, 0x1b, 0x03, 0x06 };
+
+typedef struct {
+    const TsGenConfig *config;
+    TsGenWriteFunc write;
+    void *userdata;
+
+    uint64_t random;
+    uint64_t packet_count; /* packets generated so far */
+    uint8_t cc[8192];
+
+    uint8_t buffer[TS_GEN_BATCH * 204 + TS_GEN_GARBAGE_MAX];
+    size_t used;
+} TsGenerator;
+
+void ts_gen_config_init(TsGenConfig *config)
+{
+    memset(config, 0, sizeof(TsGenConfig));
+    config->packets = 100000;
+    config->pid_count = 16;
+    config->program_count = 4;
+    config->packet_length = 188;
+    config->null_percent = 5;
+    config->bitrate = 10000000;
+    config->seed = 1;
+}
+
+bool ts_gen_config_validate(const TsGenConfig *config)
+{
+    return config->program_count >= 1 && config->program_count <= TS_GEN_PROGRAM_MAX &&
+           config->pid_count >= config->program_count && config->pid_count <= TS_GEN_PID_MAX &&
+           (config->packet_length == 188 || config->packet_length == 192 || config->packet_length == 204) &&
+           config->null_percent <= 100 && config->bitrate > 0;
+}
+
+uint16_t ts_gen_pmt_pid(unsigned int program)
+{
+    return 0x20 + program;
+}
+
+uint16_t ts_gen_es_pid(unsigned int index)
+{
+    return 0x100 + index;
+}
+
+/* xorshift64* */
+static uint64_t ts_gen_random(TsGenerator *gen)
+{
+    uint64_t x = gen->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    gen->random = x;
+    return x * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static void ts_gen_fill_random(TsGenerator *gen, uint8_t *data, size_t len)
+{
+    uint64_t value;
+    size_t j;
+    for (j = 0; j + 8 <= len; j += 8) {
+        value = ts_gen_random(gen);
+        memcpy(&data[j], &value, 8);
+    }
+    if (j < len) {
+        value = ts_gen_random(gen);
+        memcpy(&data[j], &value, len - j);
+    }
+}
+
+/* The time of the current packet at the configured bitrate. */
+static uint64_t ts_gen_clock(TsGenerator *gen)
+{
+    return (uint64_t)((double)gen->packet_count * TS_GEN_PACKET_SIZE * 8 * TS_GEN_CLOCK_RATE /
+                      (double)gen->config->bitrate);
+}
+
+static void ts_gen_flush(TsGenerator *gen)
+{
+    if (gen->used)
+        gen->write(gen->userdata, gen->buffer, gen->used);
+    gen->used = 0;
+}
+
+/* Start a packet with its header, NULL if all packets were generated. */
+static uint8_t *ts_gen_packet(TsGenerator *gen, uint16_t pid, bool unit_start, bool payload, uint8_t af_len)
+{
+    if (gen->packet_count >= gen->config->packets)
+        return NULL;
+    if (gen->used + gen->config->packet_length > sizeof(gen->buffer))
+        ts_gen_flush(gen);
+
+    uint8_t *packet = &gen->buffer[gen->used];
+    if (gen->config->packet_length == 192) {
+        /* arrival timestamp with copy permission 0 */
+        uint32_t timestamp = ts_gen_clock(gen) & 0x3fffffff;
+        packet[0] = timestamp >> 24;
+        packet[1] = timestamp >> 16;
+        packet[2] = timestamp >> 8;
+        packet[3] = timestamp;
+        packet += 4;
+    }
+    else if (gen->config->packet_length == 204) {
+        /* no real Reed-Solomon parity, the analyzer skips it */
+        memset(&packet[188], 0, 16);
+    }
+    gen->used += gen->config->packet_length;
+    ++gen->packet_count;
+
+    packet[0] = 0x47;
+    packet[1] = (unit_start ? 0x40 : 0) | (pid >> 8);
+    packet[2] = pid & 0xff;
+    packet[3] = (af_len ? 0x20 : 0) | (payload ? 0x10 : 0) | gen->cc[pid];
+    if (payload)
+        gen->cc[pid] = (gen->cc[pid] + 1) & 0xf;
+    if (af_len) {
+        packet[4] = af_len - 1;
+        if (af_len > 1) {
+            packet[5] = 0;
+            memset(&packet[6], 0xff, af_len - 2);
+        }
+    }
+    return packet;
+}
+
+static uint32_t ts_gen_crc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    size_t j;
+    int k;
+    for (j = 0; j < len; ++j) {
+        crc ^= (uint32_t)data[j] << 24;
+        for (k = 0; k < 8; ++k)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+/* Complete the section header and append the CRC, returns the section length. */
+static size_t ts_gen_finish_section(uint8_t *section, size_t len)
+{
+    size_t section_length = len - 3 + 4;
+    section[1] = 0xb0 | (section_length >> 8);
+    section[2] = section_length & 0xff;
+    uint32_t crc = ts_gen_crc32(section, len);
+    section[len] = crc >> 24;
+    section[len + 1] = crc >> 16;
+    section[len + 2] = crc >> 8;
+    section[len + 3] = crc;
+    return len + 4;
+}
+
+static void ts_gen_section(TsGenerator *gen, uint16_t pid, const uint8_t *section, size_t len)
+{
+    size_t offset = 0;
+    size_t part;
+    uint8_t *packet;
+    bool first = true;
+    while (offset < len) {
+        if ((packet = ts_gen_packet(gen, pid, first, true, 0)) == NULL)
+            return;
+        uint8_t *payload = &packet[4];
+        size_t room = TS_GEN_PACKET_SIZE - 4;
+        if (first) {
+            /* pointer_field */
+            *payload++ = 0;
+            --room;
+            first = false;
+        }
+        part = len - offset < room ? len - offset : room;
+        memcpy(payload, &section[offset], part);
+        memset(&payload[part], 0xff, room - part);
+        offset += part;
+    }
+}
+
+static void ts_gen_psi(TsGenerator *gen)
+{
+    const TsGenConfig *config = gen->config;
+    uint8_t section[1024];
+    size_t len;
+    unsigned int program;
+    unsigned int es;
+
+    /* PAT */
+    section[0] = 0x00;
+    section[3] = 0x00; /* transport_stream_id */
+    section[4] = 0x01;
+    section[5] = 0xc1; /* version 0, current */
+    section[6] = 0;
+    section[7] = 0;
+    len = 8;
+    for (program = 0; program < config->program_count; ++program) {
+        section[len++] = (program + 1) >> 8;
+        section[len++] = (program + 1) & 0xff;
+        section[len++] = 0xe0 | (ts_gen_pmt_pid(program) >> 8);
+        section[len++] = ts_gen_pmt_pid(program) & 0xff;
+    }
+    len = ts_gen_finish_section(section, len);
+    ts_gen_section(gen, 0, section, len);
+
+    /* PMTs, the first elementary stream of a program carries the PCR */
+    for (program = 0; program < config->program_count; ++program) {
+        section[0] = 0x02;
+        section[3] = (program + 1) >> 8;
+        section[4] = (program + 1) & 0xff;
+        section[5] = 0xc1;
+        section[6] = 0;
+        section[7] = 0;
+        section[8] = 0xe0 | (ts_gen_es_pid(program) >> 8);
+        section[9] = ts_gen_es_pid(program) & 0xff;
+        section[10] = 0xf0; /* program_info_length */
+        section[11] = 0;
+        len = 12;
+        for (es = program; es < config->pid_count && len + 5 + 4 <= 1021; es += config->program_count) {
+            section[len++] = ts_gen_stream_types[(es / config->program_count) % sizeof(ts_gen_stream_types)];
+            section[len++] = 0xe0 | (ts_gen_es_pid(es) >> 8);
+            section[len++] = ts_gen_es_pid(es) & 0xff;
+            section[len++] = 0xf0;
+            section[len++] = 0;
+        }
+        len = ts_gen_finish_section(section, len);
+        ts_gen_section(gen, ts_gen_pmt_pid(program), section, len);
+    }
+}
+
+static void ts_gen_pcr(TsGenerator *gen, unsigned int program)
+{
+    uint64_t pcr = ts_gen_clock(gen);
+    uint8_t *packet = ts_gen_packet(gen, ts_gen_es_pid(program), false, true, 8);
+    if (packet == NULL)
+        return;
+    uint64_t base = pcr / 300;
+    uint16_t ext = pcr % 300;
+    packet[5] = 0x10;
+    packet[6] = base >> 25;
+    packet[7] = base >> 17;
+    packet[8] = base >> 9;
+    packet[9] = base >> 1;
+    packet[10] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+    packet[11] = ext & 0xff;
+    ts_gen_fill_random(gen, &packet[12], TS_GEN_PACKET_SIZE - 12);
+}
+
+static void ts_gen_es(TsGenerator *gen)
+{
+    unsigned int es = ts_gen_random(gen) % gen->config->pid_count;
+    bool unit_start = ts_gen_random(gen) % 100 < TS_GEN_PES_PERCENT;
+    uint8_t *packet = ts_gen_packet(gen, ts_gen_es_pid(es), unit_start, true, 0);
+    if (packet == NULL)
+        return;
+    uint8_t *payload = &packet[4];
+    size_t offset = 0;
+    if (unit_start) {
+        /* PES header with PTS */
+        uint64_t pts = ts_gen_clock(gen) / 300;
+        const uint8_t header[] = {
+            0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05,
+            0x21 | ((pts >> 29) & 0x0e), (pts >> 22) & 0xff, ((pts >> 14) & 0xfe) | 1,
+            (pts >> 7) & 0xff, ((pts << 1) & 0xfe) | 1
+        };
+        memcpy(payload, header, sizeof(header));
+        offset = sizeof(header);
+    }
+    ts_gen_fill_random(gen, &payload[offset], TS_GEN_PACKET_SIZE - 4 - offset);
+}
+
+static void ts_gen_garbage(TsGenerator *gen)
+{
+    size_t len = 1 + ts_gen_random(gen) % TS_GEN_GARBAGE_MAX;
+    if (gen->used + len > sizeof(gen->buffer))
+        ts_gen_flush(gen);
+    ts_gen_fill_random(gen, &gen->buffer[gen->used], len);
+    gen->used += len;
+}
+
+void ts_gen_run(const TsGenConfig *config, TsGenWriteFunc write, void *userdata)
+{
+    TsGenerator *gen = calloc(1, sizeof(TsGenerator));
+    double next_psi = 0;
+    double next_pcr = 0;
+    unsigned int program;
+
+    gen->config = config;
+    gen->write = write;
+    gen->userdata = userdata;
+    gen->random = config->seed ? config->seed : UINT64_C(0x9e3779b97f4a7c15);
+
+    while (gen->packet_count < config->packets) {
+        uint64_t clock = ts_gen_clock(gen);
+        if (clock >= next_psi) {
+            ts_gen_psi(gen);
+            next_psi += TS_GEN_PSI_INTERVAL;
+        }
+        if (clock >= next_pcr) {
+            for (program = 0; program < config->program_count; ++program)
+                ts_gen_pcr(gen, program);
+            next_pcr += TS_GEN_PCR_INTERVAL;
+        }
+        if (config->garbage_per_million && ts_gen_random(gen) % 1000000 < config->garbage_per_million)
+            ts_gen_garbage(gen);
+
+        if (ts_gen_random(gen) % 100 < config->null_percent) {
+            uint8_t *packet = ts_gen_packet(gen, TS_GEN_NULL_PID, false, true, 0);
+            if (packet)
+                memset(&packet[4], 0xff, TS_GEN_PACKET_SIZE - 4);
+        }
+        else {
+            ts_gen_es(gen);
+        }
+    }
+    ts_gen_flush(gen);
+    free(gen);
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t allocated;
+} TsGenBuffer;
+
+static void ts_gen_buffer_write(TsGenBuffer *buffer, const uint8_t *data, size_t len)
+{
+    if (buffer->len + len > buffer->allocated) {
+        buffer->allocated = (buffer->len + len) * 2;
+        buffer->data = realloc(buffer->data, buffer->allocated);
+    }
+    memcpy(&buffer->data[buffer->len], data, len);
+    buffer->len += len;
+}
+
+uint8_t *ts_gen_buffer(const TsGenConfig *config, size_t *len)
+{
+    TsGenBuffer buffer = { NULL, 0, 0 };
+    buffer.allocated = config->packets * config->packet_length + 4096;
+    buffer.data = malloc(buffer.allocated);
+    ts_gen_run(config, (TsGenWriteFunc)ts_gen_buffer_write, &buffer);
+    *len = buffer.len;
+    return buffer.data;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Deterministic generator of synthetic transport streams for benchmarks. */
+
+/* Layout limits: all PMT pids and elementary stream pids must fit below the null pid. */
+#define TS_GEN_PROGRAM_MAX 200
+#define TS_GEN_PID_MAX 7000
+
+typedef struct _TsGenConfig {
+    uint64_t packets; /* number of packets, without PSI repetitions counted separately */
+    unsigned int pid_count; /* elementary stream pids, distributed round robin over the programs */
+    unsigned int program_count;
+    unsigned int packet_length; /* 188, 192 (with a 4 byte arrival timestamp) or 204 (with 16 parity bytes) */
+    unsigned int garbage_per_million; /* garbage insertions per million packets, forcing a resync */
+    unsigned int null_percent; /* share of null packets */
+    uint64_t bitrate; /* bits per second, used for PCR and PSI intervals */
+    uint64_t seed;
+} TsGenConfig;
+
+/* Called with consecutive pieces of the stream. */
+typedef void (*TsGenWriteFunc)(void *userdata, const uint8_t *data, size_t len);
+
+/* Fill in the defaults: 100000 packets, 16 pids in 4 programs, 188 bytes, no garbage,
+ * 5 % null packets at 10 Mbit/s, seed 1. */
+void ts_gen_config_init(TsGenConfig *config);
+
+/* Check the configuration, returns false if it exceeds the layout limits. */
+bool ts_gen_config_validate(const TsGenConfig *config);
+
+/* Generate the stream described by config. The same config always yields the same bytes. */
+void ts_gen_run(const TsGenConfig *config, TsGenWriteFunc write, void *userdata);
+
+/* Generate the stream into a newly allocated buffer, free with free(). */
+uint8_t *ts_gen_buffer(const TsGenConfig *config, size_t *len);
+
+/* The pid of the PMT of a program and of an elementary stream. */
+uint16_t ts_gen_pmt_pid(unsigned int program);
+uint16_t ts_gen_es_pid(unsigned int index);
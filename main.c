@@ -1,23 +1,104 @@
 #include "ts-analyzer.h"
+#include "ts-sync.h"
+#include "ts-udp.h"
+#include "ts-ring.h"
+#include "ts-snapshot.h"
 
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <memory.h>
+#include <string.h>
+#include <math.h>
 
 typedef struct {
     uint64_t packet_count;
     uint32_t client_id;
+
+    bool checks;
+    TsErrorCounters errors;
+
+    bool timing;
+    size_t packet_length; /* 0 if the stream was never synchronized */
+    uint64_t duration; /* stream time in 27 MHz ticks */
+
+    bool network;
+    TsUdpStats udp;
+
+    bool pipeline;
+    TsRingStats ring;
+    uint64_t ring_dropped; /* bytes dropped because the ring was full */
+
+    bool profile;
+    TsAnalyzerStats analyzer;
+
+    TsSi *si; /* NULL unless the SDT, EIT and NIT are decoded */
+    TsIndexWriter *index; /* NULL unless a seek index is written */
+    TsFilter *filter; /* NULL unless selected pids are written */
+    int filter_fd;
+
+    bool sampled; /* counts and duration are extrapolated from sample windows */
+    uint64_t sample_windows;
+    uint64_t sample_bytes; /* bytes read in the windows */
+    uint64_t file_size;
+
+    struct _TsPidData *pid_data; /* the records of client_id, indexed by pid */
+
+    bool descending; /* list the pids by descending packet count */
+    double start; /* monotonic time in seconds when the analysis started */
+    struct _TsAnalyzeReporter *reporter; /* NULL unless snapshots are written */
 } TsPidStat;
 
-typedef struct {
-    uint64_t count;
+typedef struct _TsPidData {
+    uint64_t count; /* 0 if the pid had no packets */
+    TsPidErrorCounters errors;
+    TsPidTiming timing;
+
+    /* sampling mode: the share of the pid in each window */
+    double share_sum;
+    double share_square_sum;
+    double margin; /* half width of the 95% confidence interval of the share */
 } TsPidData;
 
+/* Formats of the report and the snapshots. */
+typedef enum {
+    TS_ANALYZE_FORMAT_TEXT,
+    TS_ANALYZE_FORMAT_JSON,
+    TS_ANALYZE_FORMAT_CSV,
+} TsAnalyzeFormat;
+
+typedef struct {
+    bool use_mmap;
+    bool checks;
+    bool timing;
+    unsigned int threads;
+    const char *interface; /* to join multicast groups on */
+    unsigned int seconds; /* stop network input after this time, 0 to run until interrupted */
+    bool pipeline;
+    size_t ring_size; /* bytes buffered between ingest and analysis in pipelined mode */
+    bool profile;
+    bool si;
+    const char *index_file; /* seek index to write, NULL for none */
+    const char *checkpoint_file; /* checkpoint to resume from and to save, NULL for none */
+    const char *filter_file; /* file or pipe to write the selected pids to, NULL for none */
+    const char *filter_pids; /* comma separated pids to write */
+    const char *filter_programs; /* comma separated program numbers to write */
+    bool filter_pat; /* rewrite the PAT to list only the selected programs */
+    double sample_percent; /* percentage of a file read in sampling mode, 0 to read everything */
+    TsAnalyzeFormat format;
+    double interval; /* seconds between snapshots, 0 for none */
+    bool descending;
+} TsAnalyzeOptions;
+
 static char* pid_names[] = {
     "PAT",
     "PMT",
@@ -33,70 +114,1118 @@ static char* pid_names[] = {
     "Other"
 };
 
-bool ts_analyze_handle_packet(PidInfo *pidinfo, const uint8_t *packet, const size_t offset, TsPidStat *stats)
+/* Address space used for one mapping of the input file. */
+#define TS_ANALYZE_MMAP_WINDOW (sizeof(void *) >= 8 ? ((size_t)1 << 30) : ((size_t)64 << 20))
+/* Amount of data pushed to the analyzer between progress updates. */
+#define TS_ANALYZE_PUSH_SIZE ((size_t)16 << 20)
+/* Buffer size of the parallel workers reading with pread(). */
+#define TS_ANALYZE_PREAD_SIZE ((size_t)1 << 20)
+/* Minimum number of bytes analyzed by one worker in parallel mode. */
+#define TS_ANALYZE_MIN_CHUNK ((uint64_t)8 << 20)
+/* Bytes searched for the first packet of a chunk. */
+#define TS_ANALYZE_SYNC_PROBE ((size_t)64 << 10)
+/* Default buffer between ingest and analysis in pipelined mode. */
+#define TS_ANALYZE_RING_SIZE ((size_t)64 << 20)
+/* Slab sizes for reading files and for one batch of datagrams in pipelined mode. */
+#define TS_ANALYZE_FILE_SLAB (2 * TS_RING_PACKET_ALIGN)
+#define TS_ANALYZE_UDP_SLAB TS_RING_PACKET_ALIGN
+/* Sampling mode reads windows of this size spread evenly over the file. If the requested part of the file
+ * holds fewer than the minimum number of them, the windows are made smaller, down to the minimum size. */
+#define TS_ANALYZE_SAMPLE_WINDOW ((uint64_t)1 << 20)
+#define TS_ANALYZE_SAMPLE_MIN_WINDOWS 16
+#define TS_ANALYZE_SAMPLE_MIN_WINDOW ((uint64_t)256 << 10)
+/* Quantile of the normal distribution for 95% confidence intervals. */
+#define TS_ANALYZE_SAMPLE_Z 1.96
+
+/* Snapshots are polled by the reporter thread this often. */
+#define TS_ANALYZE_REPORTER_POLL_US 100000
+
+/* A pid in a snapshot. */
+typedef struct {
+    uint16_t pid;
+    uint16_t type; /* PidType */
+    uint32_t cc_errors;
+    uint32_t transport_errors;
+    uint64_t count;
+    uint64_t bitrate; /* over the last second while running, the average in the final report */
+    uint64_t pcr_count; /* 0 if the pid carries no PCR */
+    uint64_t pcr_interval_min; /* 27 MHz ticks */
+    uint64_t pcr_interval_avg;
+    uint64_t pcr_interval_max;
+    uint64_t pcr_jitter_max;
+    uint64_t pcr_bitrate;
+    double margin; /* of the share when sampling, 0 otherwise */
+} TsAnalyzeSnapshotPid;
+
+/* The numbers passed from the analysis to the reporter and encoded as JSON or CSV. */
+typedef struct {
+    double time; /* seconds since the start of the analysis */
+    bool final;
+    uint64_t packet_count;
+    uint64_t bitrate;
+    uint64_t duration; /* stream time in 27 MHz ticks */
+    TsErrorCounters errors;
+    size_t pid_count;
+    TsAnalyzeSnapshotPid pids[8192];
+} TsAnalyzeSnapshot;
+
+/* Publishes snapshots from the analysis thread between two pushes and writes them in its own thread,
+ * so that a slow consumer of the output never holds up the analysis. */
+typedef struct _TsAnalyzeReporter {
+    TsSnapshot *snapshot;
+    PidInfoManager *pmgr;
+    TsAnalyzeOptions *options;
+    double next; /* when the next snapshot is due, analysis thread only */
+    uint32_t stop; /* set atomically to end the reporter thread */
+    pthread_t thread;
+} TsAnalyzeReporter;
+
+static double ts_analyze_now(void)
 {
-    if (!stats || !pidinfo) {
-        fprintf(stderr, "Error at %zu\n", offset);
-    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    TsPidData *piddata = pid_info_get_private_data(pidinfo, stats->client_id);
-    if (!piddata) {
-        piddata = malloc(sizeof(TsPidData));
-        memset(piddata, 0, sizeof(TsPidData));
-        pid_info_set_private_data(pidinfo, stats->client_id, piddata, (PidInfoPrivateDataFree)free);
+static int _ts_analyze_compare_snapshot_pids(const TsAnalyzeSnapshotPid *a, const TsAnalyzeSnapshotPid *b)
+{
+    if (a->count != b->count)
+        return a->count < b->count ? 1 : -1;
+    return (int)a->pid - (int)b->pid;
+}
+
+static void ts_analyze_write_header(FILE *output, TsAnalyzeFormat format)
+{
+    if (format == TS_ANALYZE_FORMAT_CSV)
+        fprintf(output, "time,final,pid,type,packets,share,bitrate,cc_errors,transport_errors,margin,pcr_count,"
+                        "pcr_interval_min_ms,pcr_interval_avg_ms,pcr_interval_max_ms,pcr_jitter_max_us,pcr_bitrate,"
+                        "sync_loss,sync_byte_errors,pat_errors,pmt_errors\n");
+}
+
+static void ts_analyze_add_errors(TsErrorCounters *total, const TsErrorCounters *errors)
+{
+    total->sync_loss += errors->sync_loss;
+    total->sync_byte_errors += errors->sync_byte_errors;
+    total->pat_errors += errors->pat_errors;
+    total->cc_errors += errors->cc_errors;
+    total->pmt_errors += errors->pmt_errors;
+    total->transport_errors += errors->transport_errors;
+}
+
+/* List the pids of a snapshot by descending packet count, in pid order for equal counts. */
+static void ts_analyze_sort_snapshot(TsAnalyzeSnapshot *snapshot)
+{
+    qsort(snapshot->pids, snapshot->pid_count, sizeof(TsAnalyzeSnapshotPid),
+          (int (*)(const void *, const void *))_ts_analyze_compare_snapshot_pids);
+}
+
+/* Encode a snapshot as one JSON object per line or as CSV rows, one per pid and one for the total. */
+static void ts_analyze_write_snapshot(FILE *output, TsAnalyzeSnapshot *snapshot, TsAnalyzeFormat format, bool descending)
+{
+    size_t j;
+    if (descending)
+        ts_analyze_sort_snapshot(snapshot);
+
+    if (format == TS_ANALYZE_FORMAT_JSON) {
+        fprintf(output, "{\"time\": %.3f, \"final\": %s, \"packets\": %" PRIu64 ", \"bitrate\": %" PRIu64
+                        ", \"duration\": %.3f, \"sync_loss\": %" PRIu64 ", \"sync_byte_errors\": %" PRIu64
+                        ", \"pat_errors\": %" PRIu64 ", \"cc_errors\": %" PRIu64 ", \"pmt_errors\": %" PRIu64
+                        ", \"transport_errors\": %" PRIu64 ", \"pids\": [",
+                snapshot->time, snapshot->final ? "true" : "false", snapshot->packet_count, snapshot->bitrate,
+                snapshot->duration / 27000000.0, snapshot->errors.sync_loss, snapshot->errors.sync_byte_errors,
+                snapshot->errors.pat_errors, snapshot->errors.cc_errors, snapshot->errors.pmt_errors,
+                snapshot->errors.transport_errors);
+        for (j = 0; j < snapshot->pid_count; ++j) {
+            TsAnalyzeSnapshotPid *pid = &snapshot->pids[j];
+            fprintf(output, "%s{\"pid\": %u, \"type\": \"%s\", \"packets\": %" PRIu64 ", \"share\": %.6f, "
+                            "\"margin\": %.6f, \"bitrate\": %" PRIu64 ", \"cc_errors\": %" PRIu32
+                            ", \"transport_errors\": %" PRIu32,
+                    j ? ", " : "", pid->pid, pid_names[pid->type], pid->count,
+                    snapshot->packet_count ? (double)pid->count / snapshot->packet_count : 0.0, pid->margin,
+                    pid->bitrate, pid->cc_errors, pid->transport_errors);
+            if (pid->pcr_count)
+                fprintf(output, ", \"pcr_count\": %" PRIu64 ", \"pcr_interval_min_ms\": %.3f, "
+                                "\"pcr_interval_avg_ms\": %.3f, \"pcr_interval_max_ms\": %.3f, "
+                                "\"pcr_jitter_max_us\": %.1f, \"pcr_bitrate\": %" PRIu64,
+                        pid->pcr_count, pid->pcr_interval_min / 27000.0, pid->pcr_interval_avg / 27000.0,
+                        pid->pcr_interval_max / 27000.0, pid->pcr_jitter_max / 27.0, pid->pcr_bitrate);
+            fprintf(output, "}");
+        }
+        fprintf(output, "]}\n");
     }
-    ++piddata->count;
-    ++stats->packet_count;
+    else {
+        for (j = 0; j < snapshot->pid_count; ++j) {
+            TsAnalyzeSnapshotPid *pid = &snapshot->pids[j];
+            fprintf(output, "%.3f,%d,%u,%s,%" PRIu64 ",%.6f,%" PRIu64 ",%" PRIu32 ",%" PRIu32 ",%.6f",
+                    snapshot->time, snapshot->final, pid->pid, pid_names[pid->type], pid->count,
+                    snapshot->packet_count ? (double)pid->count / snapshot->packet_count : 0.0,
+                    pid->bitrate, pid->cc_errors, pid->transport_errors, pid->margin);
+            /* the PCR columns are empty for pids without PCR, the stream errors only in the total row */
+            if (pid->pcr_count)
+                fprintf(output, ",%" PRIu64 ",%.3f,%.3f,%.3f,%.1f,%" PRIu64 ",,,,\n",
+                        pid->pcr_count, pid->pcr_interval_min / 27000.0, pid->pcr_interval_avg / 27000.0,
+                        pid->pcr_interval_max / 27000.0, pid->pcr_jitter_max / 27.0, pid->pcr_bitrate);
+            else
+                fprintf(output, ",0,,,,,,,,,\n");
+        }
+        fprintf(output, "%.3f,%d,total,,%" PRIu64 ",%.6f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",,,,,,,,%" PRIu64
+                        ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                snapshot->time, snapshot->final, snapshot->packet_count, snapshot->packet_count ? 1.0 : 0.0,
+                snapshot->bitrate, snapshot->errors.cc_errors, snapshot->errors.transport_errors,
+                snapshot->errors.sync_loss, snapshot->errors.sync_byte_errors, snapshot->errors.pat_errors,
+                snapshot->errors.pmt_errors);
+    }
+    fflush(output);
+}
 
+typedef struct {
+    TsAnalyzer *ts_analyzer;
+    TsPidStat *stats;
+    TsAnalyzeSnapshot *snapshot;
+} TsAnalyzeSnapshotFill;
+
+static void ts_analyze_set_snapshot_pcr(TsAnalyzeSnapshotPid *pid, const TsPidTiming *timing)
+{
+    pid->pcr_count = timing->pcr_count;
+    pid->pcr_interval_min = timing->pcr_interval_min;
+    pid->pcr_interval_avg = timing->pcr_interval_avg;
+    pid->pcr_interval_max = timing->pcr_interval_max;
+    pid->pcr_jitter_max = timing->pcr_jitter_max;
+    pid->pcr_bitrate = timing->pcr_bitrate;
+}
+
+/* Add the live numbers of a pid to a snapshot, on top of those collected from earlier analyzers. */
+static bool _ts_analyze_fill_snapshot_pid(PidInfo *info, TsAnalyzeSnapshotFill *fill)
+{
+    TsPidData *data = &fill->stats->pid_data[info->pid];
+    TsAnalyzeSnapshotPid *pid = &fill->snapshot->pids[fill->snapshot->pid_count];
+    TsPidCounters counters;
+    TsPidErrorCounters errors;
+    TsPidTiming timing;
+    memset(pid, 0, sizeof(TsAnalyzeSnapshotPid));
+    pid->count = data->count;
+    if (ts_analyzer_get_pid_counters(fill->ts_analyzer, info->pid, &counters))
+        pid->count += counters.packets;
+    if (pid->count == 0)
+        return true;
+    pid->pid = info->pid;
+    pid->type = info->type;
+    pid->cc_errors = data->errors.cc_errors;
+    pid->transport_errors = data->errors.transport_errors;
+    if (ts_analyzer_get_pid_errors(fill->ts_analyzer, info->pid, &errors)) {
+        pid->cc_errors += errors.cc_errors;
+        pid->transport_errors += errors.transport_errors;
+    }
+    if (ts_analyzer_get_pid_timing(fill->ts_analyzer, info->pid, &timing)) {
+        pid->bitrate = timing.bitrate;
+        ts_analyze_set_snapshot_pcr(pid, &timing);
+    }
+    else
+        ts_analyze_set_snapshot_pcr(pid, &data->timing);
+    ++fill->snapshot->pid_count;
     return true;
 }
 
-void ts_analyze_file(const char *filename, TsPidStat *stats, PidInfoManager *pmgr)
+/* Publish a snapshot if one is due, called in the analysis thread between two pushes. */
+static void ts_analyze_reporter_update(TsAnalyzeReporter *reporter, TsAnalyzer *ts_analyzer, TsPidStat *stats)
 {
-    FILE *f;
-    struct stat st;
-    if (stat(filename, &st) != 0)
+    double now = ts_analyze_now();
+    if (now < reporter->next)
         return;
+    reporter->next += reporter->options->interval;
+    if (reporter->next < now)
+        reporter->next = now + reporter->options->interval;
 
-    if ((f = fopen(filename, "r")) == NULL) {
-        perror("Could not open file");
+    TsAnalyzeSnapshot *snapshot = ts_snapshot_get_buffer(reporter->snapshot);
+    TsAnalyzeSnapshotFill fill = { ts_analyzer, stats, snapshot };
+    TsPidCounters counters;
+    TsErrorCounters errors;
+    snapshot->time = now - stats->start;
+    snapshot->final = false;
+    snapshot->packet_count = stats->packet_count;
+    if (ts_analyzer_get_counters(ts_analyzer, &counters))
+        snapshot->packet_count += counters.packets;
+    snapshot->bitrate = ts_analyzer_get_bitrate(ts_analyzer);
+    snapshot->duration = ts_analyzer_get_duration(ts_analyzer);
+    snapshot->errors = stats->errors;
+    ts_analyzer_get_errors(ts_analyzer, &errors);
+    ts_analyze_add_errors(&snapshot->errors, &errors);
+    snapshot->pid_count = 0;
+    pid_info_manager_enumerate_pid_infos(reporter->pmgr, (PidInfoEnumFunc)_ts_analyze_fill_snapshot_pid, &fill);
+    ts_snapshot_publish(reporter->snapshot);
+}
+
+static void *ts_analyze_reporter_run(TsAnalyzeReporter *reporter)
+{
+    TsAnalyzeSnapshot *snapshot;
+    bool stop;
+    do {
+        /* the last snapshot is written after stop was seen */
+        stop = __atomic_load_n(&reporter->stop, __ATOMIC_ACQUIRE);
+        if ((snapshot = ts_snapshot_read(reporter->snapshot)) != NULL)
+            ts_analyze_write_snapshot(stdout, snapshot, reporter->options->format, reporter->options->descending);
+        else if (!stop)
+            usleep(TS_ANALYZE_REPORTER_POLL_US);
+    } while (!stop);
+    return NULL;
+}
+
+static TsAnalyzeReporter *ts_analyze_reporter_new(PidInfoManager *pmgr, TsAnalyzeOptions *options, double start)
+{
+    TsAnalyzeReporter *reporter = calloc(1, sizeof(TsAnalyzeReporter));
+    reporter->snapshot = ts_snapshot_new(sizeof(TsAnalyzeSnapshot));
+    reporter->pmgr = pmgr;
+    reporter->options = options;
+    reporter->next = start + options->interval;
+    if (pthread_create(&reporter->thread, NULL, (void *(*)(void *))ts_analyze_reporter_run, reporter) != 0) {
+        perror("Could not start the reporter");
+        ts_snapshot_free(reporter->snapshot);
+        free(reporter);
+        return NULL;
+    }
+    return reporter;
+}
+
+/* Write the pending snapshot and stop the reporter thread. */
+static void ts_analyze_reporter_free(TsAnalyzeReporter *reporter)
+{
+    if (reporter == NULL)
+        return;
+    __atomic_store_n(&reporter->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(reporter->thread, NULL);
+    ts_snapshot_free(reporter->snapshot);
+    free(reporter);
+}
+
+typedef struct {
+    uint64_t done; /* bytes processed, updated atomically */
+    uint64_t full; /* total bytes, 0 if unknown */
+    TsPidStat *stats; /* print the progress if set */
+    TsAnalyzer *ts_analyzer; /* its packets are not yet in stats */
+} TsAnalyzeProgress;
+
+static void ts_analyze_progress_add(TsAnalyzeProgress *progress, uint64_t bytes)
+{
+    uint64_t done = __atomic_add_fetch(&progress->done, bytes, __ATOMIC_RELAXED);
+    if (!progress->stats)
         return;
+    /* called after a push, in the thread of the analyzer */
+    if (progress->stats->reporter)
+        ts_analyze_reporter_update(progress->stats->reporter, progress->ts_analyzer, progress->stats);
+    TsAnalyzerStats analyzer_stats;
+    ts_analyzer_get_stats(progress->ts_analyzer, &analyzer_stats);
+    uint64_t packets = progress->stats->packet_count + analyzer_stats.packets;
+    if (progress->full)
+        fprintf(stderr, "\rProgress: %6.2f%% [%" PRIu64 " packets]",
+                ((double)done)/((double)progress->full)*100.0f, packets);
+    else
+        fprintf(stderr, "\rProgress: [%" PRIu64 " packets]", packets);
+}
+
+/* Read the input with read(), works for pipes and other non-regular files. */
+static void ts_analyze_fd_read(int fd, TsAnalyzer *ts_analyzer, TsAnalyzeProgress *progress)
+{
+    uint8_t buffer[8*4096];
+    ssize_t bytes_read;
+
+    while (1) {
+        bytes_read = read(fd, buffer, 8*4096);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading buffer");
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+
+        ts_analyzer_push_buffer(ts_analyzer, buffer, bytes_read);
+
+        ts_analyze_progress_add(progress, bytes_read);
     }
+}
 
-    static TsAnalyzerClass tscls = {
-        .handle_packet = (TsHandlePacketFunc)ts_analyze_handle_packet,
-    };
-    TsAnalyzer *ts_analyzer = ts_analyzer_new(&tscls, stats);
+/* Read the bytes [start, end) of a regular file with pread(). */
+static void ts_analyze_fd_pread(int fd, uint64_t start, uint64_t end, TsAnalyzer *ts_analyzer, TsAnalyzeProgress *progress)
+{
+    uint8_t *buffer = malloc(TS_ANALYZE_PREAD_SIZE);
+    ssize_t bytes_read;
+    size_t len;
+
+    while (start < end) {
+        len = end - start < TS_ANALYZE_PREAD_SIZE ? end - start : TS_ANALYZE_PREAD_SIZE;
+        bytes_read = pread(fd, buffer, len, start);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading buffer");
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+
+        ts_analyzer_push_buffer(ts_analyzer, buffer, bytes_read);
+        start += bytes_read;
+
+        ts_analyze_progress_add(progress, bytes_read);
+    }
+
+    free(buffer);
+}
+
+/* Map the bytes [start, end) of the file in windows and push the mapped memory directly to the analyzer.
+ * Returns false if the file could not be mapped and nothing was read. */
+static bool ts_analyze_fd_mmap(int fd, uint64_t start, uint64_t end, TsAnalyzer *ts_analyzer, TsAnalyzeProgress *progress)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    /* mappings have to start at a page boundary */
+    uint64_t offset = start - start % page_size;
+    size_t skip = start - offset;
+    size_t window;
+    size_t pushed;
+    size_t chunk;
+    uint8_t *map;
+
+    while (offset < end) {
+        window = end - offset < TS_ANALYZE_MMAP_WINDOW ? end - offset : TS_ANALYZE_MMAP_WINDOW;
+        map = mmap(NULL, window, PROT_READ, MAP_PRIVATE, fd, offset);
+        if (map == MAP_FAILED) {
+            if (offset + skip == start)
+                return false;
+            perror("Could not map file");
+            break;
+        }
+        madvise(map, window, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(map, window, MADV_HUGEPAGE);
+#endif
+
+        for (pushed = skip; pushed < window; pushed += chunk) {
+            chunk = window - pushed < TS_ANALYZE_PUSH_SIZE ? window - pushed : TS_ANALYZE_PUSH_SIZE;
+            ts_analyzer_push_buffer(ts_analyzer, map + pushed, chunk);
+            ts_analyze_progress_add(progress, chunk);
+        }
+
+        munmap(map, window);
+        offset += window;
+        skip = 0;
+    }
 
+    return true;
+}
+
+/* Pipelined mode: the calling thread fills a ring, an analyzer thread drains it. */
+typedef struct {
+    TsRing *ring;
+    TsAnalyzer *ts_analyzer;
+    TsAnalyzeProgress *progress;
+    pthread_t thread;
+    bool live; /* drop data instead of waiting when the ring is full */
+    uint8_t *slab; /* slab being filled by ts_analyze_pipeline_write, NULL if none */
+    size_t slab_used;
+    uint64_t dropped;
+} TsAnalyzePipeline;
+
+static void *ts_analyze_pipeline_run(TsAnalyzePipeline *pipeline)
+{
+    const uint8_t *slab;
+    size_t len;
+    while ((slab = ts_ring_peek(pipeline->ring, &len, true)) != NULL) {
+        ts_analyzer_push_buffer(pipeline->ts_analyzer, slab, len);
+        ts_ring_release(pipeline->ring);
+        ts_analyze_progress_add(pipeline->progress, len);
+    }
+    return NULL;
+}
+
+static bool ts_analyze_pipeline_start(TsAnalyzePipeline *pipeline, TsAnalyzer *ts_analyzer, TsAnalyzeProgress *progress,
+                                      TsAnalyzeOptions *options, size_t slab_size, bool live)
+{
+    memset(pipeline, 0, sizeof(TsAnalyzePipeline));
+    pipeline->ring = ts_ring_new(options->ring_size / slab_size, slab_size);
+    pipeline->ts_analyzer = ts_analyzer;
+    pipeline->progress = progress;
+    pipeline->live = live;
+    if (pthread_create(&pipeline->thread, NULL, (void *(*)(void *))ts_analyze_pipeline_run, pipeline) != 0) {
+        ts_ring_free(pipeline->ring);
+        pipeline->ring = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Pass the partially filled slab to the analyzer thread. */
+static void ts_analyze_pipeline_flush(TsAnalyzePipeline *pipeline)
+{
+    if (pipeline->slab && pipeline->slab_used)
+        ts_ring_commit(pipeline->ring, pipeline->slab_used);
+    pipeline->slab = NULL;
+}
+
+/* Copy data into the ring, e.g. from the udp receiver. */
+static void ts_analyze_pipeline_write(TsAnalyzePipeline *pipeline, const uint8_t *data, size_t len)
+{
+    size_t slab_size = ts_ring_get_slab_size(pipeline->ring);
+    size_t part;
+    while (len) {
+        if (!pipeline->slab) {
+            pipeline->slab = ts_ring_acquire(pipeline->ring, !pipeline->live);
+            pipeline->slab_used = 0;
+            if (!pipeline->slab) {
+                pipeline->dropped += len;
+                return;
+            }
+        }
+        part = slab_size - pipeline->slab_used < len ? slab_size - pipeline->slab_used : len;
+        memcpy(&pipeline->slab[pipeline->slab_used], data, part);
+        pipeline->slab_used += part;
+        data += part;
+        len -= part;
+        if (pipeline->slab_used == slab_size)
+            ts_analyze_pipeline_flush(pipeline);
+    }
+}
+
+/* Read into the slabs directly, waiting for the analyzer thread when the ring is full. */
+static void ts_analyze_pipeline_read(TsAnalyzePipeline *pipeline, int fd)
+{
+    size_t slab_size = ts_ring_get_slab_size(pipeline->ring);
+    uint8_t *slab;
+    ssize_t bytes_read;
+
+    while (1) {
+        slab = ts_ring_acquire(pipeline->ring, true);
+        bytes_read = read(fd, slab, slab_size);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading buffer");
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+        ts_ring_commit(pipeline->ring, bytes_read);
+    }
+}
+
+/* Wait for the analyzer thread to drain the ring. */
+static void ts_analyze_pipeline_finish(TsAnalyzePipeline *pipeline, TsPidStat *stats)
+{
+    ts_analyze_pipeline_flush(pipeline);
+    ts_ring_close(pipeline->ring);
+    pthread_join(pipeline->thread, NULL);
+
+    stats->pipeline = true;
+    ts_ring_get_stats(pipeline->ring, &stats->ring);
+    stats->ring_dropped = pipeline->dropped;
+    ts_ring_free(pipeline->ring);
+}
+
+/* The packets are only counted by the analyzer, there is no handler. */
+static TsAnalyzer *ts_analyze_analyzer_new(TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeOptions *options)
+{
+    TsAnalyzer *ts_analyzer = ts_analyzer_new(NULL, NULL);
     ts_analyzer_set_pid_info_manager(ts_analyzer, pmgr);
+    ts_analyzer_enable_counters(ts_analyzer, true);
+    ts_analyzer_enable_checks(ts_analyzer, options->checks);
+    ts_analyzer_enable_timing(ts_analyzer, options->timing);
+    ts_analyzer_enable_profiling(ts_analyzer, options->profile);
+    ts_analyzer_set_si(ts_analyzer, stats->si);
+    ts_analyzer_set_index_writer(ts_analyzer, stats->index);
+    ts_analyzer_set_filter(ts_analyzer, stats->filter);
+    return ts_analyzer;
+}
 
-    uint8_t buffer[8*4096];
-    size_t bytes_read;
+typedef struct {
+    TsAnalyzer *ts_analyzer;
+    TsPidStat *stats;
+} TsAnalyzeCollect;
+
+static bool _ts_analyze_collect_pid_data(PidInfo *info, TsAnalyzeCollect *collect)
+{
+    TsAnalyzer *ts_analyzer = collect->ts_analyzer;
+    TsPidData *data = &collect->stats->pid_data[info->pid];
+    TsPidCounters counters;
+    if (ts_analyzer_get_pid_counters(ts_analyzer, info->pid, &counters))
+        data->count += counters.packets;
+    if (data->count) {
+        ts_analyzer_get_pid_errors(ts_analyzer, info->pid, &data->errors);
+        ts_analyzer_get_pid_timing(ts_analyzer, info->pid, &data->timing);
+    }
+    return true;
+}
+
+/* Collect the results kept in the analyzer and free it. */
+static void ts_analyze_analyzer_free(TsAnalyzer *ts_analyzer, TsPidStat *stats, PidInfoManager *pmgr)
+{
+    if (ts_analyzer_get_packet_length(ts_analyzer))
+        stats->packet_length = ts_analyzer_get_packet_length(ts_analyzer);
+    stats->duration = ts_analyzer_get_duration(ts_analyzer);
+    if (stats->checks)
+        ts_analyzer_get_errors(ts_analyzer, &stats->errors);
+    if (stats->profile)
+        ts_analyzer_get_stats(ts_analyzer, &stats->analyzer);
+    TsPidCounters counters;
+    if (ts_analyzer_get_counters(ts_analyzer, &counters))
+        stats->packet_count += counters.packets;
+    TsAnalyzeCollect collect = { ts_analyzer, stats };
+    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_collect_pid_data, &collect);
+    ts_analyzer_free(ts_analyzer);
+}
+
+/* Analyze the bytes [start, end) of a regular file. */
+static void ts_analyze_fd_range(int fd, uint64_t start, uint64_t end, TsAnalyzer *ts_analyzer,
+                                TsAnalyzeProgress *progress, TsAnalyzeOptions *options)
+{
+    /* a resumed analyzer is already there, with a partial packet */
+    if (ts_analyzer_get_stream_offset(ts_analyzer) != start)
+        ts_analyzer_set_stream_offset(ts_analyzer, start);
+    if (!options->use_mmap || !ts_analyze_fd_mmap(fd, start, end, ts_analyzer, progress))
+        ts_analyze_fd_pread(fd, start, end, ts_analyzer, progress);
+}
+
+typedef struct {
+    pthread_t thread;
+    bool joinable;
+    int fd;
+    uint64_t start;
+    uint64_t end;
+    TsAnalyzeOptions *options;
+    TsAnalyzeProgress *progress;
+    uint32_t *finished;
+
+    /* results of this chunk */
+    TsPidStat stats;
+    PidInfoManager *pmgr;
+} TsAnalyzeWorker;
 
-    size_t prog_full = st.st_size;
-    size_t prog_current = 0;
+static void *ts_analyze_worker_run(TsAnalyzeWorker *worker)
+{
+    TsAnalyzer *ts_analyzer = ts_analyze_analyzer_new(&worker->stats, worker->pmgr, worker->options);
+
+    ts_analyze_fd_range(worker->fd, worker->start, worker->end, ts_analyzer, worker->progress, worker->options);
+
+    ts_analyze_analyzer_free(ts_analyzer, &worker->stats, worker->pmgr);
+    __atomic_add_fetch(worker->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    /* read from file */
-    while (!feof(f)) {
-        bytes_read = fread(buffer, 1, 8*4096, f);
-        if (bytes_read == 0) {
-            fprintf(stderr, "Error reading buffer.\n");
+/* Find the first packet at or after offset starting a run of count packets, count is TS_SYNC_CONFIRM_COUNT
+ * while the packet length is not known. Returns end if there is none before end. */
+static uint64_t ts_analyze_find_run(int fd, uint64_t offset, uint64_t end, size_t *packet_length, size_t count)
+{
+    uint8_t *probe = malloc(TS_ANALYZE_SYNC_PROBE);
+    ssize_t bytes_read;
+    size_t found;
+    uint64_t result = end;
+
+    while (offset < end) {
+        bytes_read = pread(fd, probe, TS_ANALYZE_SYNC_PROBE, offset);
+        if (bytes_read <= 0)
+            break;
+        if (*packet_length)
+            found = ts_sync_find(probe, bytes_read, *packet_length, count);
+        else
+            found = ts_sync_detect(probe, bytes_read, packet_length);
+        if (found < (size_t)bytes_read) {
+            /* M2TS packets start with the arrival timestamp before the sync byte */
+            result = offset + found;
+            if (result >= ts_sync_get_prefix_length(*packet_length))
+                result -= ts_sync_get_prefix_length(*packet_length);
+            if (result > end)
+                result = end;
             break;
         }
-        if (bytes_read > 0) {
-            ts_analyzer_push_buffer(ts_analyzer, buffer, bytes_read);
+        /* continue with an overlap, so that runs crossing the end of the probe are found */
+        if ((size_t)bytes_read < TS_ANALYZE_SYNC_PROBE)
+            break;
+        offset += TS_ANALYZE_SYNC_PROBE / 2;
+    }
+
+    free(probe);
+    return result;
+}
+
+/* Find the first packet at or after offset. Returns end if there is none before end. */
+static uint64_t ts_analyze_find_packet(int fd, uint64_t offset, uint64_t end, size_t *packet_length)
+{
+    return ts_analyze_find_run(fd, offset, end, packet_length, TS_SYNC_CONFIRM_COUNT);
+}
+
+/* Find a chunk boundary at or after offset: a packet with enough packets before it to confirm sync and
+ * enough after it. Whatever the state of the sequential run at the packets before it, the analyzer of the
+ * chunk ending there is in sync with it at the boundary, and the analyzer of the next chunk starts there. */
+static uint64_t ts_analyze_find_boundary(int fd, uint64_t offset, uint64_t end, size_t packet_length)
+{
+    size_t before = 2 * (TS_SYNC_CONFIRM_COUNT - 1);
+    uint64_t result = ts_analyze_find_run(fd, offset, end, &packet_length, before + TS_SYNC_CONFIRM_COUNT);
+    if (result >= end || end - result <= before * packet_length)
+        return end;
+    return result + before * packet_length;
+}
+
+typedef struct {
+    TsPidStat *stats;
+    PidInfoManager *pmgr;
+    TsPidData *src_pid_data;
+} TsAnalyzeMerge;
+
+/* Merge the PCR statistics of a sampling window into those of the earlier windows,
+ * the average interval and the rates are weighted by the PCRs of each window. */
+static void _ts_analyze_merge_pid_timing(TsPidTiming *merged, const TsPidTiming *timing)
+{
+    if (timing->pcr_count == 0)
+        return;
+    if (merged->pcr_count == 0 || timing->pcr_interval_min < merged->pcr_interval_min)
+        merged->pcr_interval_min = timing->pcr_interval_min;
+    if (timing->pcr_interval_max > merged->pcr_interval_max)
+        merged->pcr_interval_max = timing->pcr_interval_max;
+    if (timing->pcr_jitter_max > merged->pcr_jitter_max)
+        merged->pcr_jitter_max = timing->pcr_jitter_max;
+    uint64_t pcr_count = merged->pcr_count + timing->pcr_count;
+    merged->pcr_interval_avg = (merged->pcr_interval_avg * merged->pcr_count +
+                                timing->pcr_interval_avg * timing->pcr_count) / pcr_count;
+    merged->pcr_bitrate = (uint64_t)(((double)merged->pcr_bitrate * merged->pcr_count +
+                                      (double)timing->pcr_bitrate * timing->pcr_count) / pcr_count + 0.5);
+    merged->bitrate = (uint64_t)(((double)merged->bitrate * merged->pcr_count +
+                                  (double)timing->bitrate * timing->pcr_count) / pcr_count + 0.5);
+    merged->pcr_count = pcr_count;
+}
+
+static void _ts_analyze_merge_analyzer_stats(TsAnalyzerStats *merged, const TsAnalyzerStats *stats)
+{
+    merged->bytes_pushed += stats->bytes_pushed;
+    merged->packets += stats->packets;
+    merged->packets_dispatched += stats->packets_dispatched;
+    merged->bytes_discarded += stats->bytes_discarded;
+    merged->resyncs += stats->resyncs;
+    merged->stitched_packets += stats->stitched_packets;
+    merged->stitched_bytes += stats->stitched_bytes;
+    merged->psi_packets += stats->psi_packets;
+    merged->psi_sections_skipped += stats->psi_sections_skipped;
+    merged->psi_packets_skipped += stats->psi_packets_skipped;
+    merged->callback_failures += stats->callback_failures;
+    merged->cycles_parse += stats->cycles_parse;
+    merged->cycles_psi += stats->cycles_psi;
+    merged->cycles_callback += stats->cycles_callback;
+}
+
+static bool _ts_analyze_merge_pid_info(PidInfo *info, TsAnalyzeMerge *merge)
+{
+    PidInfo *merged = pid_info_manager_add_pid(merge->pmgr, info->pid);
+    if (merged == NULL)
+        return true;
+
+    /* PID types are only known after PAT/PMT were seen in this chunk. */
+    if (info->type != PID_TYPE_PAT)
+        merged->type = info->type;
+    if (info->stream_type)
+        merged->stream_type = info->stream_type;
+    if (info->program)
+        merged->program = info->program;
+
+    merge->stats->pid_data[info->pid].count += merge->src_pid_data[info->pid].count;
+    return true;
+}
+
+/* Split the file into sync-aligned chunks, analyze each chunk in its own thread and merge the results.
+ * Returns false if the file cannot be split. */
+static bool ts_analyze_fd_parallel(int fd, uint64_t size, TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeOptions *options)
+{
+    size_t packet_length = 0;
+    uint64_t first = ts_analyze_find_packet(fd, 0, size, &packet_length);
+    uint64_t chunk_count = options->threads;
+    if (chunk_count > size / TS_ANALYZE_MIN_CHUNK)
+        chunk_count = size / TS_ANALYZE_MIN_CHUNK;
+    if (first >= size || chunk_count < 2)
+        return false;
+
+    TsAnalyzeWorker *workers = calloc(chunk_count, sizeof(TsAnalyzeWorker));
+    TsAnalyzeProgress progress = { .full = size };
+    TsAnalyzeMerge merge = { .stats = stats, .pmgr = pmgr };
+    uint32_t finished = 0;
+    uint64_t j;
+
+    /* The analyzer drops everything before the first packet, start the first chunk at 0 as well. */
+    for (j = 0; j < chunk_count; ++j) {
+        workers[j].start = j == 0 ? 0 : workers[j - 1].end;
+        workers[j].end = j + 1 == chunk_count ? size :
+            ts_analyze_find_boundary(fd, first + (size - first) / chunk_count * (j + 1), size, packet_length);
+        if (workers[j].end < workers[j].start)
+            workers[j].end = workers[j].start;
+    }
+
+    for (j = 0; j < chunk_count; ++j) {
+        workers[j].fd = fd;
+        workers[j].options = options;
+        workers[j].progress = &progress;
+        workers[j].finished = &finished;
+        workers[j].pmgr = pid_info_manager_new();
+        workers[j].stats.client_id = pid_info_manager_register_client_records(workers[j].pmgr, sizeof(TsPidData));
+        workers[j].stats.pid_data = pid_info_manager_get_client_records(workers[j].pmgr, workers[j].stats.client_id);
+        workers[j].stats.profile = stats->profile;
+        if (pthread_create(&workers[j].thread, NULL, (void *(*)(void *))ts_analyze_worker_run, &workers[j]) == 0)
+            workers[j].joinable = true;
+        else /* analyze this chunk in the main thread */
+            ts_analyze_worker_run(&workers[j]);
+    }
+
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < chunk_count) {
+        fprintf(stderr, "\rProgress: %6.2f%%",
+                ((double)__atomic_load_n(&progress.done, __ATOMIC_RELAXED))/((double)size)*100.0f);
+        usleep(100000);
+    }
+
+    for (j = 0; j < chunk_count; ++j) {
+        if (workers[j].joinable)
+            pthread_join(workers[j].thread, NULL);
+        /* merge in stream order, so that the pid order and types match a sequential run */
+        merge.src_pid_data = workers[j].stats.pid_data;
+        pid_info_manager_enumerate_pid_infos(workers[j].pmgr, (PidInfoEnumFunc)_ts_analyze_merge_pid_info, &merge);
+        stats->packet_count += workers[j].stats.packet_count;
+        if (workers[j].stats.packet_length)
+            stats->packet_length = workers[j].stats.packet_length;
+        _ts_analyze_merge_analyzer_stats(&stats->analyzer, &workers[j].stats.analyzer);
+        pid_info_manager_free(workers[j].pmgr);
+    }
+
+    free(workers);
+    return true;
+}
+
+typedef struct {
+    TsAnalyzer *ts_analyzer;
+    TsPidStat *stats;
+    uint64_t packets; /* packets in the window */
+    uint64_t pcr_count; /* PCRs of the pid the transport rate is taken from */
+    uint64_t rate;
+} TsAnalyzeSample;
+
+/* Add the share of a pid in the window just analyzed and merge its PCR statistics. */
+static bool _ts_analyze_sample_pid(PidInfo *info, TsAnalyzeSample *sample)
+{
+    TsPidData *data = &sample->stats->pid_data[info->pid];
+    TsPidCounters counters;
+    TsPidErrorCounters errors;
+    TsPidTiming timing;
+    ts_analyzer_get_pid_counters(sample->ts_analyzer, info->pid, &counters);
+    data->count += counters.packets;
+    if (data->count == 0)
+        return true;
+    double share = (double)counters.packets / (double)sample->packets;
+    data->share_sum += share;
+    data->share_square_sum += share * share;
+
+    if (sample->stats->checks && ts_analyzer_get_pid_errors(sample->ts_analyzer, info->pid, &errors)) {
+        data->errors.cc_errors += errors.cc_errors;
+        data->errors.transport_errors += errors.transport_errors;
+    }
+    if (sample->stats->timing && ts_analyzer_get_pid_timing(sample->ts_analyzer, info->pid, &timing)) {
+        /* the transport rate measured between PCRs is not biased by the packets before the first PCR */
+        if (timing.pcr_bitrate && timing.pcr_count > sample->pcr_count) {
+            sample->pcr_count = timing.pcr_count;
+            sample->rate = timing.pcr_bitrate;
+        }
+        _ts_analyze_merge_pid_timing(&data->timing, &timing);
+    }
+    return true;
+}
+
+/* Extrapolate the counts from the shares of the pids in the windows. */
+static bool _ts_analyze_sample_estimate(PidInfo *info, TsPidStat *stats)
+{
+    TsPidData *data = &stats->pid_data[info->pid];
+    if (data->count == 0)
+        return true;
+    double windows = (double)stats->sample_windows;
+    double share = data->share_sum / windows;
+    double variance = 0.0;
+    if (stats->sample_windows > 1)
+        variance = (data->share_square_sum - windows * share * share) / (windows - 1.0);
+    /* the windows cover part of the file, finite population correction */
+    double unread = 1.0 - (double)stats->sample_bytes / (double)stats->file_size;
+    data->count = (uint64_t)(share * stats->packet_count + 0.5);
+    data->margin = variance > 0.0 && unread > 0.0 ? TS_ANALYZE_SAMPLE_Z * sqrt(variance / windows * unread) : 0.0;
+    return true;
+}
+
+/* Analyze windows spread evenly over the file, each with a new analyzer that synchronizes at its start.
+ * Returns false if the windows would cover the whole file. */
+static bool ts_analyze_fd_sample(int fd, uint64_t size, TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeOptions *options)
+{
+    uint64_t budget = (uint64_t)(size * options->sample_percent / 100.0);
+    uint64_t window = TS_ANALYZE_SAMPLE_WINDOW;
+    if (budget < TS_ANALYZE_SAMPLE_MIN_WINDOWS * window)
+        window = budget / TS_ANALYZE_SAMPLE_MIN_WINDOWS;
+    if (window < TS_ANALYZE_SAMPLE_MIN_WINDOW)
+        window = TS_ANALYZE_SAMPLE_MIN_WINDOW;
+    /* a single window of the minimum size if even that is more than requested */
+    uint64_t windows = budget / window ? budget / window : 1;
+    if (windows * window >= size)
+        return false;
+    uint64_t stride = size / windows;
+    size_t packet_length = 0;
+    uint64_t timed_packets = 0;
+    double timed_duration = 0.0;
+    TsAnalyzerStats analyzer_stats;
+    uint64_t start;
+    uint64_t end;
+    uint64_t j;
+
+    TsAnalyzeProgress progress = {
+        .full = windows * window,
+        .stats = stats,
+    };
+    memset(&analyzer_stats, 0, sizeof(TsAnalyzerStats));
 
-            prog_current += bytes_read;
+    for (j = 0; j < windows; ++j) {
+        end = j * stride + window;
+        start = ts_analyze_find_packet(fd, j * stride, end, &packet_length);
+        if (start >= end)
+            continue;
+
+        TsAnalyzer *ts_analyzer = ts_analyze_analyzer_new(stats, pmgr, options);
+        TsAnalyzeSample sample = {
+            .ts_analyzer = ts_analyzer,
+            .stats = stats,
+        };
+        TsPidCounters counters;
+        progress.ts_analyzer = ts_analyzer;
+        ts_analyze_fd_range(fd, start, end, ts_analyzer, &progress, options);
+        ts_analyzer_get_counters(ts_analyzer, &counters);
+        sample.packets = counters.packets;
+        stats->packet_count += sample.packets;
+        stats->sample_bytes += end - start;
+        if (sample.packets) {
+            ++stats->sample_windows;
+            pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_sample_pid, &sample);
         }
-        fprintf(stderr, "\rProgress: %6.2f%% [%" PRIu64 " packets]",
-                ((double)prog_current)/((double)prog_full)*100.0f,
-                stats->packet_count);
+        if (sample.rate) {
+            timed_packets += sample.packets;
+            timed_duration += (double)sample.packets * 188 * 8 * 27000000.0 / (double)sample.rate;
+        }
+        if (ts_analyzer_get_packet_length(ts_analyzer))
+            stats->packet_length = ts_analyzer_get_packet_length(ts_analyzer);
+        if (stats->checks) {
+            TsErrorCounters errors;
+            ts_analyzer_get_errors(ts_analyzer, &errors);
+            ts_analyze_add_errors(&stats->errors, &errors);
+        }
+        if (stats->profile) {
+            ts_analyzer_get_stats(ts_analyzer, &stats->analyzer);
+            _ts_analyze_merge_analyzer_stats(&analyzer_stats, &stats->analyzer);
+        }
+        ts_analyzer_free(ts_analyzer);
+    }
+
+    stats->analyzer = analyzer_stats;
+    stats->sampled = true;
+    stats->file_size = size;
+    if (stats->sample_windows == 0)
+        return true;
+    /* garbage in the windows is assumed to be spread like in the rest of the file */
+    uint64_t sampled_packets = stats->packet_count;
+    stats->packet_count = (uint64_t)((double)sampled_packets * size / stats->sample_bytes + 0.5);
+    if (timed_packets)
+        stats->duration = (uint64_t)(timed_duration * stats->packet_count / timed_packets);
+    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_sample_estimate, stats);
+    return true;
+}
+
+static volatile sig_atomic_t ts_analyze_stop = 0;
+
+static void ts_analyze_handle_signal(int signal)
+{
+    ts_analyze_stop = 1;
+}
+
+/* Receive from udp:// or rtp:// until interrupted or options->seconds passed. */
+static void ts_analyze_udp(const char *url, TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeOptions *options)
+{
+    TsUdpReceiver *receiver = ts_udp_receiver_new_from_url(url, options->interface);
+    if (receiver == NULL) {
+        perror("Could not open network input");
+        return;
+    }
+
+    /* SIGINT ends the capture, interrupting poll() */
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = ts_analyze_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    TsAnalyzer *ts_analyzer = ts_analyze_analyzer_new(stats, pmgr, options);
+    TsAnalyzeProgress progress = {
+        .stats = stats,
+        .ts_analyzer = ts_analyzer,
+    };
+    TsAnalyzePipeline pipeline;
+    bool pipelined = options->pipeline &&
+        ts_analyze_pipeline_start(&pipeline, ts_analyzer, &progress, options, TS_ANALYZE_UDP_SLAB, true);
+    struct timespec start;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count;
+
+    while (!ts_analyze_stop) {
+        if (options->seconds) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec - start.tv_sec >= (time_t)options->seconds)
+                break;
+        }
+        if (pipelined)
+            count = ts_udp_receiver_receive(receiver, 100, (TsUdpPushFunc)ts_analyze_pipeline_write, &pipeline);
+        else
+            count = ts_udp_receiver_receive(receiver, 100, (TsUdpPushFunc)ts_analyzer_push_buffer, ts_analyzer);
+        if (count < 0) {
+            perror("Error receiving");
+            break;
+        }
+        if (count > 0 && pipelined)
+            ts_analyze_pipeline_flush(&pipeline);
+        else if (count > 0)
+            ts_analyze_progress_add(&progress, 0);
     }
 
+    if (pipelined)
+        ts_analyze_pipeline_finish(&pipeline, stats);
+    stats->network = true;
+    ts_udp_receiver_get_stats(receiver, &stats->udp);
+    ts_analyze_analyzer_free(ts_analyzer, stats, pmgr);
+    ts_udp_receiver_free(receiver);
     fputs("                  \r", stderr);
+}
 
-    ts_analyzer_free(ts_analyzer);
-    fclose(f);
+#define TS_ANALYZE_CHECKPOINT_MAGIC 0x43415354 /* "TSAC" */
+
+/* Save the pid info manager and the analyzer with its packet counters, replacing the checkpoint atomically.
+ * The rest of TsPidStat is collected from the analyzer. */
+static void ts_analyze_save_checkpoint(const char *filename, TsAnalyzer *ts_analyzer, PidInfoManager *pmgr)
+{
+    char *temporary = malloc(strlen(filename) + 5);
+    sprintf(temporary, "%s.tmp", filename);
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        perror("Could not save checkpoint");
+        free(temporary);
+        return;
+    }
+    uint32_t magic = TS_ANALYZE_CHECKPOINT_MAGIC;
+    bool result = fwrite(&magic, sizeof(magic), 1, file) == 1 && pid_info_manager_save(pmgr, file) &&
+                  ts_analyzer_save_checkpoint(ts_analyzer, file);
+    if (fclose(file) != 0)
+        result = false;
+    if (!result || rename(temporary, filename) != 0) {
+        perror("Could not save checkpoint");
+        unlink(temporary);
+    }
+    free(temporary);
+}
+
+/* Resume from the checkpoint of an earlier run of the growing file.
+ * Returns the offset to continue at, 0 if there is no checkpoint yet. Exits on an invalid checkpoint. */
+static uint64_t ts_analyze_load_checkpoint(const char *filename, TsAnalyzer *ts_analyzer, PidInfoManager *pmgr,
+                                           uint64_t size)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        perror("Could not open checkpoint");
+        exit(1);
+    }
+    uint32_t magic;
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != TS_ANALYZE_CHECKPOINT_MAGIC ||
+            !pid_info_manager_load(pmgr, file) || !ts_analyzer_load_checkpoint(ts_analyzer, file)) {
+        fprintf(stderr, "%s is no valid checkpoint of a run with the same -e and -t options.\n", filename);
+        exit(1);
+    }
+    fclose(file);
+
+    if (ts_analyzer_get_stream_offset(ts_analyzer) > size) {
+        fprintf(stderr, "The file is shorter than at the checkpoint %s.\n", filename);
+        exit(1);
+    }
+    return ts_analyzer_get_stream_offset(ts_analyzer);
+}
+
+void ts_analyze_file(const char *filename, TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeOptions *options)
+{
+    int fd;
+    struct stat st;
+
+    if (ts_udp_is_url(filename)) {
+        ts_analyze_udp(filename, stats, pmgr, options);
+        return;
+    }
+
+    if (strcmp(filename, "-") == 0)
+        fd = STDIN_FILENO;
+    else if ((fd = open(filename, O_RDONLY)) < 0) {
+        perror("Could not open file");
+        return;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("Could not stat file");
+        goto out;
+    }
+
+    if (options->checkpoint_file && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Checkpoints need a regular file.\n");
+        goto out;
+    }
+
+    if (S_ISREG(st.st_mode) && options->sample_percent > 0.0 && !options->index_file && !options->checkpoint_file &&
+            !options->filter_file && ts_analyze_fd_sample(fd, st.st_size, stats, pmgr, options))
+        goto done;
+
+    /* the SI tables are decoded, the index and the selected pids are written and checkpoints and
+     * snapshots are taken in stream order by a single analyzer, the checks follow the continuity counters and PAT/PMT
+     * timeouts and the timing the PCRs across the whole stream */
+    if (S_ISREG(st.st_mode) && options->threads > 1 && !options->si && !options->index_file &&
+            !options->checkpoint_file && !options->filter_file && !options->checks && !options->timing &&
+            options->interval == 0 && ts_analyze_fd_parallel(fd, st.st_size, stats, pmgr, options))
+        goto done;
+
+    TsAnalyzer *ts_analyzer = ts_analyze_analyzer_new(stats, pmgr, options);
+
+    uint64_t start = 0;
+    if (options->checkpoint_file)
+        start = ts_analyze_load_checkpoint(options->checkpoint_file, ts_analyzer, pmgr, st.st_size);
+
+    TsAnalyzeProgress progress = {
+        .done = start,
+        .full = S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0,
+        .stats = stats,
+        .ts_analyzer = ts_analyzer,
+    };
+
+    TsAnalyzePipeline pipeline;
+
+    if (start && lseek(fd, start, SEEK_SET) < 0)
+        perror("Could not seek");
+
+    /* pipes and devices can neither be mapped nor read at an offset, use read() */
+    if (S_ISREG(st.st_mode) && options->use_mmap)
+        ts_analyze_fd_range(fd, start, st.st_size, ts_analyzer, &progress, options);
+    else if (options->pipeline &&
+             ts_analyze_pipeline_start(&pipeline, ts_analyzer, &progress, options, TS_ANALYZE_FILE_SLAB, false)) {
+        ts_analyze_pipeline_read(&pipeline, fd);
+        ts_analyze_pipeline_finish(&pipeline, stats);
+    }
+    else
+        ts_analyze_fd_read(fd, ts_analyzer, &progress);
+
+    if (options->checkpoint_file)
+        ts_analyze_save_checkpoint(options->checkpoint_file, ts_analyzer, pmgr);
+
+    ts_analyze_analyzer_free(ts_analyzer, stats, pmgr);
+done:
+    fputs("                  \r", stderr);
+out:
+    if (fd != STDIN_FILENO)
+        close(fd);
 }
 
 char *format_size(size_t size)
@@ -122,53 +1251,575 @@ char *format_size(size_t size)
     return buffer;
 }
 
-static bool _ts_analyze_print_pid_info(PidInfo *info, TsPidStat *stats)
+char *format_bitrate(uint64_t bitrate)
 {
-    if (!stats)
-        return false;
-    TsPidData *data = pid_info_get_private_data(info, stats->client_id);
-    if (!data)
+    double drate = (double)bitrate;
+    char suffix[] = {
+        ' ',
+        'k',
+        'M',
+        'G',
+        0
+    };
+    size_t j;
+    for (j = 0; suffix[j + 1] != 0 && drate >= 1000.0; ++j) {
+        drate /= 1000.0;
+    }
+    char *buffer = malloc(64);
+    snprintf(buffer, 64, "%.2f %cbit/s", drate, suffix[j]);
+    return buffer;
+}
+
+static size_t ts_analyze_packet_length(TsPidStat *stats)
+{
+    return stats->packet_length ? stats->packet_length : 188;
+}
+
+/* Average bitrate of count packets over the whole stream, bitrates do not include the M2TS prefix. */
+static uint64_t ts_analyze_average_bitrate(TsPidStat *stats, uint64_t count)
+{
+    if (stats->duration == 0)
+        return 0;
+    return (uint64_t)((double)count * 188 * 8 * 27000000.0 / (double)stats->duration);
+}
+
+static bool _ts_analyze_fill_final_pid(PidInfo *info, TsAnalyzeSnapshotFill *fill)
+{
+    TsPidStat *stats = fill->stats;
+    TsPidData *data = &stats->pid_data[info->pid];
+    TsAnalyzeSnapshotPid *pid = &fill->snapshot->pids[fill->snapshot->pid_count];
+    if (data->count == 0)
         return true;
-    char *size_str = format_size(188 * data->count);
-    fprintf(stdout, " %4u | %10" PRIu64 " | %6.2f%% | %10s | %14s\n", info->pid,
-            data->count, ((double)data->count)/((double)stats->packet_count)*100.0f,
-            size_str, pid_names[info->type]);
+    memset(pid, 0, sizeof(TsAnalyzeSnapshotPid));
+    pid->pid = info->pid;
+    pid->type = info->type;
+    pid->count = data->count;
+    pid->cc_errors = data->errors.cc_errors;
+    pid->transport_errors = data->errors.transport_errors;
+    if (stats->timing) {
+        pid->bitrate = ts_analyze_average_bitrate(stats, data->count);
+        ts_analyze_set_snapshot_pcr(pid, &data->timing);
+    }
+    pid->margin = data->margin;
+    ++fill->snapshot->pid_count;
+    return true;
+}
+
+/* Get the final results as a snapshot, sorted if stats->descending. Free it with free(). */
+static TsAnalyzeSnapshot *ts_analyze_final_snapshot(TsPidStat *stats, PidInfoManager *pmgr)
+{
+    TsAnalyzeSnapshot *snapshot = calloc(1, sizeof(TsAnalyzeSnapshot));
+    TsAnalyzeSnapshotFill fill = { NULL, stats, snapshot };
+    snapshot->time = ts_analyze_now() - stats->start;
+    snapshot->final = true;
+    snapshot->packet_count = stats->packet_count;
+    if (stats->timing)
+        snapshot->bitrate = ts_analyze_average_bitrate(stats, stats->packet_count);
+    snapshot->duration = stats->duration;
+    snapshot->errors = stats->errors;
+    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_fill_final_pid, &fill);
+    if (stats->descending)
+        ts_analyze_sort_snapshot(snapshot);
+    return snapshot;
+}
+
+static void ts_analyze_print_pid_info(TsAnalyzeSnapshotPid *pid, TsPidStat *stats)
+{
+    char *size_str = format_size(ts_analyze_packet_length(stats) * pid->count);
+    fprintf(stdout, " %4u | %10" PRIu64 " | %6.2f%% | %10s | %14s", pid->pid,
+            pid->count, ((double)pid->count)/((double)stats->packet_count)*100.0f,
+            size_str, pid_names[pid->type]);
     free(size_str);
+    if (stats->timing) {
+        char *rate_str = format_bitrate(pid->bitrate);
+        fprintf(stdout, " | %12s", rate_str);
+        free(rate_str);
+    }
+    if (stats->sampled)
+        fprintf(stdout, " | %6.2f%%", stats->pid_data[pid->pid].margin * 100.0);
+    fprintf(stdout, "\n");
+}
+
+static bool _ts_analyze_print_pid_errors(PidInfo *info, TsPidStat *stats)
+{
+    TsPidData *data = &stats->pid_data[info->pid];
+    if ((data->errors.cc_errors == 0 && data->errors.transport_errors == 0))
+        return true;
+    fprintf(stdout, " %4u | %10" PRIu32 " | %10" PRIu32 "\n", info->pid,
+            data->errors.cc_errors, data->errors.transport_errors);
     return true;
 }
 
-void ts_analyze_print(TsPidStat *stats, PidInfoManager *pmgr)
+void ts_analyze_print_errors(TsPidStat *stats, PidInfoManager *pmgr)
+{
+    fprintf(stdout, "\n"
+                    "  PID |  cc errors |  tr errors\n"
+                    "=================================\n");
+
+    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_print_pid_errors, stats);
+
+    fprintf(stdout, "=================================\n"
+                    "total | %10" PRIu64 " | %10" PRIu64 "\n\n",
+                    stats->errors.cc_errors, stats->errors.transport_errors);
+
+    fprintf(stdout, "TS_sync_loss:          %10" PRIu64 "\n"
+                    "Sync_byte_error:       %10" PRIu64 "\n"
+                    "PAT_error:             %10" PRIu64 "\n"
+                    "Continuity_count_error:%10" PRIu64 "\n"
+                    "PMT_error:             %10" PRIu64 "\n"
+                    "Transport_error:       %10" PRIu64 "\n",
+                    stats->errors.sync_loss, stats->errors.sync_byte_errors,
+                    stats->errors.pat_errors, stats->errors.cc_errors,
+                    stats->errors.pmt_errors, stats->errors.transport_errors);
+}
+
+static bool _ts_analyze_print_pid_pcr(PidInfo *info, TsPidStat *stats)
+{
+    TsPidData *data = &stats->pid_data[info->pid];
+    if (data->timing.pcr_count == 0)
+        return true;
+    char *rate_str = format_bitrate(data->timing.pcr_bitrate);
+    /* intervals in ms, jitter in µs */
+    fprintf(stdout, " %4u | %10" PRIu64 " | %7.2f | %7.2f | %7.2f | %8.1f | %12s\n", info->pid,
+            data->timing.pcr_count,
+            data->timing.pcr_interval_min / 27000.0, data->timing.pcr_interval_avg / 27000.0,
+            data->timing.pcr_interval_max / 27000.0, data->timing.pcr_jitter_max / 27.0,
+            rate_str);
+    free(rate_str);
+    return true;
+}
+
+void ts_analyze_print_timing(TsPidStat *stats, PidInfoManager *pmgr)
+{
+    fprintf(stdout, "\n"
+                    "  PID |   PCRs     | min. ms | avg. ms | max. ms | jitter µs |    PCR rate\n"
+                    "==========================================================================\n");
+
+    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_print_pid_pcr, stats);
+
+    fprintf(stdout, "==========================================================================\n"
+                    "duration: %.3f s\n", stats->duration / 27000000.0);
+}
+
+void ts_analyze_print_network(TsPidStat *stats)
+{
+    fprintf(stdout, "\n"
+                    "Datagrams:             %10" PRIu64 "\n"
+                    "RTP datagrams:         %10" PRIu64 "\n"
+                    "Lost datagrams:        %10" PRIu64 "\n"
+                    "Reordered datagrams:   %10" PRIu64 "\n"
+                    "Duplicate datagrams:   %10" PRIu64 "\n"
+                    "Truncated datagrams:   %10" PRIu64 "\n"
+                    "Datagrams per receive: %10.1f\n",
+                    stats->udp.datagrams, stats->udp.rtp_datagrams, stats->udp.lost,
+                    stats->udp.reordered, stats->udp.duplicates, stats->udp.truncated,
+                    stats->udp.batches ? (double)stats->udp.datagrams / stats->udp.batches : 0.0);
+}
+
+void ts_analyze_print_pipeline(TsPidStat *stats)
+{
+    fprintf(stdout, "\n"
+                    "Ring slabs:            %10zu\n"
+                    "Ring high water mark:  %10zu\n"
+                    "Ring overruns:         %10" PRIu64 "\n"
+                    "Bytes dropped:         %10" PRIu64 "\n",
+                    stats->ring.slab_count, stats->ring.high_water_mark,
+                    stats->ring.overruns, stats->ring_dropped);
+}
+
+void ts_analyze_print_filter(TsPidStat *stats)
+{
+    TsFilterStats filter;
+    ts_filter_get_stats(stats->filter, &filter);
+    fprintf(stdout, "\n"
+                    "Packets written:       %10" PRIu64 "\n"
+                    "Bytes written:         %10" PRIu64 "\n"
+                    "Writes:                %10" PRIu64 "\n"
+                    "Packets copied:        %10" PRIu64 "\n"
+                    "PAT rewritten:         %10" PRIu64 "\n"
+                    "PAT dropped:           %10" PRIu64 "\n",
+                    filter.packets, filter.bytes, filter.writes, filter.copied,
+                    filter.pat_rewritten, filter.pat_dropped);
+}
+
+void ts_analyze_print_analyzer(TsPidStat *stats)
+{
+    const TsAnalyzerStats *a = &stats->analyzer;
+    uint64_t cycles = a->cycles_parse + a->cycles_psi + a->cycles_callback;
+    double packets = a->packets ? (double)a->packets : 1.0;
+    double total = cycles ? (double)cycles : 1.0;
+    fprintf(stdout, "\n"
+                    "Bytes pushed:          %10" PRIu64 "\n"
+                    "Packets:               %10" PRIu64 "\n"
+                    "Packets dispatched:    %10" PRIu64 "\n"
+                    "Bytes discarded:       %10" PRIu64 "\n"
+                    "Resyncs:               %10" PRIu64 "\n"
+                    "Stitched packets:      %10" PRIu64 "\n"
+                    "Stitched bytes:        %10" PRIu64 "\n"
+                    "PSI packets:           %10" PRIu64 "\n"
+                    "PSI sections skipped:  %10" PRIu64 "\n"
+                    "PSI packets skipped:   %10" PRIu64 "\n"
+                    "Callback failures:     %10" PRIu64 "\n"
+                    "\n"
+                    "         | cycles/packet |   share\n"
+                    "=====================================\n"
+                    "parse    | %13.1f | %6.2f%%\n"
+                    "PSI      | %13.1f | %6.2f%%\n"
+                    "callback | %13.1f | %6.2f%%\n"
+                    "=====================================\n"
+                    "total    | %13.1f |\n",
+                    a->bytes_pushed, a->packets, a->packets_dispatched, a->bytes_discarded, a->resyncs,
+                    a->stitched_packets, a->stitched_bytes, a->psi_packets, a->psi_sections_skipped,
+                    a->psi_packets_skipped, a->callback_failures,
+                    a->cycles_parse / packets, a->cycles_parse / total * 100.0,
+                    a->cycles_psi / packets, a->cycles_psi / total * 100.0,
+                    a->cycles_callback / packets, a->cycles_callback / total * 100.0,
+                    cycles / packets);
+}
+
+static void ts_analyze_print_event(const char *label, const TsSiEvent *event)
+{
+    char start[32] = "";
+    time_t t = (time_t)event->start_time;
+    struct tm tm;
+    if (event->start_time >= 0 && gmtime_r(&t, &tm))
+        strftime(start, sizeof(start), "%Y-%m-%d %H:%M", &tm);
+    fprintf(stdout, "      %-5s %16s %4" PRIu32 " min  %s\n", label, start, event->duration / 60, event->name);
+}
+
+static bool _ts_analyze_count_event(const TsSiEvent *event, size_t *count)
+{
+    ++*count;
+    return true;
+}
+
+static bool _ts_analyze_print_service(const TsSiService *service, TsSi *si)
+{
+    const TsSiEvent *present, *following;
+    size_t events = 0;
+    ts_si_enumerate_events(si, service, (TsSiEventEnumFunc)_ts_analyze_count_event, &events);
+    fprintf(stdout, " %5u | %5u | %5u | %4u | %6zu | %s%s%s\n", service->original_network_id,
+            service->transport_stream_id, service->service_id, service->service_type, events,
+            service->provider_name, service->provider_name[0] ? " / " : "", service->name);
+    if (ts_si_get_present_following(si, service, &present, &following)) {
+        if (present)
+            ts_analyze_print_event("now:", present);
+        if (following)
+            ts_analyze_print_event("next:", following);
+    }
+    return true;
+}
+
+static bool _ts_analyze_print_network(const TsSiNetwork *network, void *userdata)
+{
+    fprintf(stdout, "Network %u%s: %s\n", network->network_id, network->actual ? " (actual)" : "", network->name);
+    return true;
+}
+
+void ts_analyze_print_si(TsPidStat *stats)
+{
+    TsSiStats si_stats;
+    ts_si_get_stats(stats->si, &si_stats);
+
+    fprintf(stdout, "\n");
+    ts_si_enumerate_networks(stats->si, _ts_analyze_print_network, NULL);
+    fprintf(stdout, "\n"
+                    "  ONID |  TSID |   SID | type | events | provider / name\n"
+                    "=================================================================\n");
+    ts_si_enumerate_services(stats->si, (TsSiServiceEnumFunc)_ts_analyze_print_service, stats->si);
+    fprintf(stdout, "=================================================================\n"
+                    "SI sections:           %10" PRIu64 "\n"
+                    "SI sections parsed:    %10" PRIu64 "\n"
+                    "SI sections repeated:  %10" PRIu64 "\n"
+                    "SI CRC errors:         %10" PRIu64 "\n"
+                    "SI discontinuities:    %10" PRIu64 "\n",
+                    si_stats.sections, si_stats.sections_parsed, si_stats.sections_repeated,
+                    si_stats.crc_errors, si_stats.discontinuities);
+}
+
+/* Write the final results in a machine-readable format, encoded like the snapshots. */
+void ts_analyze_print_snapshot(TsPidStat *stats, PidInfoManager *pmgr, TsAnalyzeFormat format)
 {
-    /* TODO stort descending */
+    TsAnalyzeSnapshot *snapshot = ts_analyze_final_snapshot(stats, pmgr);
+    ts_analyze_write_snapshot(stdout, snapshot, format, false);
+    free(snapshot);
+}
 
-    fprintf(stdout, "  PID |      count |    rel. |       size |           type \n"
-                    "===========================================================\n");
+void ts_analyze_print(TsPidStat *stats, PidInfoManager *pmgr)
+{
+    TsAnalyzeSnapshot *snapshot = ts_analyze_final_snapshot(stats, pmgr);
+    size_t j;
+    const char *rule = stats->timing ? "==========================================================================" :
+                                       "===========================================================";
+    if (stats->sampled)
+        fprintf(stdout, "Sampled %.2f%% of the file in %" PRIu64 " windows. Counts are estimates, ± is the\n"
+                        "95%% confidence interval of rel.; errors are those found in the windows.\n",
+                stats->sample_bytes * 100.0 / stats->file_size, stats->sample_windows);
+    fprintf(stdout, "  PID |      count |    rel. |       size |           type%s%s\n%s%s\n",
+            stats->timing ? " |     avg. rate" : stats->sampled ? "" : " ", stats->sampled ? " |       ±" : "",
+            rule, stats->sampled ? "==========" : "");
 
-    pid_info_manager_enumerate_pid_infos(pmgr, (PidInfoEnumFunc)_ts_analyze_print_pid_info, stats);
+    for (j = 0; j < snapshot->pid_count; ++j)
+        ts_analyze_print_pid_info(&snapshot->pids[j], stats);
+    free(snapshot);
 
-    fprintf(stdout, "===========================================================\n");
+    fprintf(stdout, "%s%s\n", rule, stats->sampled ? "==========" : "");
 
-    char *size_str = format_size(188 * stats->packet_count);
-    fprintf(stdout, "total | %10" PRIu64 " | 100.00%% | %10s | \n",
+    char *size_str = format_size(ts_analyze_packet_length(stats) * stats->packet_count);
+    fprintf(stdout, "total | %10" PRIu64 " | 100.00%% | %10s | ",
             stats->packet_count, size_str);
     free(size_str);
+    if (stats->timing) {
+        char *rate_str = format_bitrate(ts_analyze_average_bitrate(stats, stats->packet_count));
+        fprintf(stdout, "               | %12s", rate_str);
+        free(rate_str);
+    }
+    fprintf(stdout, "\n");
+
+    if (stats->timing)
+        ts_analyze_print_timing(stats, pmgr);
+
+    if (stats->checks)
+        ts_analyze_print_errors(stats, pmgr);
+
+    if (stats->network)
+        ts_analyze_print_network(stats);
+
+    if (stats->pipeline)
+        ts_analyze_print_pipeline(stats);
+
+    if (stats->si)
+        ts_analyze_print_si(stats);
+
+    if (stats->filter)
+        ts_analyze_print_filter(stats);
+
+    if (stats->profile)
+        ts_analyze_print_analyzer(stats);
+}
+
+/* Add the comma separated numbers of list up to max to the filter. */
+static bool ts_analyze_filter_add(TsFilter *filter, const char *list, unsigned long max,
+                                  void (*add)(TsFilter *, uint16_t))
+{
+    char *end;
+    unsigned long value;
+    while (list && *list) {
+        value = strtoul(list, &end, 0);
+        if (end == list || value > max || (*end != ',' && *end != 0))
+            return false;
+        add(filter, value);
+        list = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+/* Open the output and set up the filter, exits on errors. */
+static void ts_analyze_filter_new(TsPidStat *stats, TsAnalyzeOptions *options)
+{
+    /* a resumed analysis continues the output */
+    int flags = O_WRONLY | O_CREAT | (options->checkpoint_file ? O_APPEND : O_TRUNC);
+    int fd = open(options->filter_file, flags, 0644);
+    if (fd < 0) {
+        perror("Could not open output");
+        exit(1);
+    }
+    /* a closed pipe fails the write instead of killing us */
+    signal(SIGPIPE, SIG_IGN);
+
+    TsFilter *filter = ts_filter_new(fd);
+    if (!ts_analyze_filter_add(filter, options->filter_pids, 0x1fff, ts_filter_add_pid) ||
+            !ts_analyze_filter_add(filter, options->filter_programs, 0xffff, ts_filter_add_program)) {
+        fprintf(stderr, "Invalid pid or program list.\n");
+        exit(1);
+    }
+    ts_filter_enable_pat_rewrite(filter, options->filter_pat);
+    stats->filter = filter;
+    stats->filter_fd = fd;
+}
+
+static void ts_analyze_filter_free(TsPidStat *stats)
+{
+    if (stats->filter == NULL)
+        return;
+    TsFilterStats filter;
+    ts_filter_get_stats(stats->filter, &filter);
+    if (filter.write_errors)
+        fprintf(stderr, "Could not write all selected packets, the analysis stopped early.\n");
+    close(stats->filter_fd);
+    ts_filter_free(stats->filter);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-m] [-e] [-t] [-j threads] [-I interface] [-d seconds] [-p] [-b MiB] [-s] [-S]\n"
+                    "       [-x index] [-c checkpoint] [-f percent] [-o format] [-i seconds] [-r]\n"
+                    "       [-w output [-k pids] [-P programs] [-R]] <file|url>\n"
+                    "  -m  Map the file into memory instead of reading it.\n"
+                    "  -e  Check for continuity counter, transport, sync and PAT/PMT errors. The file is\n"
+                    "      not analyzed in parallel.\n"
+                    "  -t  Measure bitrates and PCR intervals/jitter. The file is not analyzed in parallel.\n"
+                    "  -j  Analyze the file in parallel with the given number of threads (0: one per cpu).\n"
+                    "  -I  Join multicast groups on this interface.\n"
+                    "  -d  Stop receiving from the network after this many seconds.\n"
+                    "  -p  Read and analyze in separate threads, buffering the input in a ring.\n"
+                    "  -b  Size of the ring in MiB (default 64). Network input is dropped when it is full.\n"
+                    "  -s  Print internal counters of the analyzer and where the time is spent.\n"
+                    "  -S  Decode the SDT, EIT and NIT and print the services with their present and\n"
+                    "      following events. The file is not analyzed in parallel.\n"
+                    "  -x  Write a seek index of the PAT/PMT versions, pid runs, PCR samples and random\n"
+                    "      access points to this file. The file is not analyzed in parallel.\n"
+                    "  -c  Resume the analysis of a growing file from this checkpoint, if it exists, and\n"
+                    "      save a new one at the end. The file is not analyzed in parallel.\n"
+                    "  -f  Read only this percentage of a large file, in windows spread over it, and\n"
+                    "      estimate the counts and rates with error bounds. At least one window of\n"
+                    "      256 KiB is read.\n"
+                    "  -o  Write the results as text (default), json or csv.\n"
+                    "  -i  Write a snapshot of the counts, rates and errors at this interval while\n"
+                    "      analyzing, as json unless -o csv is given. The file is not analyzed in\n"
+                    "      parallel.\n"
+                    "  -r  List the pids by descending packet count.\n"
+                    "  -w  Write the packets of the selected pids and programs to this file or pipe,\n"
+                    "      appending to it with -c. The file is not analyzed in parallel.\n"
+                    "  -k  Comma separated pids to write.\n"
+                    "  -P  Comma separated program numbers to write with their PAT, PMT, PCR and\n"
+                    "      elementary stream pids.\n"
+                    "  -R  Rewrite the PAT to list only the selected programs.\n"
+                    "Use - as file name to read from stdin, udp://address:port or rtp://address:port\n"
+                    "to receive from the network until interrupted.\n", name);
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
+    TsAnalyzeOptions options;
+    memset(&options, 0, sizeof(TsAnalyzeOptions));
+    options.threads = 1;
+    options.ring_size = TS_ANALYZE_RING_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "metj:I:d:pb:sSx:c:f:o:i:rw:k:P:R")) != -1) {
+        switch (opt) {
+            case 'm':
+                options.use_mmap = true;
+                break;
+            case 'e':
+                options.checks = true;
+                break;
+            case 't':
+                options.timing = true;
+                break;
+            case 'j':
+                options.threads = strtoul(optarg, NULL, 10);
+                if (options.threads == 0)
+                    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            case 'I':
+                options.interface = optarg;
+                break;
+            case 'd':
+                options.seconds = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                options.pipeline = true;
+                break;
+            case 'b':
+                options.ring_size = strtoul(optarg, NULL, 10) << 20;
+                break;
+            case 's':
+                options.profile = true;
+                break;
+            case 'S':
+                options.si = true;
+                break;
+            case 'x':
+                options.index_file = optarg;
+                break;
+            case 'c':
+                options.checkpoint_file = optarg;
+                break;
+            case 'f':
+                options.sample_percent = strtod(optarg, NULL);
+                break;
+            case 'o':
+                if (strcmp(optarg, "text") == 0)
+                    options.format = TS_ANALYZE_FORMAT_TEXT;
+                else if (strcmp(optarg, "json") == 0)
+                    options.format = TS_ANALYZE_FORMAT_JSON;
+                else if (strcmp(optarg, "csv") == 0)
+                    options.format = TS_ANALYZE_FORMAT_CSV;
+                else {
+                    fprintf(stderr, "Unknown format %s.\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                options.interval = strtod(optarg, NULL);
+                break;
+            case 'r':
+                options.descending = true;
+                break;
+            case 'w':
+                options.filter_file = optarg;
+                break;
+            case 'k':
+                options.filter_pids = optarg;
+                break;
+            case 'P':
+                options.filter_programs = optarg;
+                break;
+            case 'R':
+                options.filter_pat = true;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "You must specify a file name.\n");
+        usage(argv[0]);
         exit(1);
     }
+    /* snapshots have no text form */
+    if (options.interval > 0 && options.format == TS_ANALYZE_FORMAT_TEXT)
+        options.format = TS_ANALYZE_FORMAT_JSON;
 
     TsPidStat stats;
     memset(&stats, 0, sizeof(TsPidStat));
     PidInfoManager *pmgr = pid_info_manager_new();
-    stats.client_id = pid_info_manager_register_client(pmgr);
+    stats.client_id = pid_info_manager_register_client_records(pmgr, sizeof(TsPidData));
+    stats.pid_data = pid_info_manager_get_client_records(pmgr, stats.client_id);
+    stats.checks = options.checks;
+    stats.timing = options.timing;
+    stats.profile = options.profile;
+    if (options.si)
+        stats.si = ts_si_new();
+    if (options.index_file)
+        stats.index = ts_index_writer_new();
+    if (options.filter_file)
+        ts_analyze_filter_new(&stats, &options);
+    stats.descending = options.descending;
+    stats.start = ts_analyze_now();
+    ts_analyze_write_header(stdout, options.format);
+    if (options.interval > 0)
+        stats.reporter = ts_analyze_reporter_new(pmgr, &options, stats.start);
+
+    ts_analyze_file(argv[optind], &stats, pmgr, &options);
+    ts_analyze_reporter_free(stats.reporter);
+    stats.reporter = NULL;
+    if (options.format == TS_ANALYZE_FORMAT_TEXT)
+        ts_analyze_print(&stats, pmgr);
+    else
+        ts_analyze_print_snapshot(&stats, pmgr, options.format);
 
-    ts_analyze_file(argv[1], &stats, pmgr);
-    ts_analyze_print(&stats, pmgr);
+    if (stats.index && !ts_index_writer_write(stats.index, options.index_file, ts_analyze_packet_length(&stats)))
+        perror("Could not write index");
 
+    ts_index_writer_free(stats.index);
+    ts_analyze_filter_free(&stats);
+    ts_si_free(stats.si);
     pid_info_manager_free(pmgr);
     return 0;
 }
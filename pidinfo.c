@@ -3,6 +3,8 @@
 
 #define PID_INFO_CLIENT_MAX 8
 
+#define PID_INFO_CHECKPOINT_MAGIC 0x49505354 /* "TSPI" */
+
 typedef struct {
     void *data;
     PidInfoPrivateDataFree destroy;
@@ -10,20 +12,55 @@ typedef struct {
 
 typedef struct _PidInfoListEntry {
     PidInfo info;
-    PidInfoPrivateData private_data[PID_INFO_CLIENT_MAX];
+    PidInfoManager *pmgr; /* to find the client data from a PidInfo */
 } PidInfoListEntry;
 
+/* A pid in a checkpoint. */
+typedef struct {
+    uint16_t pid;
+    uint16_t program;
+    uint8_t type;
+    uint8_t stream_type;
+    uint8_t reserved[2];
+} PidInfoCheckpointEntry;
+
 #define PID_INFO_BLOCK 32
 
+/* PIDs are 13 bit. */
+#define PID_INFO_PID_MAX 8192
+
+/* The data of a client, kept outside the entries in arrays indexed by pid. */
+typedef struct {
+    size_t record_size; /* 0 unless registered with records */
+    uint8_t *records; /* record_size bytes per pid */
+    PidInfoPrivateData *private_data; /* per pid, NULL until private data is set */
+} PidInfoClient;
+
 struct _PidInfoManager {
     uint16_t max_client_id;
+    PidInfoClient clients[PID_INFO_CLIENT_MAX];
 
     size_t pid_count;
     size_t allocated_pid_count;
 
-    PidInfoListEntry **pidlist;
+    /* Entries in insertion order, allocated in blocks of PID_INFO_BLOCK contiguous entries.
+     * Blocks are never moved, so pointers to the entries stay valid. */
+    PidInfoListEntry **blocks;
+
+    /* Direct lookup of the entry for each pid, NULL if the pid is unknown. */
+    PidInfoListEntry *lookup[PID_INFO_PID_MAX];
 };
 
+/** Get the entry at a given position in insertion order.
+ *  @param[in] pmgr The pid info manager.
+ *  @param[in] index The index of the entry, less than pid_count.
+ *  @return The entry at this position.
+ */
+static inline PidInfoListEntry *_pid_info_manager_get_entry(PidInfoManager *pmgr, size_t index)
+{
+    return &pmgr->blocks[index / PID_INFO_BLOCK][index % PID_INFO_BLOCK];
+}
+
 /** Add a pid info to the manager
  *  @param[in] pmgr The pid info manager.
  *  @param[in] pid The pid for which to add the info.
@@ -31,15 +68,18 @@ struct _PidInfoManager {
  */
 PidInfoListEntry *_pid_info_manager_add_pid(PidInfoManager *pmgr, uint16_t pid)
 {
-    if (!pmgr)
+    if (!pmgr || pid >= PID_INFO_PID_MAX)
         return NULL;
     if (pmgr->pid_count == pmgr->allocated_pid_count) {
+        size_t block_count = pmgr->allocated_pid_count / PID_INFO_BLOCK;
+        pmgr->blocks = util_realloc(pmgr->blocks, (block_count + 1) * sizeof(PidInfoListEntry *));
+        pmgr->blocks[block_count] = util_alloc0(PID_INFO_BLOCK * sizeof(PidInfoListEntry));
         pmgr->allocated_pid_count += PID_INFO_BLOCK;
-        pmgr->pidlist = util_realloc(pmgr->pidlist, pmgr->allocated_pid_count * sizeof(PidInfoListEntry *));
     }
-    PidInfoListEntry *entry = util_alloc0(sizeof(PidInfoListEntry));
-    pmgr->pidlist[pmgr->pid_count++] = entry;
+    PidInfoListEntry *entry = _pid_info_manager_get_entry(pmgr, pmgr->pid_count++);
     entry->info.pid = pid;
+    entry->pmgr = pmgr;
+    pmgr->lookup[pid] = entry;
 
     return entry;
 }
@@ -52,14 +92,10 @@ PidInfoListEntry *_pid_info_manager_add_pid(PidInfoManager *pmgr, uint16_t pid)
  */
 PidInfoListEntry *_pid_info_manager_find_pid(PidInfoManager *pmgr, uint16_t pid, bool create)
 {
-    if (pmgr == NULL)
+    if (pmgr == NULL || pid >= PID_INFO_PID_MAX)
         return NULL;
-    size_t j;
-    for (j = 0; j < pmgr->pid_count; ++j) {
-        if (pmgr->pidlist[j]->info.pid == pid) {
-            return pmgr->pidlist[j];
-        }
-    }
+    if (pmgr->lookup[pid])
+        return pmgr->lookup[pid];
 
     return create ? _pid_info_manager_add_pid(pmgr, pid) : NULL;
 }
@@ -76,14 +112,22 @@ void pid_info_manager_free(PidInfoManager *pmgr)
     if (pmgr) {
         size_t j;
         size_t k;
-        for (j = 0; j < pmgr->pid_count; ++j) {
-            for (k = 0; k < pmgr->max_client_id; ++k) {
-                if (pmgr->pidlist[j]->private_data[k].data && pmgr->pidlist[j]->private_data[k].destroy)
-                    pmgr->pidlist[j]->private_data[k].destroy(pmgr->pidlist[j]->private_data[k].data);
+        PidInfoPrivateData *private_data;
+        for (k = 0; k < pmgr->max_client_id; ++k) {
+            if (pmgr->clients[k].private_data) {
+                for (j = 0; j < pmgr->pid_count; ++j) {
+                    private_data = &pmgr->clients[k].private_data[_pid_info_manager_get_entry(pmgr, j)->info.pid];
+                    if (private_data->data && private_data->destroy)
+                        private_data->destroy(private_data->data);
+                }
             }
-            util_free(pmgr->pidlist[j]);
+            util_free(pmgr->clients[k].private_data);
+            util_free(pmgr->clients[k].records);
+        }
+        for (j = 0; j < pmgr->allocated_pid_count / PID_INFO_BLOCK; ++j) {
+            util_free(pmgr->blocks[j]);
         }
-        util_free(pmgr->pidlist);
+        util_free(pmgr->blocks);
         util_free(pmgr);
     }
 }
@@ -99,26 +143,72 @@ uint16_t pid_info_manager_register_client(PidInfoManager *pmgr)
     return pmgr != NULL && pmgr->max_client_id < PID_INFO_CLIENT_MAX ? pmgr->max_client_id++ : PID_INFO_CLIENT_MAX;
 }
 
+uint16_t pid_info_manager_register_client_records(PidInfoManager *pmgr, size_t record_size)
+{
+    uint16_t client_id = pid_info_manager_register_client(pmgr);
+    if (client_id == PID_INFO_CLIENT_MAX || record_size == 0)
+        return client_id;
+    pmgr->clients[client_id].record_size = record_size;
+    pmgr->clients[client_id].records = util_alloc0(PID_INFO_PID_MAX * record_size);
+    return client_id;
+}
+
+void *pid_info_manager_get_client_records(PidInfoManager *pmgr, uint16_t client_id)
+{
+    if (pmgr == NULL || client_id >= PID_INFO_CLIENT_MAX)
+        return NULL;
+    return pmgr->clients[client_id].records;
+}
+
+void *pid_info_get_client_record(PidInfo *pinfo, uint16_t client_id)
+{
+    if (pinfo == NULL || client_id >= PID_INFO_CLIENT_MAX)
+        return NULL;
+    PidInfoClient *client = &((PidInfoListEntry *)pinfo)->pmgr->clients[client_id];
+    return client->records ? &client->records[pinfo->pid * client->record_size] : NULL;
+}
+
+/** Get the private data slot of a client for a pid.
+ *  @param[in] pinfo The pid info.
+ *  @param[in] client_id The client id.
+ *  @param[in] create Whether to allocate the slots of the client if there are none yet.
+ *  @return The slot, NULL if the client has no slots and create is false.
+ */
+static PidInfoPrivateData *_pid_info_get_private_data(PidInfo *pinfo, uint16_t client_id, bool create)
+{
+    PidInfoClient *client = &((PidInfoListEntry *)pinfo)->pmgr->clients[client_id];
+    if (client->private_data == NULL) {
+        if (!create)
+            return NULL;
+        client->private_data = util_alloc0(PID_INFO_PID_MAX * sizeof(PidInfoPrivateData));
+    }
+    return &client->private_data[pinfo->pid];
+}
+
 void pid_info_set_private_data(PidInfo *pinfo, uint16_t client_id, void *data, PidInfoPrivateDataFree destroy_data_func)
 {
     if (pinfo == NULL || client_id >= PID_INFO_CLIENT_MAX)
         return;
-    ((PidInfoListEntry *)pinfo)->private_data[client_id].data = data;
-    ((PidInfoListEntry *)pinfo)->private_data[client_id].destroy = destroy_data_func;
+    PidInfoPrivateData *pdata = _pid_info_get_private_data(pinfo, client_id, true);
+    pdata->data = data;
+    pdata->destroy = destroy_data_func;
 }
 
 void *pid_info_get_private_data(PidInfo *pinfo, uint16_t client_id)
 {
     if (pinfo == NULL || client_id >= PID_INFO_CLIENT_MAX)
         return NULL;
-    return ((PidInfoListEntry *)pinfo)->private_data[client_id].data;
+    PidInfoPrivateData *pdata = _pid_info_get_private_data(pinfo, client_id, false);
+    return pdata ? pdata->data : NULL;
 }
 
 void pid_info_clear_private_data(PidInfo *pinfo, uint16_t client_id)
 {
     if (pinfo == NULL || client_id >= PID_INFO_CLIENT_MAX)
         return;
-    PidInfoPrivateData *pdata = &((PidInfoListEntry *)pinfo)->private_data[client_id];
+    PidInfoPrivateData *pdata = _pid_info_get_private_data(pinfo, client_id, false);
+    if (pdata == NULL)
+        return;
     if (pdata->destroy)
         pdata->destroy(pdata->data);
     pdata->data = NULL;
@@ -142,7 +232,7 @@ void pid_info_manager_enumerate_pid_infos(PidInfoManager *pmgr, PidInfoEnumFunc
         return;
     size_t j;
     for (j = 0; j < pmgr->pid_count; ++j) {
-        if (!callback((PidInfo *)pmgr->pidlist[j], userdata))
+        if (!callback((PidInfo *)_pid_info_manager_get_entry(pmgr, j), userdata))
             return;
     }
 }
@@ -153,7 +243,7 @@ void pid_info_manager_clear_private_data(PidInfoManager *pmgr, uint16_t client_i
         return;
     size_t j;
     for (j = 0; j < pmgr->pid_count; ++j) {
-        pid_info_clear_private_data((PidInfo *)pmgr->pidlist[j], client_id);
+        pid_info_clear_private_data((PidInfo *)_pid_info_manager_get_entry(pmgr, j), client_id);
     }
 }
 
@@ -161,3 +251,60 @@ size_t pid_info_manager_get_pid_count(PidInfoManager *pmgr)
 {
     return pmgr != NULL ? pmgr->pid_count : 0;
 }
+
+bool pid_info_manager_save(PidInfoManager *pmgr, FILE *file)
+{
+    if (pmgr == NULL || file == NULL)
+        return false;
+    uint32_t header[2] = { PID_INFO_CHECKPOINT_MAGIC, pmgr->pid_count };
+    PidInfoCheckpointEntry record = { 0 };
+    PidInfoListEntry *entry;
+    size_t j;
+
+    if (fwrite(header, sizeof(header), 1, file) != 1)
+        return false;
+    for (j = 0; j < pmgr->pid_count; ++j) {
+        entry = _pid_info_manager_get_entry(pmgr, j);
+        record.pid = entry->info.pid;
+        record.program = entry->info.program;
+        record.type = entry->info.type;
+        record.stream_type = entry->info.stream_type;
+        if (fwrite(&record, sizeof(record), 1, file) != 1)
+            return false;
+    }
+    return true;
+}
+
+bool pid_info_manager_load(PidInfoManager *pmgr, FILE *file)
+{
+    if (pmgr == NULL || file == NULL)
+        return false;
+    uint32_t header[2];
+    PidInfoCheckpointEntry *records;
+    PidInfoListEntry *entry;
+    size_t j;
+
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != PID_INFO_CHECKPOINT_MAGIC ||
+            header[1] > PID_INFO_PID_MAX)
+        return false;
+    /* validate everything before the manager is touched, malloc(0) may return NULL */
+    records = util_alloc(header[1] * sizeof(PidInfoCheckpointEntry) + 1);
+    if (fread(records, sizeof(PidInfoCheckpointEntry), header[1], file) != header[1]) {
+        util_free(records);
+        return false;
+    }
+    for (j = 0; j < header[1]; ++j) {
+        if (records[j].pid >= PID_INFO_PID_MAX || records[j].type > PID_TYPE_OTHER) {
+            util_free(records);
+            return false;
+        }
+    }
+    for (j = 0; j < header[1]; ++j) {
+        entry = _pid_info_manager_find_pid(pmgr, records[j].pid, true);
+        entry->info.type = records[j].type;
+        entry->info.stream_type = records[j].stream_type;
+        entry->info.program = records[j].program;
+    }
+    util_free(records);
+    return true;
+}
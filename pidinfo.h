@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 typedef enum {
     PID_TYPE_PAT = 0,
@@ -49,7 +50,8 @@ void pid_info_manager_free(PidInfoManager *pmgr);
 /** Add a pid to the manager.
  *  @param[in] pmgr The pid info manager.
  *  @param[in] pid The pid to add.
- *  @return The info of the pid, possibly created.
+ *  @return The info of the pid, possibly created. The pointer stays valid until the manager is freed.
+ *          NULL if pid is not a valid 13 bit pid.
  */
 PidInfo *pid_info_manager_add_pid(PidInfoManager *pmgr, uint16_t pid);
 
@@ -60,6 +62,30 @@ PidInfo *pid_info_manager_add_pid(PidInfoManager *pmgr, uint16_t pid);
  */
 uint16_t pid_info_manager_register_client(PidInfoManager *pmgr);
 
+/** Register a client keeping a record of a fixed size for every pid. The records of a client are one
+ *  contiguous array of 8192 records indexed by pid, so that a client updates the record of a packet
+ *  with a single indexed access. They start zeroed, also for pids the manager does not know yet.
+ *  @param[in] pmgr The pid info manager to register the client to.
+ *  @param[in] record_size The size of a record in bytes.
+ *  @return The new, unique client id.
+ */
+uint16_t pid_info_manager_register_client_records(PidInfoManager *pmgr, size_t record_size);
+
+/** Get the records of a client.
+ *  @param[in] pmgr The pid info manager.
+ *  @param[in] client_id The client id as returned by register_client_records().
+ *  @return The array of records indexed by pid, valid until the manager is freed.
+ *          NULL if the client has no records.
+ */
+void *pid_info_manager_get_client_records(PidInfoManager *pmgr, uint16_t client_id);
+
+/** Get the record of a client for a pid info.
+ *  @param[in] pinfo The pid info.
+ *  @param[in] client_id The client id as returned by register_client_records().
+ *  @return The record of the pid, NULL if the client has no records.
+ */
+void *pid_info_get_client_record(PidInfo *pinfo, uint16_t client_id);
+
 /** Set private data of the pid info.
  *  @param[in] pinfo The pid info to set private data for.
  *  @param[in] client_id The client id as returned by register_client().
@@ -116,3 +142,17 @@ void pid_info_manager_clear_private_data(PidInfoManager *pmgr, uint16_t client_i
  *  @return The number of managed pids.
  */
 size_t pid_info_manager_get_pid_count(PidInfoManager *pmgr);
+
+/** Save the pids with their type, stream type and program to a checkpoint. Private data is not saved.
+ *  @param[in] pmgr The pid manager.
+ *  @param[in] file The file to write to.
+ *  @return False if the file could not be written.
+ */
+bool pid_info_manager_save(PidInfoManager *pmgr, FILE *file);
+
+/** Restore the pids of a checkpoint in their original order, usually into a new manager.
+ *  @param[in] pmgr The pid manager.
+ *  @param[in] file The file to read from, positioned where pid_info_manager_save() wrote.
+ *  @return False if the file holds no valid pid list, the manager is unchanged then.
+ */
+bool pid_info_manager_load(PidInfoManager *pmgr, FILE *file);
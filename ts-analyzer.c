@@ -1,7 +1,11 @@
 #include "ts-analyzer.h"
+#include "ts-sync.h"
+#include "ts-timing.h"
+#include "ts-psi-cache.h"
 #include "utils.h"
 
 #include <memory.h>
+#include <time.h>
 #include <bitstream/mpeg/ts.h>
 #include <dvbpsi/dvbpsi.h>
 #include <dvbpsi/descriptor.h>
@@ -10,12 +14,58 @@
 #include <dvbpsi/pmt.h>
 #include <bitstream/mpeg/pes.h>
 
+/* PIDs are 13 bit. */
+#define TS_PID_COUNT 8192
+#define TS_NULL_PID 0x1fff
+
+/* The PCR counts in 27 MHz ticks and wraps after 2^33 * 300 ticks. */
+#define TS_CLOCK_RATE 27000000
+#define TS_PCR_WRAP ((UINT64_C(1) << 33) * 300)
+/* Maximum interval between PAT/PMT. */
+#define TS_CHECK_PSI_TIMEOUT (TS_CLOCK_RATE / 2)
+/* Larger steps of the PCR are treated as discontinuity. */
+#define TS_CLOCK_MAX_STEP TS_CLOCK_RATE
+
+/* Per-pid state of the built-in checks. */
+typedef struct _TsPidCheck {
+    uint8_t cc; /* last continuity counter */
+    uint8_t flags;
+    TsPidErrorCounters errors;
+} TsPidCheck;
+
+#define TS_PID_CHECK_SEEN 0x01 /* cc is valid */
+#define TS_PID_CHECK_DUPLICATE 0x02 /* the last packet was a duplicate */
+
+/* A checkpoint starts with TsAnalyzerCheckpoint, followed by the pid checks, the timing and the pid
+ * counters if they are enabled and program_count TsAnalyzerProgramCheckpoint. */
+#define TS_ANALYZER_CHECKPOINT_MAGIC 0x4b435354 /* "TSCK" */
+#define TS_ANALYZER_CHECKPOINT_VERSION 5
+/* Maximum number of programs. */
+#define TS_ANALYZER_PROGRAMS 64
+/* Consecutive corrupted sync bytes declaring a loss of sync, TR 101 290 1.1. */
+#define TS_SYNC_LOSS_COUNT 2
+/* Bytes kept while searching for sync, enough for the last candidate packet whose sync byte cannot be
+ * confirmed by the following ones yet: the M2TS prefix and four more 204 byte packets. */
+#define TS_ANALYZER_SYNC_KEEP (TS_SYNC_M2TS_PREFIX + (TS_SYNC_CONFIRM_COUNT - 1) * 204)
+
+typedef struct _TsPidSubscription {
+    TsHandlePacketFunc callback;
+    void *userdata;
+} TsPidSubscription;
+
 typedef struct _DvbPsiProgInfo {
     uint16_t prog_number;
     uint16_t pid;
+    uint16_t pcr_pid; /* from the PMT, TS_NULL_PID before the first PMT */
     dvbpsi_t *handle;
+    TsPsiCache *cache; /* repetitions of the PMT are not decoded */
+    uint64_t seen; /* clock when the PMT was last seen */
+    bool seen_pending; /* PMT seen since the last clock update */
 } DvbPsiProgInfo;
 
+/* Handles the complete packets at the start of the buffer, specialized for each packet length. */
+typedef void (*TsAnalyzerProcessFunc)(TsAnalyzer *analyzer);
+
 struct _TsAnalyzer {
     TsAnalyzerClass klass;
     void *cb_userdata;
@@ -36,26 +86,122 @@ struct _TsAnalyzer {
     size_t remaining;
 
     size_t packet_length;
+    /* Bytes of a packet before the sync byte, TS_SYNC_M2TS_PREFIX for 192 byte packets. */
+    size_t prefix_length;
+    /* The parse loop for packet_length, NULL before the stream was synchronized. */
+    TsAnalyzerProcessFunc process_buffer;
+
+    /* The bytes not yet ruled out as start of a packet while searching for sync, followed by those of
+     * the next push needed to confirm them. They are not included in stream_offset. */
+    uint8_t sync_data[2 * TS_ANALYZER_SYNC_KEEP];
+    size_t sync_bytes;
+    /* After a corrupted sync byte, the stream offset of the next sync byte where the packets would have
+     * continued, 0 once sync loss was declared or sync was found again. */
+    uint64_t sync_grid;
+    /* Consecutive corrupted sync bytes at the positions of sync_grid. */
+    uint32_t sync_bad;
 
     uint32_t error_occurred : 1;
+    uint32_t synced : 1; /* locked onto the packets, otherwise searching for sync */
+    uint32_t clock_valid : 1;
+    uint32_t pat_seen_pending : 1; /* PAT seen since the last clock update */
+    uint32_t profiling : 1;
+
+    /* State of the built-in checks, indexed by pid. NULL if disabled. */
+    TsPidCheck *checks;
+    TsErrorCounters errors;
+
+    /* Built-in packet counters, indexed by pid. NULL if disabled. */
+    TsPidCounters *counters;
+
+    /* Stream clock in 27 MHz ticks, driven by the PCR of clock_pid. */
+    uint64_t clock;
+    uint64_t clock_pcr;
+    uint16_t clock_pid;
+    /* clock when the PAT was last seen */
+    uint64_t pat_seen;
+
+    /* Number of packets handled so far. */
+    uint64_t packet_count;
+
+    /* Internal counters, packets is taken from packet_count. */
+    TsAnalyzerStats stats;
+
+    /* Bitrate and PCR measurement, NULL if disabled. */
+    TsTiming *timing;
+
+    /* PES reassembly, NULL until it is enabled for a pid. */
+    TsPesAssembler *pes;
+
+    /* SDT/EIT/NIT decoder set by the user, NULL if disabled. */
+    TsSi *si;
+
+    /* Seek index writer set by the user, NULL if disabled. */
+    TsIndexWriter *index;
+
+    /* Filter writing selected pids set by the user, NULL if disabled. */
+    TsFilter *filter;
+
+    /* Bitmap of subscribed pids and their callbacks, NULL if there are no subscriptions. */
+    uint64_t *subscribed;
+    TsPidSubscription *subscriptions;
+    size_t subscription_count;
+
+    /* Packets collected for klass.handle_packets. */
+    TsPacketDesc batch[TS_ANALYZER_BATCH_MAX];
+    size_t batch_count;
 
     PidInfoManager *pmgr;
 
     /* dvbpsi handlers */
     dvbpsi_t *pat_handle;
+    TsPsiCache *pat_cache;
     /* FIXME make this dynamic. */
-    DvbPsiProgInfo pmt_handles[64];
+    DvbPsiProgInfo pmt_handles[TS_ANALYZER_PROGRAMS];
     size_t pmt_handle_count;
 };
 
-bool ts_analyzer_handle_packet_fallback(PidInfo *pidinfo, const uint8_t *packet, size_t offset, void *userdata)
-{
-    return true;
-}
+typedef struct _TsAnalyzerCheckpoint {
+    uint32_t magic;
+    uint32_t version;
+    /* sizes of the records, checkpoints of builds with another layout are rejected */
+    uint32_t size;
+    uint32_t check_size;
+    uint32_t timing_size;
+    uint32_t counters_size;
+    uint32_t program_size;
+    uint32_t program_count;
+    uint32_t packet_bytes_read;
+    uint32_t packet_length;
+    uint32_t sync_bad;
+    uint16_t clock_pid;
+    uint8_t clock_valid;
+    uint8_t pat_seen_pending;
+    uint8_t has_checks;
+    uint8_t has_timing;
+    uint8_t has_counters;
+    uint8_t synced;
+    uint64_t stream_offset;
+    uint64_t packet_offset;
+    uint64_t packet_count;
+    uint64_t clock;
+    uint64_t clock_pcr;
+    uint64_t pat_seen;
+    uint64_t sync_grid;
+    uint8_t packet_data[256];
+    TsErrorCounters errors;
+    TsAnalyzerStats stats;
+    TsPsiCacheCheckpoint pat;
+} TsAnalyzerCheckpoint;
 
-TsAnalyzerClass ts_analyzer_class_fallback = {
-    .handle_packet = ts_analyzer_handle_packet_fallback,
-};
+typedef struct _TsAnalyzerProgramCheckpoint {
+    uint16_t prog_number;
+    uint16_t pid;
+    uint16_t pcr_pid;
+    bool seen_pending;
+    uint64_t seen;
+    TsPsiCacheCheckpoint cache;
+} TsAnalyzerProgramCheckpoint;
 
 static PidInfo *_ts_analyzer_add_pid(TsAnalyzer *analyzer, uint16_t pid, PidType type)
 {
@@ -89,6 +235,13 @@ static void ts_analyzer_dvbpsi_pmt_cb(TsAnalyzer *analyzer, dvbpsi_pmt_t *pmt)
 {
     dvbpsi_pmt_es_t *stream;
     PidType type = PID_TYPE_OTHER;
+    size_t j;
+    for (j = 0; j < analyzer->pmt_handle_count; ++j) {
+        if (analyzer->pmt_handles[j].prog_number == pmt->i_program_number) {
+            analyzer->pmt_handles[j].pcr_pid = pmt->i_pcr_pid;
+            break;
+        }
+    }
     for (stream = pmt->p_first_es; stream; stream = stream->p_next) {
         switch (stream->i_type) { /* see page 66 (48) of iso 13818-1 */
             case 0x01:
@@ -117,6 +270,7 @@ static void ts_analyzer_dvbpsi_pmt_cb(TsAnalyzer *analyzer, dvbpsi_pmt_t *pmt)
         PidInfo *info =_ts_analyzer_add_pid(analyzer, stream->i_pid, type);
         if (info) {
             info->stream_type = stream->i_type;
+            info->program = pmt->i_program_number;
         }
     }
     dvbpsi_pmt_delete(pmt);
@@ -133,18 +287,37 @@ static DvbPsiProgInfo *ts_analyzer_dvbpsi_add_program(TsAnalyzer *analyzer, uint
         }
     }
     if (info == NULL) {
+        if (analyzer->pmt_handle_count == TS_ANALYZER_PROGRAMS)
+            return NULL;
         info = &analyzer->pmt_handles[analyzer->pmt_handle_count++];
         info->prog_number = prog_number;
         info->pid = pid;
+        info->pcr_pid = TS_NULL_PID;
+        info->seen = analyzer->clock;
         info->handle = dvbpsi_new(ts_analyzer_dvbpsi_message, DVBPSI_MSG_ERROR);
+        info->cache = ts_psi_cache_new();
         dvbpsi_pmt_attach(info->handle, prog_number, (dvbpsi_pmt_callback)ts_analyzer_dvbpsi_pmt_cb, analyzer);
     }
 
-    _ts_analyzer_add_pid(analyzer, info->pid, PID_TYPE_PMT);
+    PidInfo *pidinfo = _ts_analyzer_add_pid(analyzer, info->pid, PID_TYPE_PMT);
+    if (pidinfo && prog_number != 0)
+        pidinfo->program = prog_number;
 
     return info;
 }
 
+/* Timestamp for profiling. */
+static inline uint64_t ts_analyzer_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
 static inline void ts_analyzer_advance_buffer(TsAnalyzer *analyzer, size_t len)
 {
     analyzer->buffer += len;
@@ -152,113 +325,580 @@ static inline void ts_analyzer_advance_buffer(TsAnalyzer *analyzer, size_t len)
     analyzer->remaining -= len;
 }
 
-void ts_analyzer_sync_stream(TsAnalyzer *analyzer)
+static void ts_analyzer_set_packet_length(TsAnalyzer *analyzer, size_t packet_length);
+static bool ts_analyzer_flush_batch(TsAnalyzer *analyzer);
+static inline void ts_analyzer_read_packet_partial(TsAnalyzer *analyzer);
+
+/* Find the first packet whose sync byte is confirmed by the following packets, detecting the packet
+ * length if it is not known yet. Returns the offset of the packet, or len if there is none. */
+static size_t ts_analyzer_find_sync(TsAnalyzer *analyzer, const uint8_t *buffer, size_t len)
 {
-    size_t offset = 0;
-    if (!analyzer->packet_length) {
-        while (offset < analyzer->remaining) {
-            /* FIXME: validate five packets (as below) to avoid error in synchronization. */
-            if (ts_validate(&analyzer->buffer[offset])) {
-                if (offset + 188 < analyzer->remaining && ts_validate(&analyzer->buffer[offset + 188])) {
-                    analyzer->packet_length = 188;
-                    break;
-                }
-                if (offset + 192 < analyzer->remaining && ts_validate(&analyzer->buffer[offset + 192])) {
-                    analyzer->packet_length = 192;
-                    break;
-                }
+    size_t packet_length = 0;
+    size_t offset;
+    if (!analyzer->packet_length && ts_sync_detect(buffer, len, &packet_length) < len)
+        ts_analyzer_set_packet_length(analyzer, packet_length);
+    /* packets are taken with their prefix, a sync byte without the bytes before it is skipped */
+    if (!analyzer->packet_length || len <= analyzer->prefix_length)
+        return len;
+    offset = ts_sync_find(buffer + analyzer->prefix_length, len - analyzer->prefix_length,
+                          analyzer->packet_length, TS_SYNC_CONFIRM_COUNT);
+    return offset < len - analyzer->prefix_length ? offset : len;
+}
+
+/* Drop bytes that cannot start a packet. Until sync loss is declared or sync is found again, the bytes
+ * where the sync bytes of the following packets would have been are checked. */
+static void ts_analyzer_discard(TsAnalyzer *analyzer, const uint8_t *data, size_t len)
+{
+    while (analyzer->sync_grid && analyzer->sync_grid < analyzer->stream_offset + len) {
+        if (data[analyzer->sync_grid - analyzer->stream_offset] == 0x47) {
+            analyzer->sync_bad = 0;
+        }
+        else {
+            ++analyzer->errors.sync_byte_errors;
+            if (++analyzer->sync_bad == TS_SYNC_LOSS_COUNT) {
+                /* counted once until sync is found again */
+                ++analyzer->errors.sync_loss;
+                analyzer->sync_grid = 0;
+                break;
             }
-            ++offset;
         }
+        analyzer->sync_grid += analyzer->packet_length;
+    }
+    analyzer->stream_offset += len;
+    analyzer->stats.bytes_discarded += len;
+}
 
-        if (!analyzer->packet_length)
-            goto err;
-    }
-    /* return start of first valid sync byte */
-    int no_match = 0;
-    size_t i;
-    while (offset < analyzer->remaining) {
-        if (ts_validate(&analyzer->buffer[offset])) { /* possible start */
-            no_match = 0;
-            /* check if we have the start of a packet (next five packets) */
-            for (i = 1; i < 5 && no_match == 0; ++i) {
-                if (offset + i * analyzer->packet_length < analyzer->remaining) {
-                    if (!ts_validate(&analyzer->buffer[offset + i * analyzer->packet_length]))
-                        no_match = 1;
-                    break;
-                }
-                else {
-                    goto err;
-                }
-            }
-            if (!no_match) {
-                ts_analyzer_advance_buffer(analyzer, offset);
-                analyzer->packet_offset = analyzer->stream_offset;
-                return;
-            }
+/* Keep bytes that may start a packet until the next push confirms or rules them out. */
+static bool ts_analyzer_stage(TsAnalyzer *analyzer, const uint8_t *data, size_t len)
+{
+    /* pending batch packets may point into the staged bytes */
+    if (!ts_analyzer_flush_batch(analyzer)) {
+        analyzer->error_occurred = 1;
+        return false;
+    }
+    memcpy(&analyzer->sync_data[analyzer->sync_bytes], data, len);
+    analyzer->sync_bytes += len;
+    return true;
+}
+
+/* Lock onto the packet starting at the current position. */
+static void ts_analyzer_lock(TsAnalyzer *analyzer)
+{
+    analyzer->synced = 1;
+    analyzer->sync_grid = 0;
+    analyzer->sync_bad = 0;
+    analyzer->packet_offset = analyzer->stream_offset;
+    ++analyzer->stats.resyncs;
+}
+
+/* Handle the staged bytes from offset on as if they were pushed before the current buffer. */
+static void ts_analyzer_process_staged(TsAnalyzer *analyzer, size_t offset)
+{
+    uint8_t *buffer = analyzer->buffer;
+    size_t remaining = analyzer->remaining;
+
+    ts_analyzer_discard(analyzer, analyzer->sync_data, offset);
+    ts_analyzer_lock(analyzer);
+    /* at most four packets and a partial one, all confirmed by the sync search */
+    analyzer->buffer = &analyzer->sync_data[offset];
+    analyzer->remaining = analyzer->sync_bytes - offset;
+    analyzer->sync_bytes = 0;
+    while (analyzer->remaining && !analyzer->error_occurred)
+        ts_analyzer_read_packet_partial(analyzer);
+
+    analyzer->buffer = buffer;
+    analyzer->remaining = remaining;
+}
+
+/* Search the staged bytes and the current buffer for sync. The search finds the same packets however
+ * the stream is split into pushes: bytes are only dropped once they are ruled out as start of a packet,
+ * the others are staged until the next push. */
+void ts_analyzer_sync_stream(TsAnalyzer *analyzer)
+{
+    size_t offset;
+    size_t total;
+    size_t keep;
+
+    if (analyzer->sync_bytes) {
+        /* look ahead into the buffer far enough to confirm or rule out every staged byte */
+        size_t ahead = analyzer->remaining < TS_ANALYZER_SYNC_KEEP ? analyzer->remaining : TS_ANALYZER_SYNC_KEEP;
+        memcpy(&analyzer->sync_data[analyzer->sync_bytes], analyzer->buffer, ahead);
+        total = analyzer->sync_bytes + ahead;
+        offset = ts_analyzer_find_sync(analyzer, analyzer->sync_data, total);
+        if (offset < analyzer->sync_bytes) {
+            ts_analyzer_process_staged(analyzer, offset);
+            return;
+        }
+        if (offset == total && ahead == analyzer->remaining) {
+            /* the whole buffer is staged now, keep what is not ruled out yet */
+            keep = total < TS_ANALYZER_SYNC_KEEP ? total : TS_ANALYZER_SYNC_KEEP;
+            ts_analyzer_discard(analyzer, analyzer->sync_data, total - keep);
+            memmove(analyzer->sync_data, &analyzer->sync_data[total - keep], keep);
+            analyzer->sync_bytes = keep;
+            analyzer->buffer += analyzer->remaining;
+            analyzer->remaining = 0;
+            return;
         }
-        ++offset;
+        /* the run starts in the buffer or the staged bytes are ruled out */
+        ts_analyzer_discard(analyzer, analyzer->sync_data, analyzer->sync_bytes);
+        analyzer->sync_bytes = 0;
+    }
+
+    offset = ts_analyzer_find_sync(analyzer, analyzer->buffer, analyzer->remaining);
+    if (offset < analyzer->remaining) {
+        ts_analyzer_discard(analyzer, analyzer->buffer, offset);
+        analyzer->buffer += offset;
+        analyzer->remaining -= offset;
+        ts_analyzer_lock(analyzer);
+        return;
     }
-err:
-    /* drop buffer if not enough bytes in buffer to sync */
-    analyzer->stream_offset += analyzer->remaining;
+
+    keep = analyzer->remaining < TS_ANALYZER_SYNC_KEEP ? analyzer->remaining : TS_ANALYZER_SYNC_KEEP;
+    ts_analyzer_discard(analyzer, analyzer->buffer, analyzer->remaining - keep);
+    if (!ts_analyzer_stage(analyzer, &analyzer->buffer[analyzer->remaining - keep], keep))
+        return;
+    analyzer->buffer += analyzer->remaining;
     analyzer->remaining = 0;
 }
 
-static bool ts_analyzer_handle_packet_internal(TsAnalyzer *analyzer)
+/* The packet at the stream offset did not start with a sync byte, search for sync from its first byte on.
+ * Sync loss is only declared if the sync byte of the next packet is corrupted as well. */
+static void ts_analyzer_sync_lost(TsAnalyzer *analyzer)
+{
+    ++analyzer->errors.sync_byte_errors;
+    analyzer->synced = 0;
+    analyzer->sync_bad = 1;
+    analyzer->sync_grid = analyzer->stream_offset + analyzer->prefix_length + analyzer->packet_length;
+}
+
+/* Check for PAT/PMT timeouts whenever the clock advances.
+ * Tables seen since the last update count as seen now, so that the coarse clock causes no false errors. */
+static void ts_analyzer_check_timeouts(TsAnalyzer *analyzer)
+{
+    if (analyzer->pat_seen_pending) {
+        analyzer->pat_seen = analyzer->clock;
+        analyzer->pat_seen_pending = 0;
+    }
+    if (analyzer->clock - analyzer->pat_seen > TS_CHECK_PSI_TIMEOUT) {
+        ++analyzer->errors.pat_errors;
+        analyzer->pat_seen = analyzer->clock;
+    }
+    size_t j;
+    for (j = 0; j < analyzer->pmt_handle_count; ++j) {
+        /* program 0 is the network pid */
+        if (analyzer->pmt_handles[j].prog_number == 0)
+            continue;
+        if (analyzer->pmt_handles[j].seen_pending) {
+            analyzer->pmt_handles[j].seen = analyzer->clock;
+            analyzer->pmt_handles[j].seen_pending = false;
+        }
+        if (analyzer->clock - analyzer->pmt_handles[j].seen > TS_CHECK_PSI_TIMEOUT) {
+            ++analyzer->errors.pmt_errors;
+            analyzer->pmt_handles[j].seen = analyzer->clock;
+        }
+    }
+}
+
+/* A packet carried a PCR. The PCR of the first pid carrying one drives the stream clock. */
+static void ts_analyzer_handle_pcr(TsAnalyzer *analyzer, uint16_t pid, const uint8_t *packet)
+{
+    uint64_t pcr = tsaf_get_pcr(packet) * 300 + tsaf_get_pcrext(packet);
+    uint64_t step;
+    size_t j;
+
+    if (analyzer->timing)
+        ts_timing_add_pcr(analyzer->timing, pid, pcr, analyzer->packet_count);
+
+    if (!analyzer->clock_valid) {
+        analyzer->clock_valid = 1;
+        analyzer->clock_pid = pid;
+        analyzer->clock_pcr = pcr;
+        if (analyzer->timing)
+            ts_timing_update_clock(analyzer->timing, analyzer->clock, false);
+        return;
+    }
+    if (pid != analyzer->clock_pid)
+        return;
+
+    step = (pcr + TS_PCR_WRAP - analyzer->clock_pcr) % TS_PCR_WRAP;
+    analyzer->clock_pcr = pcr;
+    if (step > TS_CLOCK_MAX_STEP) {
+        /* discontinuity, restart the timeouts and the bitrate window */
+        analyzer->pat_seen = analyzer->clock;
+        for (j = 0; j < analyzer->pmt_handle_count; ++j)
+            analyzer->pmt_handles[j].seen = analyzer->clock;
+        if (analyzer->timing)
+            ts_timing_update_clock(analyzer->timing, analyzer->clock, true);
+        return;
+    }
+    analyzer->clock += step;
+    if (analyzer->timing)
+        ts_timing_update_clock(analyzer->timing, analyzer->clock, false);
+    if (analyzer->checks)
+        ts_analyzer_check_timeouts(analyzer);
+}
+
+/* Continuity counter and transport error checks, see TR 101 290 1.4 and 2.1. */
+static inline void ts_analyzer_check_packet(TsAnalyzer *analyzer, const uint8_t *packet, uint16_t pid)
+{
+    TsPidCheck *check = &analyzer->checks[pid];
+    uint8_t cc;
+
+    if (ts_get_transporterror(packet)) {
+        /* the header cannot be trusted, restart the continuity check */
+        ++check->errors.transport_errors;
+        ++analyzer->errors.transport_errors;
+        check->flags &= ~TS_PID_CHECK_SEEN;
+        return;
+    }
+
+    if (ts_has_adaptation(packet) && ts_get_adaptation(packet) > 0 && tsaf_has_discontinuity(packet))
+        check->flags &= ~TS_PID_CHECK_SEEN;
+
+    /* the counter is only incremented for packets with payload */
+    if (pid == TS_NULL_PID || !ts_has_payload(packet))
+        return;
+
+    cc = ts_get_cc(packet);
+    if (check->flags & TS_PID_CHECK_SEEN) {
+        if (cc == check->cc) {
+            /* one duplicate packet is allowed */
+            if (check->flags & TS_PID_CHECK_DUPLICATE) {
+                ++check->errors.cc_errors;
+                ++analyzer->errors.cc_errors;
+            }
+            check->flags |= TS_PID_CHECK_DUPLICATE;
+            return;
+        }
+        if (cc != ((check->cc + 1) & 0xf)) {
+            ++check->errors.cc_errors;
+            ++analyzer->errors.cc_errors;
+        }
+    }
+    check->cc = cc;
+    check->flags = TS_PID_CHECK_SEEN;
+}
+
+/* Update the built-in counters of the pid. */
+static inline void ts_analyzer_count_packet(TsAnalyzer *analyzer, const uint8_t *packet, uint16_t pid)
+{
+    TsPidCounters *counters = &analyzer->counters[pid];
+    bool payload = ts_has_payload(packet);
+    bool adaptation = ts_has_adaptation(packet);
+    /* an invalid adaptation field length may leave no payload */
+    size_t header = adaptation ? TS_HEADER_SIZE + 1 + ts_get_adaptation(packet) : TS_HEADER_SIZE;
+    /* no branches on the flags, they change from packet to packet */
+    ++counters->packets;
+    counters->pusi += ts_get_unitstart(packet) != 0;
+    counters->scrambled += ts_get_scrambling(packet) != 0;
+    counters->payload_bytes += payload && header < TS_SIZE ? TS_SIZE - header : 0;
+    counters->af_only += adaptation && !payload;
+}
+
+/* Get the table id of a section starting in this packet, -1 if there is none. */
+static int ts_analyzer_get_table_id(const uint8_t *packet)
+{
+    if (!ts_get_unitstart(packet))
+        return -1;
+    const uint8_t *payload = ts_payload((uint8_t *)packet);
+    if (payload >= packet + TS_SIZE - 1 || payload + 1 + payload[0] >= packet + TS_SIZE)
+        return -1;
+    return payload[1 + payload[0]];
+}
+
+/* Push a packet to a PAT/PMT decoder, unless it repeats the last section. */
+static inline void ts_analyzer_push_psi(TsAnalyzer *analyzer, dvbpsi_t *handle, TsPsiCache *cache,
+                                        const uint8_t *packet)
+{
+    if (!analyzer->profiling) {
+        analyzer->stats.psi_packets += ts_psi_cache_push(cache, handle, packet);
+        return;
+    }
+    uint64_t start = ts_analyzer_cycles();
+    analyzer->stats.psi_packets += ts_psi_cache_push(cache, handle, packet);
+    analyzer->stats.cycles_psi += ts_analyzer_cycles() - start;
+}
+
+/* Push a packet of the SI pids to the decoder and give the SDT and EIT pids their types. */
+static inline void ts_analyzer_push_si(TsAnalyzer *analyzer, uint16_t pid, const uint8_t *packet)
+{
+    if (pid != TS_SI_PID_NIT)
+        _ts_analyzer_add_pid(analyzer, pid, pid == TS_SI_PID_SDT ? PID_TYPE_SDT : PID_TYPE_EIT);
+    if (!analyzer->profiling) {
+        ts_si_push_packet(analyzer->si, packet);
+        return;
+    }
+    uint64_t start = ts_analyzer_cycles();
+    ts_si_push_packet(analyzer->si, packet);
+    analyzer->stats.cycles_psi += ts_analyzer_cycles() - start;
+}
+
+/* Pass a packet to a handler or subscription callback. */
+static inline bool ts_analyzer_call_handler(TsAnalyzer *analyzer, TsHandlePacketFunc callback,
+                                            PidInfo *info, const uint8_t *packet, void *userdata)
+{
+    bool result;
+    if (!analyzer->profiling)
+        result = callback(info, packet, analyzer->packet_offset, userdata);
+    else {
+        uint64_t start = ts_analyzer_cycles();
+        result = callback(info, packet, analyzer->packet_offset, userdata);
+        analyzer->stats.cycles_callback += ts_analyzer_cycles() - start;
+    }
+    if (!result)
+        ++analyzer->stats.callback_failures;
+    return result;
+}
+
+/* Push a packet to the PES assembler, which calls the PES callback for every complete PES packet. */
+static inline bool ts_analyzer_push_pes(TsAnalyzer *analyzer, const uint8_t *packet)
+{
+    bool result;
+    if (!analyzer->profiling)
+        result = ts_pes_assembler_push(analyzer->pes, packet, analyzer->packet_offset);
+    else {
+        uint64_t start = ts_analyzer_cycles();
+        result = ts_pes_assembler_push(analyzer->pes, packet, analyzer->packet_offset);
+        analyzer->stats.cycles_callback += ts_analyzer_cycles() - start;
+    }
+    if (!result)
+        ++analyzer->stats.callback_failures;
+    return result;
+}
+
+/* Pass the collected packets to the batch handler. */
+static bool ts_analyzer_flush_batch(TsAnalyzer *analyzer)
+{
+    if (analyzer->batch_count == 0)
+        return true;
+    size_t count = analyzer->batch_count;
+    bool result;
+    analyzer->batch_count = 0;
+    if (!analyzer->profiling)
+        result = analyzer->klass.handle_packets(analyzer->batch, count, analyzer->cb_userdata);
+    else {
+        uint64_t start = ts_analyzer_cycles();
+        result = analyzer->klass.handle_packets(analyzer->batch, count, analyzer->cb_userdata);
+        analyzer->stats.cycles_callback += ts_analyzer_cycles() - start;
+    }
+    if (!result)
+        ++analyzer->stats.callback_failures;
+    return result;
+}
+
+/* Whether a packet is in packet_data or sync_data rather than in the pushed buffer. */
+static inline bool ts_analyzer_is_staged(TsAnalyzer *analyzer, const uint8_t *packet)
+{
+    return (packet >= analyzer->packet_data && packet < analyzer->packet_data + sizeof(analyzer->packet_data)) ||
+           (packet >= analyzer->sync_data && packet < analyzer->sync_data + sizeof(analyzer->sync_data));
+}
+
+static bool ts_analyzer_handle_packet_internal(TsAnalyzer *analyzer, const uint8_t *packet)
 {
     /* analyze pid */
-    uint16_t pid = ts_get_pid(analyzer->packet_data);
+    uint16_t pid = ts_get_pid(packet);
+    if (analyzer->checks || analyzer->timing) {
+        if (analyzer->checks)
+            ts_analyzer_check_packet(analyzer, packet, pid);
+        if (analyzer->timing)
+            ts_timing_count_packet(analyzer->timing, pid);
+        if (!ts_get_transporterror(packet) && ts_has_adaptation(packet) &&
+                ts_get_adaptation(packet) >= 7 && tsaf_has_pcr(packet))
+            ts_analyzer_handle_pcr(analyzer, pid, packet);
+    }
+    ++analyzer->packet_count;
+    if (analyzer->counters)
+        ts_analyzer_count_packet(analyzer, packet, pid);
+
+    if (analyzer->index)
+        ts_index_writer_push_packet(analyzer->index, packet, analyzer->packet_offset);
+
+    /* the staging buffers are overwritten by the next stitched or staged packets, the filter copies them */
+    if (analyzer->filter &&
+            !ts_filter_push_packet(analyzer->filter, packet, ts_analyzer_is_staged(analyzer, packet)))
+        return false;
+
     if (pid == 0) {
+        if (analyzer->checks) {
+            int table_id = ts_analyzer_get_table_id(packet);
+            if (ts_get_scrambling(packet) || table_id > 0)
+                ++analyzer->errors.pat_errors;
+            else if (table_id == 0)
+                analyzer->pat_seen_pending = 1;
+        }
         if (analyzer->pat_handle)
-            dvbpsi_packet_push(analyzer->pat_handle, analyzer->packet_data);
+            ts_analyzer_push_psi(analyzer, analyzer->pat_handle, analyzer->pat_cache, packet);
     }
     else {
         /* check for programs, push packet to handle. */
         size_t j;
         for (j = 0; j < analyzer->pmt_handle_count; ++j) {
             if (analyzer->pmt_handles[j].pid == pid) {
+                if (analyzer->checks) {
+                    if (ts_get_scrambling(packet))
+                        ++analyzer->errors.pmt_errors;
+                    else if (ts_analyzer_get_table_id(packet) == 0x02)
+                        analyzer->pmt_handles[j].seen_pending = true;
+                }
                 if (analyzer->pmt_handles[j].handle)
-                    dvbpsi_packet_push(analyzer->pmt_handles[j].handle, analyzer->packet_data);
+                    ts_analyzer_push_psi(analyzer, analyzer->pmt_handles[j].handle, analyzer->pmt_handles[j].cache, packet);
                 break;
             }
         }
     }
 
+    if (analyzer->si && pid >= TS_SI_PID_NIT && pid <= TS_SI_PID_EIT)
+        ts_analyzer_push_si(analyzer, pid, packet);
+
+    if (analyzer->pes && !ts_analyzer_push_pes(analyzer, packet))
+        return false;
+
+    TsPidSubscription *subscription = NULL;
+    if (analyzer->subscribed) {
+        if (!(analyzer->subscribed[pid >> 6] & (UINT64_C(1) << (pid & 63))))
+            return true;
+        subscription = &analyzer->subscriptions[pid];
+    }
+
     PidInfo *info = pid_info_manager_add_pid(analyzer->pmgr, pid);
 
+    if (subscription && subscription->callback) {
+        ++analyzer->stats.packets_dispatched;
+        return ts_analyzer_call_handler(analyzer, subscription->callback, info, packet, subscription->userdata);
+    }
+
+    if (analyzer->klass.handle_packets) {
+        /* collect for batch handler */
+        ++analyzer->stats.packets_dispatched;
+        TsPacketDesc *desc = &analyzer->batch[analyzer->batch_count++];
+        desc->info = info;
+        desc->packet = packet;
+        desc->offset = analyzer->packet_offset;
+        desc->prefix = analyzer->prefix_length ? packet - analyzer->prefix_length : NULL;
+        if (analyzer->batch_count == TS_ANALYZER_BATCH_MAX)
+            return ts_analyzer_flush_batch(analyzer);
+        return true;
+    }
+
+    /* without a handler the packets are only counted */
+    if (!analyzer->klass.handle_packet)
+        return true;
+
     /* pass to handler */
-    return analyzer->klass.handle_packet(info, analyzer->packet_data, analyzer->packet_offset, analyzer->cb_userdata);
+    ++analyzer->stats.packets_dispatched;
+    return ts_analyzer_call_handler(analyzer, analyzer->klass.handle_packet, info, packet, analyzer->cb_userdata);
 }
 
-static void ts_analyzer_process_packet(TsAnalyzer *analyzer)
+/* Handle the packet stitched together in packet_data. */
+static void ts_analyzer_process_packet(TsAnalyzer *analyzer, const uint8_t *packet)
 {
-    if (ts_validate(analyzer->packet_data)) {
-        if (!ts_analyzer_handle_packet_internal(analyzer))
+    if (ts_validate(packet)) {
+        if (!ts_analyzer_handle_packet_internal(analyzer, packet))
             analyzer->error_occurred = 1;
     }
     else {
-        analyzer->packet_bytes_read = 0;
-        ts_analyzer_sync_stream(analyzer);
+        /* the next packet may start within the bytes of this one, search them again */
+        analyzer->stream_offset -= analyzer->packet_length;
+        ts_analyzer_sync_lost(analyzer);
+        ts_analyzer_stage(analyzer, analyzer->packet_data, analyzer->packet_length);
+    }
+}
+
+/* Handle all complete packets at the start of the buffer without copying them.
+ * The sync bytes of all packets are validated up front. Inlined into one loop per packet length,
+ * so that the division and the strides are by constants. */
+static inline __attribute__((always_inline))
+void ts_analyzer_process_packets(TsAnalyzer *analyzer, const size_t packet_length, const size_t prefix_length)
+{
+    size_t count = analyzer->remaining / packet_length;
+    size_t valid = ts_sync_count_valid(analyzer->buffer + prefix_length, analyzer->remaining - prefix_length,
+                                       packet_length, count);
+    size_t j;
+    const uint8_t *packet;
+
+    for (j = 0; j < valid && !analyzer->error_occurred; ++j) {
+        packet = analyzer->buffer + prefix_length;
+        ts_analyzer_advance_buffer(analyzer, packet_length);
+
+        if (!ts_analyzer_handle_packet_internal(analyzer, packet))
+            analyzer->error_occurred = 1;
+
+        analyzer->packet_offset = analyzer->stream_offset;
     }
+
+    /* lost sync, find next valid packet */
+    if (valid < count && !analyzer->error_occurred)
+        ts_analyzer_sync_lost(analyzer);
+}
+
+static void ts_analyzer_process_buffer_188(TsAnalyzer *analyzer)
+{
+    ts_analyzer_process_packets(analyzer, 188, 0);
+}
+
+/* M2TS: the arrival timestamp precedes the sync byte. */
+static void ts_analyzer_process_buffer_192(TsAnalyzer *analyzer)
+{
+    ts_analyzer_process_packets(analyzer, 192, TS_SYNC_M2TS_PREFIX);
+}
+
+/* Reed-Solomon parity bytes follow the packet. */
+static void ts_analyzer_process_buffer_204(TsAnalyzer *analyzer)
+{
+    ts_analyzer_process_packets(analyzer, 204, 0);
+}
+
+/* The parse loop for a packet length, NULL if the length is not supported. */
+static TsAnalyzerProcessFunc ts_analyzer_get_process_func(size_t packet_length)
+{
+    switch (packet_length) {
+        case 188:
+            return ts_analyzer_process_buffer_188;
+        case 192:
+            return ts_analyzer_process_buffer_192;
+        case 204:
+            return ts_analyzer_process_buffer_204;
+        default:
+            return NULL;
+    }
+}
+
+/* Lock onto a packet length and select its parse loop, 0 before the stream was synchronized. */
+static void ts_analyzer_set_packet_length(TsAnalyzer *analyzer, size_t packet_length)
+{
+    analyzer->packet_length = packet_length;
+    analyzer->prefix_length = ts_sync_get_prefix_length(packet_length);
+    analyzer->process_buffer = ts_analyzer_get_process_func(packet_length);
 }
 
 static inline void ts_analyzer_read_packet_partial(TsAnalyzer *analyzer)
 {
+    /* Fast path: whole packets in the buffer, no need to copy them. */
+    if (analyzer->packet_bytes_read == 0 && analyzer->remaining >= analyzer->packet_length) {
+        analyzer->process_buffer(analyzer);
+    }
     /* Are there less bytes remaining in the buffer than there are required for a full packet. */
-    if (analyzer->remaining < analyzer->packet_length - analyzer->packet_bytes_read) {
+    else if (analyzer->remaining < analyzer->packet_length - analyzer->packet_bytes_read) {
+        /* A stitched packet in the pending batch would be overwritten. */
+        if (analyzer->packet_bytes_read == 0 && !ts_analyzer_flush_batch(analyzer)) {
+            analyzer->error_occurred = 1;
+            return;
+        }
         /* Copy all remaining bytes to the packet data. */
         memcpy(&analyzer->packet_data[analyzer->packet_bytes_read], analyzer->buffer, analyzer->remaining);
         analyzer->packet_bytes_read += analyzer->remaining;
+        analyzer->stats.stitched_bytes += analyzer->remaining;
         ts_analyzer_advance_buffer(analyzer, analyzer->remaining);
         return;
     }
     else {
-        /* Copy all bytes that are required for a full packet. */
+        /* Stitch the packet spanning two buffers: copy all bytes that are required for a full packet. */
         memcpy(&analyzer->packet_data[analyzer->packet_bytes_read], analyzer->buffer, analyzer->packet_length - analyzer->packet_bytes_read);
         ts_analyzer_advance_buffer(analyzer, analyzer->packet_length - analyzer->packet_bytes_read);
+        analyzer->stats.stitched_bytes += analyzer->packet_length - analyzer->packet_bytes_read;
+        ++analyzer->stats.stitched_packets;
 
-        ts_analyzer_process_packet(analyzer);
+        ts_analyzer_process_packet(analyzer, &analyzer->packet_data[analyzer->prefix_length]);
         analyzer->packet_bytes_read = 0;
 
         analyzer->packet_offset = analyzer->stream_offset;
@@ -272,16 +912,12 @@ TsAnalyzer *ts_analyzer_new(TsAnalyzerClass *klass, void *userdata)
         return NULL;
     if (klass)
         analyzer->klass = *klass;
-    else
-        analyzer->klass = ts_analyzer_class_fallback;
-
-    if (!analyzer->klass.handle_packet)
-        analyzer->klass.handle_packet = ts_analyzer_handle_packet_fallback;
 
     analyzer->cb_userdata = userdata;
 
     analyzer->pat_handle = dvbpsi_new(ts_analyzer_dvbpsi_message, DVBPSI_MSG_ERROR);
     dvbpsi_pat_attach(analyzer->pat_handle, (dvbpsi_pat_callback)ts_analyzer_dvbpsi_pat_cb, analyzer);
+    analyzer->pat_cache = ts_psi_cache_new();
 
     return analyzer;
 }
@@ -295,6 +931,7 @@ void ts_analyzer_free(TsAnalyzer *analyzer)
             dvbpsi_pat_detach(analyzer->pat_handle);
         dvbpsi_delete(analyzer->pat_handle);
     }
+    ts_psi_cache_free(analyzer->pat_cache);
     size_t j;
     for (j = 0; j < analyzer->pmt_handle_count; ++j) {
         if (analyzer->pmt_handles[j].handle) {
@@ -302,7 +939,14 @@ void ts_analyzer_free(TsAnalyzer *analyzer)
                 dvbpsi_pmt_detach(analyzer->pmt_handles[j].handle);
             dvbpsi_delete(analyzer->pmt_handles[j].handle);
         }
+        ts_psi_cache_free(analyzer->pmt_handles[j].cache);
     }
+    util_free(analyzer->subscribed);
+    util_free(analyzer->subscriptions);
+    util_free(analyzer->checks);
+    util_free(analyzer->counters);
+    ts_timing_free(analyzer->timing);
+    ts_pes_assembler_free(analyzer->pes);
     util_free(analyzer);
 }
 
@@ -312,17 +956,481 @@ void ts_analyzer_set_pid_info_manager(TsAnalyzer *analyzer, PidInfoManager *pmgr
         analyzer->pmgr = pmgr;
 }
 
+void ts_analyzer_set_si(TsAnalyzer *analyzer, TsSi *si)
+{
+    if (analyzer)
+        analyzer->si = si;
+}
+
+void ts_analyzer_set_index_writer(TsAnalyzer *analyzer, TsIndexWriter *index)
+{
+    if (analyzer)
+        analyzer->index = index;
+}
+
+void ts_analyzer_set_filter(TsAnalyzer *analyzer, TsFilter *filter)
+{
+    if (analyzer)
+        analyzer->filter = filter;
+}
+
+void ts_analyzer_set_stream_offset(TsAnalyzer *analyzer, size_t offset)
+{
+    if (analyzer == NULL)
+        return;
+    analyzer->stream_offset = offset;
+    analyzer->packet_offset = offset;
+    analyzer->packet_bytes_read = 0;
+    analyzer->sync_bytes = 0;
+    analyzer->synced = 0;
+    analyzer->sync_grid = 0;
+    analyzer->sync_bad = 0;
+}
+
+size_t ts_analyzer_get_stream_offset(TsAnalyzer *analyzer)
+{
+    return analyzer ? analyzer->stream_offset : 0;
+}
+
 void ts_analyzer_push_buffer(TsAnalyzer *analyzer, const uint8_t *buffer, size_t len)
 {
     /* if packet_bytes_read < 188 read min{188-packet_bytes_read,len} bytes from buffer
      * else check if byte 0 valid; if not sync stream */
+    uint64_t start = 0;
+    uint64_t measured = 0;
+    if (analyzer->profiling) {
+        start = ts_analyzer_cycles();
+        measured = analyzer->stats.cycles_psi + analyzer->stats.cycles_callback;
+    }
+
     analyzer->buffer = (uint8_t *)buffer;
     analyzer->remaining = len;
+    analyzer->stats.bytes_pushed += len;
 
-    if (analyzer->packet_bytes_read == 0 && !ts_validate(analyzer->buffer))
-        ts_analyzer_sync_stream(analyzer);
-
+    /* Synchronize first, the fast path in read_packet_partial relies on a known packet length. */
     while (analyzer->remaining && !analyzer->error_occurred) {
-        ts_analyzer_read_packet_partial(analyzer);
+        if (!analyzer->synced)
+            ts_analyzer_sync_stream(analyzer);
+        else
+            ts_analyzer_read_packet_partial(analyzer);
     }
+
+    if (!analyzer->error_occurred && !ts_analyzer_flush_batch(analyzer))
+        analyzer->error_occurred = 1;
+    analyzer->batch_count = 0;
+
+    /* the filter points into the buffer, which is only valid until we return */
+    if (analyzer->filter && !ts_filter_flush(analyzer->filter))
+        analyzer->error_occurred = 1;
+
+    /* everything not spent in PSI decoding or handlers during this call */
+    if (analyzer->profiling)
+        analyzer->stats.cycles_parse += ts_analyzer_cycles() - start -
+            (analyzer->stats.cycles_psi + analyzer->stats.cycles_callback - measured);
+}
+
+bool ts_analyzer_subscribe_pid(TsAnalyzer *analyzer, uint16_t pid, TsHandlePacketFunc callback, void *userdata)
+{
+    if (analyzer == NULL || pid >= TS_PID_COUNT)
+        return false;
+    if (!analyzer->subscribed) {
+        analyzer->subscribed = util_alloc0(TS_PID_COUNT / 8);
+        analyzer->subscriptions = util_alloc0(TS_PID_COUNT * sizeof(TsPidSubscription));
+    }
+    if (!(analyzer->subscribed[pid >> 6] & (UINT64_C(1) << (pid & 63)))) {
+        analyzer->subscribed[pid >> 6] |= UINT64_C(1) << (pid & 63);
+        ++analyzer->subscription_count;
+    }
+    analyzer->subscriptions[pid].callback = callback;
+    analyzer->subscriptions[pid].userdata = userdata;
+    return true;
+}
+
+bool ts_analyzer_subscribe_pids(TsAnalyzer *analyzer, const uint16_t *pids, size_t count,
+                                TsHandlePacketFunc callback, void *userdata)
+{
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        if (!ts_analyzer_subscribe_pid(analyzer, pids[j], callback, userdata))
+            return false;
+    }
+    return true;
+}
+
+void ts_analyzer_unsubscribe_pid(TsAnalyzer *analyzer, uint16_t pid)
+{
+    if (analyzer == NULL || analyzer->subscribed == NULL || pid >= TS_PID_COUNT)
+        return;
+    if (!(analyzer->subscribed[pid >> 6] & (UINT64_C(1) << (pid & 63))))
+        return;
+    analyzer->subscribed[pid >> 6] &= ~(UINT64_C(1) << (pid & 63));
+    if (--analyzer->subscription_count == 0) {
+        util_free(analyzer->subscribed);
+        util_free(analyzer->subscriptions);
+        analyzer->subscribed = NULL;
+        analyzer->subscriptions = NULL;
+    }
+}
+
+bool ts_analyzer_enable_pes(TsAnalyzer *analyzer, uint16_t pid, TsHandlePesFunc callback, void *userdata)
+{
+    if (analyzer == NULL || pid >= TS_PID_COUNT)
+        return false;
+    if (!analyzer->pes)
+        analyzer->pes = ts_pes_assembler_new();
+    return ts_pes_assembler_add_pid(analyzer->pes, pid, callback, userdata);
+}
+
+void ts_analyzer_disable_pes(TsAnalyzer *analyzer, uint16_t pid)
+{
+    if (analyzer && analyzer->pes)
+        ts_pes_assembler_remove_pid(analyzer->pes, pid);
+}
+
+void ts_analyzer_flush_pes(TsAnalyzer *analyzer)
+{
+    if (analyzer == NULL || analyzer->pes == NULL || analyzer->error_occurred)
+        return;
+    if (!ts_pes_assembler_flush(analyzer->pes)) {
+        ++analyzer->stats.callback_failures;
+        analyzer->error_occurred = 1;
+    }
+}
+
+bool ts_analyzer_get_pes_stats(TsAnalyzer *analyzer, TsPesStats *stats)
+{
+    if (analyzer == NULL || analyzer->pes == NULL || stats == NULL)
+        return false;
+    ts_pes_assembler_get_stats(analyzer->pes, stats);
+    return true;
+}
+
+void ts_analyzer_enable_checks(TsAnalyzer *analyzer, bool enable)
+{
+    if (analyzer == NULL)
+        return;
+    if (enable && !analyzer->checks)
+        analyzer->checks = util_alloc0(TS_PID_COUNT * sizeof(TsPidCheck));
+    else if (!enable && analyzer->checks) {
+        util_free(analyzer->checks);
+        analyzer->checks = NULL;
+    }
+}
+
+void ts_analyzer_get_errors(TsAnalyzer *analyzer, TsErrorCounters *errors)
+{
+    if (analyzer && errors)
+        *errors = analyzer->errors;
+}
+
+bool ts_analyzer_get_pid_errors(TsAnalyzer *analyzer, uint16_t pid, TsPidErrorCounters *errors)
+{
+    if (analyzer == NULL || analyzer->checks == NULL || pid >= TS_PID_COUNT || errors == NULL)
+        return false;
+    *errors = analyzer->checks[pid].errors;
+    return true;
+}
+
+void ts_analyzer_enable_counters(TsAnalyzer *analyzer, bool enable)
+{
+    if (analyzer == NULL)
+        return;
+    if (enable && !analyzer->counters)
+        analyzer->counters = util_alloc0(TS_PID_COUNT * sizeof(TsPidCounters));
+    else if (!enable && analyzer->counters) {
+        util_free(analyzer->counters);
+        analyzer->counters = NULL;
+    }
+}
+
+bool ts_analyzer_get_pid_counters(TsAnalyzer *analyzer, uint16_t pid, TsPidCounters *counters)
+{
+    if (analyzer == NULL || analyzer->counters == NULL || pid >= TS_PID_COUNT || counters == NULL)
+        return false;
+    *counters = analyzer->counters[pid];
+    counters->null_packets = pid == TS_NULL_PID ? counters->packets : 0;
+    return true;
+}
+
+bool ts_analyzer_get_counters(TsAnalyzer *analyzer, TsPidCounters *counters)
+{
+    if (analyzer == NULL || analyzer->counters == NULL || counters == NULL)
+        return false;
+    size_t pid;
+    memset(counters, 0, sizeof(TsPidCounters));
+    for (pid = 0; pid < TS_PID_COUNT; ++pid) {
+        counters->packets += analyzer->counters[pid].packets;
+        counters->payload_bytes += analyzer->counters[pid].payload_bytes;
+        counters->pusi += analyzer->counters[pid].pusi;
+        counters->scrambled += analyzer->counters[pid].scrambled;
+        counters->af_only += analyzer->counters[pid].af_only;
+    }
+    counters->null_packets = analyzer->counters[TS_NULL_PID].packets;
+    return true;
+}
+
+void ts_analyzer_enable_timing(TsAnalyzer *analyzer, bool enable)
+{
+    if (analyzer == NULL)
+        return;
+    if (enable && !analyzer->timing) {
+        analyzer->timing = ts_timing_new();
+        if (analyzer->timing && analyzer->clock_valid)
+            ts_timing_update_clock(analyzer->timing, analyzer->clock, false);
+    }
+    else if (!enable && analyzer->timing) {
+        ts_timing_free(analyzer->timing);
+        analyzer->timing = NULL;
+    }
+}
+
+uint64_t ts_analyzer_get_duration(TsAnalyzer *analyzer)
+{
+    return analyzer ? analyzer->clock : 0;
+}
+
+uint64_t ts_analyzer_get_bitrate(TsAnalyzer *analyzer)
+{
+    if (analyzer == NULL || analyzer->timing == NULL)
+        return 0;
+    return ts_timing_get_total_bitrate(analyzer->timing);
+}
+
+bool ts_analyzer_get_pid_timing(TsAnalyzer *analyzer, uint16_t pid, TsPidTiming *timing)
+{
+    if (analyzer == NULL || analyzer->timing == NULL || pid >= TS_PID_COUNT || timing == NULL)
+        return false;
+    memset(timing, 0, sizeof(TsPidTiming));
+    timing->bitrate = ts_timing_get_bitrate(analyzer->timing, pid);
+    ts_timing_get_pcr_info(analyzer->timing, pid, timing);
+    return true;
+}
+
+typedef struct {
+    TsTiming *timing;
+    uint16_t program;
+    uint64_t bitrate;
+} TsProgramBitrate;
+
+static bool _ts_analyzer_sum_program_bitrate(PidInfo *info, void *userdata)
+{
+    TsProgramBitrate *sum = userdata;
+    if (info->program == sum->program)
+        sum->bitrate += ts_timing_get_bitrate(sum->timing, info->pid);
+    return true;
+}
+
+bool ts_analyzer_get_program_timing(TsAnalyzer *analyzer, uint16_t program, TsProgramTiming *timing)
+{
+    if (analyzer == NULL || analyzer->timing == NULL || timing == NULL)
+        return false;
+    size_t j;
+    for (j = 0; j < analyzer->pmt_handle_count; ++j) {
+        if (analyzer->pmt_handles[j].prog_number == program)
+            break;
+    }
+    if (j == analyzer->pmt_handle_count)
+        return false;
+
+    TsProgramBitrate sum = { .timing = analyzer->timing, .program = program };
+    if (analyzer->pmgr)
+        pid_info_manager_enumerate_pid_infos(analyzer->pmgr, _ts_analyzer_sum_program_bitrate, &sum);
+
+    memset(timing, 0, sizeof(TsProgramTiming));
+    timing->pcr_pid = analyzer->pmt_handles[j].pcr_pid;
+    timing->bitrate = sum.bitrate;
+    if (timing->pcr_pid != TS_NULL_PID)
+        ts_analyzer_get_pid_timing(analyzer, timing->pcr_pid, &timing->pcr);
+    return true;
+}
+
+size_t ts_analyzer_get_packet_length(TsAnalyzer *analyzer)
+{
+    return analyzer ? analyzer->packet_length : 0;
+}
+
+size_t ts_analyzer_get_prefix_length(TsAnalyzer *analyzer)
+{
+    return analyzer ? analyzer->prefix_length : 0;
+}
+
+void ts_analyzer_enable_profiling(TsAnalyzer *analyzer, bool enable)
+{
+    if (analyzer)
+        analyzer->profiling = enable ? 1 : 0;
+}
+
+void ts_analyzer_get_stats(TsAnalyzer *analyzer, TsAnalyzerStats *stats)
+{
+    if (analyzer == NULL || stats == NULL)
+        return;
+    *stats = analyzer->stats;
+    stats->packets = analyzer->packet_count;
+    stats->psi_sections_skipped = analyzer->pat_cache->sections_skipped;
+    stats->psi_packets_skipped = analyzer->pat_cache->packets_skipped;
+    size_t j;
+    for (j = 0; j < analyzer->pmt_handle_count; ++j) {
+        stats->psi_sections_skipped += analyzer->pmt_handles[j].cache->sections_skipped;
+        stats->psi_packets_skipped += analyzer->pmt_handles[j].cache->packets_skipped;
+    }
+}
+
+bool ts_analyzer_save_checkpoint(TsAnalyzer *analyzer, FILE *file)
+{
+    if (analyzer == NULL || file == NULL)
+        return false;
+    TsAnalyzerCheckpoint checkpoint;
+    TsAnalyzerProgramCheckpoint program;
+    size_t j;
+
+    memset(&checkpoint, 0, sizeof(TsAnalyzerCheckpoint));
+    checkpoint.magic = TS_ANALYZER_CHECKPOINT_MAGIC;
+    checkpoint.version = TS_ANALYZER_CHECKPOINT_VERSION;
+    checkpoint.size = sizeof(TsAnalyzerCheckpoint);
+    checkpoint.check_size = sizeof(TsPidCheck);
+    checkpoint.timing_size = sizeof(TsTiming);
+    checkpoint.counters_size = sizeof(TsPidCounters);
+    checkpoint.program_size = sizeof(TsAnalyzerProgramCheckpoint);
+    checkpoint.program_count = analyzer->pmt_handle_count;
+    checkpoint.packet_bytes_read = analyzer->packet_bytes_read;
+    checkpoint.packet_length = analyzer->packet_length;
+    checkpoint.clock_pid = analyzer->clock_pid;
+    checkpoint.clock_valid = analyzer->clock_valid;
+    checkpoint.pat_seen_pending = analyzer->pat_seen_pending;
+    checkpoint.has_checks = analyzer->checks != NULL;
+    checkpoint.has_timing = analyzer->timing != NULL;
+    checkpoint.has_counters = analyzer->counters != NULL;
+    /* the staged bytes are not in stream_offset and are pushed again on resume */
+    checkpoint.synced = analyzer->synced;
+    checkpoint.sync_grid = analyzer->sync_grid;
+    checkpoint.sync_bad = analyzer->sync_bad;
+    checkpoint.stream_offset = analyzer->stream_offset;
+    checkpoint.packet_offset = analyzer->packet_offset;
+    checkpoint.packet_count = analyzer->packet_count;
+    checkpoint.clock = analyzer->clock;
+    checkpoint.clock_pcr = analyzer->clock_pcr;
+    checkpoint.pat_seen = analyzer->pat_seen;
+    memcpy(checkpoint.packet_data, analyzer->packet_data, analyzer->packet_bytes_read);
+    checkpoint.errors = analyzer->errors;
+    checkpoint.stats = analyzer->stats;
+    ts_psi_cache_save(analyzer->pat_cache, &checkpoint.pat);
+
+    if (fwrite(&checkpoint, sizeof(TsAnalyzerCheckpoint), 1, file) != 1)
+        return false;
+    if (analyzer->checks && fwrite(analyzer->checks, sizeof(TsPidCheck), TS_PID_COUNT, file) != TS_PID_COUNT)
+        return false;
+    if (analyzer->timing && fwrite(analyzer->timing, sizeof(TsTiming), 1, file) != 1)
+        return false;
+    if (analyzer->counters &&
+            fwrite(analyzer->counters, sizeof(TsPidCounters), TS_PID_COUNT, file) != TS_PID_COUNT)
+        return false;
+    for (j = 0; j < analyzer->pmt_handle_count; ++j) {
+        memset(&program, 0, sizeof(TsAnalyzerProgramCheckpoint));
+        program.prog_number = analyzer->pmt_handles[j].prog_number;
+        program.pid = analyzer->pmt_handles[j].pid;
+        program.pcr_pid = analyzer->pmt_handles[j].pcr_pid;
+        program.seen_pending = analyzer->pmt_handles[j].seen_pending;
+        program.seen = analyzer->pmt_handles[j].seen;
+        ts_psi_cache_save(analyzer->pmt_handles[j].cache, &program.cache);
+        if (fwrite(&program, sizeof(TsAnalyzerProgramCheckpoint), 1, file) != 1)
+            return false;
+    }
+    return true;
+}
+
+bool ts_analyzer_load_checkpoint(TsAnalyzer *analyzer, FILE *file)
+{
+    if (analyzer == NULL || file == NULL)
+        return false;
+    TsAnalyzerCheckpoint checkpoint;
+    TsAnalyzerProgramCheckpoint *programs = NULL;
+    TsPidCheck *checks = NULL;
+    TsTiming *timing = NULL;
+    TsPidCounters *counters = NULL;
+    DvbPsiProgInfo *info;
+    size_t j;
+
+    /* read and validate everything before the analyzer is touched */
+    if (fread(&checkpoint, sizeof(TsAnalyzerCheckpoint), 1, file) != 1 ||
+            checkpoint.magic != TS_ANALYZER_CHECKPOINT_MAGIC ||
+            checkpoint.version != TS_ANALYZER_CHECKPOINT_VERSION ||
+            checkpoint.size != sizeof(TsAnalyzerCheckpoint) || checkpoint.check_size != sizeof(TsPidCheck) ||
+            checkpoint.timing_size != sizeof(TsTiming) || checkpoint.counters_size != sizeof(TsPidCounters) ||
+            checkpoint.program_size != sizeof(TsAnalyzerProgramCheckpoint) ||
+            checkpoint.program_count > TS_ANALYZER_PROGRAMS ||
+            (checkpoint.packet_length && !ts_analyzer_get_process_func(checkpoint.packet_length)) ||
+            checkpoint.packet_bytes_read > (checkpoint.packet_length ? checkpoint.packet_length - 1 : 0) ||
+            (checkpoint.synced && !checkpoint.packet_length) || (!checkpoint.synced && checkpoint.packet_bytes_read))
+        return false;
+    /* state enabled now but missing from the checkpoint would lack the history, and the other way round
+     * the caller would get numbers it disabled */
+    if (!checkpoint.has_checks != !analyzer->checks || !checkpoint.has_timing != !analyzer->timing ||
+            !checkpoint.has_counters != !analyzer->counters)
+        return false;
+    if (checkpoint.has_checks) {
+        checks = util_alloc(TS_PID_COUNT * sizeof(TsPidCheck));
+        if (fread(checks, sizeof(TsPidCheck), TS_PID_COUNT, file) != TS_PID_COUNT)
+            goto invalid;
+    }
+    if (checkpoint.has_timing) {
+        timing = ts_timing_new();
+        if (fread(timing, sizeof(TsTiming), 1, file) != 1 || timing->slot >= TS_TIMING_SLOTS ||
+                timing->pcr_pid_count > TS_TIMING_PCR_PIDS)
+            goto invalid;
+    }
+    if (checkpoint.has_counters) {
+        counters = util_alloc(TS_PID_COUNT * sizeof(TsPidCounters));
+        if (fread(counters, sizeof(TsPidCounters), TS_PID_COUNT, file) != TS_PID_COUNT)
+            goto invalid;
+    }
+    programs = util_alloc(TS_ANALYZER_PROGRAMS * sizeof(TsAnalyzerProgramCheckpoint));
+    if (fread(programs, sizeof(TsAnalyzerProgramCheckpoint), checkpoint.program_count, file) !=
+            checkpoint.program_count)
+        goto invalid;
+
+    analyzer->stream_offset = checkpoint.stream_offset;
+    analyzer->packet_offset = checkpoint.packet_offset;
+    analyzer->packet_bytes_read = checkpoint.packet_bytes_read;
+    ts_analyzer_set_packet_length(analyzer, checkpoint.packet_length);
+    analyzer->synced = checkpoint.synced ? 1 : 0;
+    analyzer->sync_bytes = 0;
+    analyzer->sync_grid = checkpoint.sync_grid;
+    analyzer->sync_bad = checkpoint.sync_bad;
+    memcpy(analyzer->packet_data, checkpoint.packet_data, checkpoint.packet_bytes_read);
+    analyzer->packet_count = checkpoint.packet_count;
+    analyzer->clock_valid = checkpoint.clock_valid ? 1 : 0;
+    analyzer->clock_pid = checkpoint.clock_pid;
+    analyzer->clock = checkpoint.clock;
+    analyzer->clock_pcr = checkpoint.clock_pcr;
+    analyzer->pat_seen = checkpoint.pat_seen;
+    analyzer->pat_seen_pending = checkpoint.pat_seen_pending ? 1 : 0;
+    analyzer->errors = checkpoint.errors;
+    util_free(analyzer->checks);
+    analyzer->checks = checks;
+    ts_timing_free(analyzer->timing);
+    analyzer->timing = timing;
+    util_free(analyzer->counters);
+    analyzer->counters = counters;
+
+    /* the PMT decoders first, so that the replayed PAT finds the programs in their original order */
+    for (j = 0; j < checkpoint.program_count; ++j) {
+        info = ts_analyzer_dvbpsi_add_program(analyzer, programs[j].prog_number, programs[j].pid);
+        if (info == NULL)
+            continue;
+        info->pcr_pid = programs[j].pcr_pid;
+        info->seen = programs[j].seen;
+        info->seen_pending = programs[j].seen_pending;
+        ts_psi_cache_restore(info->cache, info->handle, &programs[j].cache);
+    }
+    ts_psi_cache_restore(analyzer->pat_cache, analyzer->pat_handle, &checkpoint.pat);
+    analyzer->stats = checkpoint.stats;
+    util_free(programs);
+    return true;
+
+invalid:
+    util_free(programs);
+    util_free(checks);
+    util_free(counters);
+    ts_timing_free(timing);
+    return false;
 }
@@ -3,22 +3,47 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #include "pidinfo.h"
+#include "ts-pes.h"
+#include "ts-si.h"
+#include "ts-index.h"
+#include "ts-filter.h"
 
 typedef struct _TsAnalyzer TsAnalyzer;
 
 /* Handle a packet.
  * 1. PID info
- * 2. Packet data,
- * 3. Offset (bytes consumed in analyzer),
+ * 2. Packet data, starting with the sync byte. The ts_analyzer_get_prefix_length() bytes before it
+ *    hold the TP_extra_header of 192 byte M2TS packets.
+ * 3. Offset (bytes consumed in analyzer before the packet, including its prefix),
  * 4. User data
 */
 typedef bool (*TsHandlePacketFunc)(PidInfo *, const uint8_t *, const size_t, void *);
 
+/* A packet passed to the batch handler. */
+typedef struct _TsPacketDesc {
+    PidInfo *info; /* PID info */
+    const uint8_t *packet; /* Packet data, valid until the handler returns */
+    size_t offset; /* Offset (bytes consumed in analyzer) */
+    const uint8_t *prefix; /* The TP_extra_header with the arrival timestamp of 192 byte M2TS packets, else NULL */
+} TsPacketDesc;
+
+/* Maximum number of packets passed to the batch handler at once. */
+#define TS_ANALYZER_BATCH_MAX 1024
+
+/* Handle a batch of packets from one call to ts_analyzer_push_buffer.
+ * 1. Packet descriptions in stream order,
+ * 2. Number of packets (at most TS_ANALYZER_BATCH_MAX),
+ * 3. User data
+*/
+typedef bool (*TsHandlePacketsFunc)(const TsPacketDesc *, const size_t, void *);
+
 typedef struct _TsAnalyzerClass {
     /* callbacks for packets/tables/… */
-    TsHandlePacketFunc handle_packet; /* required */
+    TsHandlePacketFunc handle_packet; /* optional, without any handler packets are only counted */
+    TsHandlePacketsFunc handle_packets; /* optional, used instead of handle_packet */
 } TsAnalyzerClass;
 
 TsAnalyzer *ts_analyzer_new(TsAnalyzerClass *klass, void *userdata);
@@ -26,4 +51,183 @@ void ts_analyzer_free(TsAnalyzer *analyzer);
 
 void ts_analyzer_set_pid_info_manager(TsAnalyzer *analyzer, PidInfoManager *pmgr);
 
+/* Decode the SDT, EIT and NIT into si, see ts-si.h, NULL to stop. The analyzer does not take ownership.
+ * The SI pids are processed regardless of the subscriptions, and the SDT and EIT pids get their PidType. */
+void ts_analyzer_set_si(TsAnalyzer *analyzer, TsSi *si);
+
+/* Add every valid packet to index, see ts-index.h, NULL to stop. The analyzer does not take ownership.
+ * Write the index with the packet length from ts_analyzer_get_packet_length after the analysis. */
+void ts_analyzer_set_index_writer(TsAnalyzer *analyzer, TsIndexWriter *index);
+
+/* Pass every valid packet to filter, see ts-filter.h, NULL to stop. The analyzer does not take ownership.
+ * The filter is flushed at the end of each ts_analyzer_push_buffer, a failed write stops the analysis. */
+void ts_analyzer_set_filter(TsAnalyzer *analyzer, TsFilter *filter);
+
+/* Set the stream offset of the next pushed byte, e.g. when starting in the middle of a file.
+ * Drops a partially read packet and the bytes kept while searching for sync, and searches for sync again. */
+void ts_analyzer_set_stream_offset(TsAnalyzer *analyzer, size_t offset);
+
+/* Get the stream offset of the first byte not handled yet. The bytes kept while searching for sync are
+ * not included, they are pushed again after resuming from a checkpoint. */
+size_t ts_analyzer_get_stream_offset(TsAnalyzer *analyzer);
+
 void ts_analyzer_push_buffer(TsAnalyzer *analyzer, const uint8_t *buffer, size_t len);
+
+/* Save the state of the analyzer between two pushes: the stream offset and partial packet, the last
+ * PAT/PMT sections, the clock, checks, timing, pid counters and internal counters. Subscriptions, PES
+ * reassembly, SI, the index writer and the filter are not saved. Save the pid info manager along with it. The format is that of this build.
+ * Returns false if the file could not be written. */
+bool ts_analyzer_save_checkpoint(TsAnalyzer *analyzer, FILE *file);
+
+/* Restore a checkpoint into a new analyzer, after the pid info manager was restored with
+ * pid_info_manager_load(), and continue pushing from ts_analyzer_get_stream_offset().
+ * The PAT/PMT sections are passed to the decoders again. Checks, timing and counters must be enabled as
+ * they were when the checkpoint was saved.
+ * Returns false if the file holds no valid checkpoint or the enabled state differs, the analyzer is
+ * unchanged then. */
+bool ts_analyzer_load_checkpoint(TsAnalyzer *analyzer, FILE *file);
+
+/* Subscribe to the packets of a pid. The packets are passed to callback with its own userdata, or
+ * to the class handlers if callback is NULL. Subscribing again replaces the callback.
+ * As long as any pid is subscribed, packets of other pids are neither passed to a handler nor added
+ * to the pid info manager. PAT/PMT are processed regardless of the subscriptions.
+ * Returns false if pid is not a valid 13 bit pid. */
+bool ts_analyzer_subscribe_pid(TsAnalyzer *analyzer, uint16_t pid, TsHandlePacketFunc callback, void *userdata);
+
+/* Subscribe to the packets of several pids with the same callback. */
+bool ts_analyzer_subscribe_pids(TsAnalyzer *analyzer, const uint16_t *pids, size_t count,
+                                TsHandlePacketFunc callback, void *userdata);
+
+/* Remove the subscription of a pid. Without any subscriptions all packets are handled again. */
+void ts_analyzer_unsubscribe_pid(TsAnalyzer *analyzer, uint16_t pid);
+
+/* Reassemble the PES packets of a pid and pass them to callback, see ts-pes.h. Enabling a pid again
+ * replaces the callback. The pid is processed regardless of the subscriptions. A callback returning false
+ * stops the analysis like a failing packet handler. Returns false if pid is not a valid 13 bit pid. */
+bool ts_analyzer_enable_pes(TsAnalyzer *analyzer, uint16_t pid, TsHandlePesFunc callback, void *userdata);
+
+/* Stop reassembling the PES packets of a pid, dropping a pending PES packet. */
+void ts_analyzer_disable_pes(TsAnalyzer *analyzer, uint16_t pid);
+
+/* Pass on the pending PES packets at the end of the stream. */
+void ts_analyzer_flush_pes(TsAnalyzer *analyzer);
+
+/* Get the counters of the PES reassembly. Returns false if it was never enabled. */
+bool ts_analyzer_get_pes_stats(TsAnalyzer *analyzer, TsPesStats *stats);
+
+/* Errors found by the built-in checks, mostly priority 1 of ETSI TR 101 290. */
+typedef struct _TsErrorCounters {
+    uint64_t sync_loss; /* 1.1 two or more consecutive corrupted sync bytes, once until sync is found again */
+    uint64_t sync_byte_errors; /* 1.2 corrupted sync bytes, up to the declared loss of sync */
+    uint64_t pat_errors; /* 1.3 no PAT for 0.5 s, other table than PAT on pid 0 or scrambled PAT */
+    uint64_t cc_errors; /* 1.4 continuity counter errors */
+    uint64_t pmt_errors; /* 1.5 no PMT for 0.5 s or scrambled PMT */
+    uint64_t transport_errors; /* 2.1 packets with transport_error_indicator set */
+} TsErrorCounters;
+
+/* Errors of a single pid found by the built-in checks. */
+typedef struct _TsPidErrorCounters {
+    uint32_t cc_errors;
+    uint32_t transport_errors;
+} TsPidErrorCounters;
+
+/* Enable the continuity counter, transport error and PAT/PMT checks on every packet.
+ * Sync errors are always counted. Timeouts use the PCR of the first pid carrying one as clock,
+ * they are not checked before the first PCR. */
+void ts_analyzer_enable_checks(TsAnalyzer *analyzer, bool enable);
+
+/* Get the errors found so far. */
+void ts_analyzer_get_errors(TsAnalyzer *analyzer, TsErrorCounters *errors);
+
+/* Get the errors of a pid found so far. Returns false if the checks are not enabled. */
+bool ts_analyzer_get_pid_errors(TsAnalyzer *analyzer, uint16_t pid, TsPidErrorCounters *errors);
+
+/* Packet counters of a pid. */
+typedef struct _TsPidCounters {
+    uint64_t packets;
+    uint64_t payload_bytes; /* bytes after the header and adaptation field */
+    uint64_t pusi; /* packets with payload_unit_start_indicator set */
+    uint64_t scrambled; /* packets with transport_scrambling_control set */
+    uint64_t af_only; /* packets with an adaptation field and no payload */
+    uint64_t null_packets; /* packets of the null pid 0x1fff */
+} TsPidCounters;
+
+/* Count the packets of every pid in a dense array updated while parsing, so that counting packets needs
+ * no handler at all. The counters cover all pids regardless of the subscriptions. */
+void ts_analyzer_enable_counters(TsAnalyzer *analyzer, bool enable);
+
+/* Get the counters of a pid. Returns false if the counters are not enabled. */
+bool ts_analyzer_get_pid_counters(TsAnalyzer *analyzer, uint16_t pid, TsPidCounters *counters);
+
+/* Get the sum of the counters of all pids. Returns false if the counters are not enabled. */
+bool ts_analyzer_get_counters(TsAnalyzer *analyzer, TsPidCounters *counters);
+
+/* Timing of a pid. Bitrates are in bits per second over the last second of the stream clock,
+ * PCR intervals and jitter in 27 MHz ticks. */
+typedef struct _TsPidTiming {
+    uint64_t bitrate; /* 0 until the clock is valid */
+    uint64_t pcr_count; /* 0 if the pid carries no PCR */
+    uint64_t pcr_bitrate; /* transport rate measured with the PCRs of this pid */
+    uint64_t pcr_interval_min;
+    uint64_t pcr_interval_max;
+    uint64_t pcr_interval_avg;
+    uint64_t pcr_jitter_max; /* maximum deviation of a PCR from a constant transport rate */
+} TsPidTiming;
+
+/* Timing of a program. */
+typedef struct _TsProgramTiming {
+    uint16_t pcr_pid; /* from the PMT, 0x1fff if unknown */
+    uint64_t bitrate; /* sum of the pids of the program, including the PMT */
+    TsPidTiming pcr; /* timing of the PCR pid */
+} TsProgramTiming;
+
+/* Enable PCR extraction and bitrate measurement. The stream clock is the PCR of the first pid
+ * carrying one. Memory use is constant, the bitrates cover a sliding window of one second. */
+void ts_analyzer_enable_timing(TsAnalyzer *analyzer, bool enable);
+
+/* Get the stream time covered by the clock in 27 MHz ticks, 0 before the second PCR.
+ * Discontinuities are skipped. Available if checks or timing are enabled. */
+uint64_t ts_analyzer_get_duration(TsAnalyzer *analyzer);
+
+/* Get the bitrate of the whole stream. Returns 0 if timing is not enabled or the clock is not valid. */
+uint64_t ts_analyzer_get_bitrate(TsAnalyzer *analyzer);
+
+/* Get the timing of a pid. Returns false if timing is not enabled. */
+bool ts_analyzer_get_pid_timing(TsAnalyzer *analyzer, uint16_t pid, TsPidTiming *timing);
+
+/* Get the timing of a program. Returns false if timing is not enabled or the program is unknown. */
+bool ts_analyzer_get_program_timing(TsAnalyzer *analyzer, uint16_t program, TsProgramTiming *timing);
+
+/* Get the detected packet length, 188, 192 or 204, 0 before the stream was synchronized. */
+size_t ts_analyzer_get_packet_length(TsAnalyzer *analyzer);
+
+/* Get the number of bytes of a packet before the sync byte, TS_SYNC_M2TS_PREFIX for 192 byte packets.
+ * They precede the packets passed to the handlers. */
+size_t ts_analyzer_get_prefix_length(TsAnalyzer *analyzer);
+
+/* Internal counters of the analyzer. They are always maintained, the cycle counts only with profiling. */
+typedef struct _TsAnalyzerStats {
+    uint64_t bytes_pushed; /* bytes passed to ts_analyzer_push_buffer */
+    uint64_t packets; /* packets starting with a sync byte */
+    uint64_t packets_dispatched; /* packets passed to a handler or subscription callback */
+    uint64_t bytes_discarded; /* bytes skipped while searching for sync */
+    uint64_t resyncs; /* times sync was found, including the initial sync */
+    uint64_t stitched_packets; /* packets spanning two pushed buffers */
+    uint64_t stitched_bytes; /* bytes copied to assemble them */
+    uint64_t psi_packets; /* packets pushed to the PAT/PMT decoders */
+    uint64_t psi_sections_skipped; /* repeated PAT/PMT sections not pushed to the decoders */
+    uint64_t psi_packets_skipped; /* packets of these sections */
+    uint64_t callback_failures; /* handler calls returning false */
+
+    /* Time spent in ts_analyzer_push_buffer: TSC cycles on x86, nanoseconds elsewhere. */
+    uint64_t cycles_parse; /* sync, parsing and checks, everything not below */
+    uint64_t cycles_psi; /* PAT/PMT decoding */
+    uint64_t cycles_callback; /* handlers, subscription callbacks, PES reassembly and its callback */
+} TsAnalyzerStats;
+
+/* Measure where the time goes in ts_analyzer_push_buffer. This reads the cycle counter around every
+ * PSI packet and handler call, so it costs a few percent of throughput. */
+void ts_analyzer_enable_profiling(TsAnalyzer *analyzer, bool enable);
+
+/* Get the internal counters. */
+void ts_analyzer_get_stats(TsAnalyzer *analyzer, TsAnalyzerStats *stats);
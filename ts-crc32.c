@@ -0,0 +1,46 @@
+#include "ts-crc32.h"
+
+#define TS_CRC32_POLYNOMIAL 0x04c11db7
+
+/* Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes, so eight bytes are
+ * folded into the CRC with eight independent lookups instead of a dependency chain of eight. */
+static uint32_t ts_crc32_table[8][256];
+
+__attribute__((constructor))
+static void ts_crc32_init(void)
+{
+    uint32_t crc;
+    unsigned int j, k;
+    for (j = 0; j < 256; ++j) {
+        crc = (uint32_t)j << 24;
+        for (k = 0; k < 8; ++k)
+            crc = crc & 0x80000000 ? (crc << 1) ^ TS_CRC32_POLYNOMIAL : crc << 1;
+        ts_crc32_table[0][j] = crc;
+    }
+    for (k = 1; k < 8; ++k) {
+        for (j = 0; j < 256; ++j) {
+            crc = ts_crc32_table[k - 1][j];
+            ts_crc32_table[k][j] = (crc << 8) ^ ts_crc32_table[0][crc >> 24];
+        }
+    }
+}
+
+uint32_t ts_crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint32_t word;
+    for (; len >= 8; data += 8, len -= 8) {
+        word = crc ^ ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3]);
+        crc = ts_crc32_table[7][word >> 24] ^ ts_crc32_table[6][(word >> 16) & 0xff] ^
+              ts_crc32_table[5][(word >> 8) & 0xff] ^ ts_crc32_table[4][word & 0xff] ^
+              ts_crc32_table[3][data[4]] ^ ts_crc32_table[2][data[5]] ^
+              ts_crc32_table[1][data[6]] ^ ts_crc32_table[0][data[7]];
+    }
+    for (; len > 0; ++data, --len)
+        crc = (crc << 8) ^ ts_crc32_table[0][(crc >> 24) ^ *data];
+    return crc;
+}
+
+uint32_t ts_crc32(const uint8_t *data, size_t len)
+{
+    return ts_crc32_update(0xffffffff, data, len);
+}
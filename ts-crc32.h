@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** The CRC32 of MPEG-2 sections (polynomial 0x04c11db7, no reflection, initial value 0xffffffff).
+ *  Computing it over a whole section including its CRC_32 field yields 0 if the section is intact.
+ *  @param[in] data The bytes.
+ *  @param[in] len The number of bytes.
+ *  @return The CRC32.
+ */
+uint32_t ts_crc32(const uint8_t *data, size_t len);
+
+/** Continue a CRC32 computed by ts_crc32 with more bytes.
+ *  @param[in] crc The CRC32 of the preceding bytes, 0xffffffff to start.
+ *  @param[in] data The bytes.
+ *  @param[in] len The number of bytes.
+ *  @return The CRC32 of all bytes.
+ */
+uint32_t ts_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
@@ -0,0 +1,329 @@
+#include "ts-filter.h"
+#include "ts-crc32.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <memory.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <bitstream/mpeg/ts.h>
+
+#define TS_FILTER_PID_COUNT 8192
+#define TS_FILTER_NULL_PID 0x1fff
+/* Entries of the I/O vector, well below IOV_MAX. A run of adjacent packets takes one entry. */
+#define TS_FILTER_IOV_COUNT 256
+/* Packets copied between two flushes. */
+#define TS_FILTER_COPY_COUNT 64
+
+#define TS_FILTER_BIT(pid) (UINT64_C(1) << ((pid) & 63))
+
+typedef struct {
+    uint16_t number;
+    uint16_t pmt_pid; /* TS_FILTER_NULL_PID until the program is in the PAT */
+    uint8_t pmt_version; /* version + 1 of the last PMT, 0 for none */
+} TsFilterProgram;
+
+struct _TsFilter {
+    int fd;
+    bool pat_rewrite;
+
+    /* Bitmaps of the pids to write and of the PMT pids of the selected programs. */
+    uint64_t selected[TS_FILTER_PID_COUNT / 64];
+    uint64_t pmt_pids[TS_FILTER_PID_COUNT / 64];
+
+    TsFilterProgram *programs;
+    size_t program_count;
+
+    /* version + 1 and transport_stream_id of the last PAT, 0 to parse the next one again */
+    uint8_t pat_version;
+    uint16_t pat_extension;
+    /* The rewritten PAT, the continuity counter is set for each packet written. */
+    uint8_t pat_packet[TS_SIZE];
+    uint8_t pat_cc;
+
+    /* The pending output, pointing into the pushed buffers and into copies. */
+    struct iovec iov[TS_FILTER_IOV_COUNT];
+    size_t iov_count;
+    size_t pending;
+    uint8_t copies[TS_FILTER_COPY_COUNT][TS_SIZE];
+    size_t copy_count;
+
+    TsFilterStats stats;
+};
+
+TsFilter *ts_filter_new(int fd)
+{
+    TsFilter *filter = util_alloc0(sizeof(TsFilter));
+    filter->fd = fd;
+    return filter;
+}
+
+void ts_filter_free(TsFilter *filter)
+{
+    if (filter == NULL)
+        return;
+    util_free(filter->programs);
+    util_free(filter);
+}
+
+void ts_filter_add_pid(TsFilter *filter, uint16_t pid)
+{
+    if (filter == NULL || pid >= TS_FILTER_PID_COUNT)
+        return;
+    filter->selected[pid >> 6] |= TS_FILTER_BIT(pid);
+    /* the rewritten PAT lists the NIT if its pid is selected */
+    filter->pat_version = 0;
+}
+
+static TsFilterProgram *ts_filter_find_program(TsFilter *filter, uint16_t program_number)
+{
+    size_t j;
+    for (j = 0; j < filter->program_count; ++j) {
+        if (filter->programs[j].number == program_number)
+            return &filter->programs[j];
+    }
+    return NULL;
+}
+
+void ts_filter_add_program(TsFilter *filter, uint16_t program_number)
+{
+    if (filter == NULL || ts_filter_find_program(filter, program_number))
+        return;
+    filter->programs = util_realloc(filter->programs, (filter->program_count + 1) * sizeof(TsFilterProgram));
+    TsFilterProgram *program = &filter->programs[filter->program_count++];
+    program->number = program_number;
+    program->pmt_pid = TS_FILTER_NULL_PID;
+    program->pmt_version = 0;
+    filter->selected[0] |= TS_FILTER_BIT(0);
+    filter->pat_version = 0;
+}
+
+void ts_filter_enable_pat_rewrite(TsFilter *filter, bool enable)
+{
+    if (filter == NULL)
+        return;
+    filter->pat_rewrite = enable;
+    filter->pat_version = 0;
+}
+
+/* Find the current section of table_id starting and ending in the packet, as PAT and PMT usually do.
+ * Returns NULL if there is none, otherwise the section and its length. */
+static const uint8_t *ts_filter_get_section(const uint8_t *packet, uint8_t table_id, size_t *length)
+{
+    const uint8_t *end = packet + TS_SIZE;
+    const uint8_t *section;
+
+    if (!ts_get_unitstart(packet) || !ts_has_payload(packet) || ts_get_scrambling(packet))
+        return NULL;
+    section = ts_payload((uint8_t *)packet);
+    if (section >= end || section + 1 + section[0] + 8 > end)
+        return NULL;
+    section += 1 + section[0];
+    *length = 3 + (((section[1] & 0x0f) << 8) | section[2]);
+    if (section + *length > end || *length < 12 || !(section[5] & 0x01) || section[0] != table_id)
+        return NULL;
+    return section;
+}
+
+/* Build the PAT packet with the selected programs of section, and the NIT if its pid is selected. */
+static void ts_filter_build_pat(TsFilter *filter, const uint8_t *section, size_t length)
+{
+    uint8_t *packet = filter->pat_packet;
+    uint8_t *out = &packet[5];
+    const uint8_t *program;
+    size_t size = 8;
+    uint32_t crc;
+
+    memset(packet, 0xff, TS_SIZE);
+    packet[0] = 0x47;
+    packet[1] = 0x40; /* payload_unit_start_indicator, pid 0 */
+    packet[2] = 0x00;
+    packet[3] = 0x10; /* payload only */
+    packet[4] = 0x00; /* pointer_field */
+    memcpy(out, section, 8);
+
+    for (program = &section[8]; program + 4 <= section + length - 4; program += 4) {
+        uint16_t number = (program[0] << 8) | program[1];
+        uint16_t pid = ((program[2] & 0x1f) << 8) | program[3];
+        bool keep = number ? ts_filter_find_program(filter, number) != NULL :
+                             (filter->selected[pid >> 6] & TS_FILTER_BIT(pid)) != 0;
+        if (keep) {
+            memcpy(&out[size], program, 4);
+            size += 4;
+        }
+    }
+
+    /* section_length counts the bytes after it, including the CRC */
+    out[1] = (out[1] & 0xf0) | (((size + 1) >> 8) & 0x0f);
+    out[2] = (size + 1) & 0xff;
+    crc = ts_crc32(out, size);
+    out[size] = crc >> 24;
+    out[size + 1] = crc >> 16;
+    out[size + 2] = crc >> 8;
+    out[size + 3] = crc;
+}
+
+/* Learn the PMT pids of the selected programs from a new PAT and rewrite it.
+ * Returns false if the packet does not carry a complete PAT. */
+static bool ts_filter_handle_pat(TsFilter *filter, const uint8_t *packet)
+{
+    const uint8_t *section;
+    const uint8_t *program;
+    TsFilterProgram *selected;
+    uint16_t extension;
+    uint8_t version;
+    size_t length;
+
+    if ((section = ts_filter_get_section(packet, 0x00, &length)) == NULL)
+        return false;
+    extension = (section[3] << 8) | section[4];
+    version = ((section[5] >> 1) & 0x1f) + 1;
+    if (filter->pat_version == version && filter->pat_extension == extension)
+        return true;
+    if (ts_crc32(section, length) != 0)
+        return false;
+    filter->pat_version = version;
+    filter->pat_extension = extension;
+
+    for (program = &section[8]; program + 4 <= section + length - 4; program += 4) {
+        uint16_t pid = ((program[2] & 0x1f) << 8) | program[3];
+        selected = ts_filter_find_program(filter, (program[0] << 8) | program[1]);
+        /* program 0 points to the NIT */
+        if (selected == NULL || selected->number == 0 || selected->pmt_pid == pid)
+            continue;
+        selected->pmt_pid = pid;
+        selected->pmt_version = 0;
+        filter->pmt_pids[pid >> 6] |= TS_FILTER_BIT(pid);
+        filter->selected[pid >> 6] |= TS_FILTER_BIT(pid);
+    }
+
+    if (filter->pat_rewrite)
+        ts_filter_build_pat(filter, section, length);
+    return true;
+}
+
+/* Select the PCR and elementary stream pids of a new PMT of a selected program. */
+static void ts_filter_handle_pmt(TsFilter *filter, uint16_t pid, const uint8_t *packet)
+{
+    const uint8_t *section;
+    const uint8_t *es;
+    const uint8_t *es_end;
+    TsFilterProgram *program;
+    uint16_t es_pid;
+    uint8_t version;
+    size_t length;
+
+    if ((section = ts_filter_get_section(packet, 0x02, &length)) == NULL)
+        return;
+    /* the PMT pid can be shared with programs that are not selected */
+    program = ts_filter_find_program(filter, (section[3] << 8) | section[4]);
+    version = ((section[5] >> 1) & 0x1f) + 1;
+    if (program == NULL || program->pmt_pid != pid || program->pmt_version == version ||
+            ts_crc32(section, length) != 0)
+        return;
+    program->pmt_version = version;
+
+    es_pid = ((section[8] & 0x1f) << 8) | section[9];
+    if (es_pid != TS_FILTER_NULL_PID)
+        filter->selected[es_pid >> 6] |= TS_FILTER_BIT(es_pid);
+
+    es_end = section + length - 4;
+    for (es = &section[12] + (((section[10] & 0x0f) << 8) | section[11]); es + 5 <= es_end;
+            es += 5 + (((es[3] & 0x0f) << 8) | es[4])) {
+        es_pid = ((es[1] & 0x1f) << 8) | es[2];
+        filter->selected[es_pid >> 6] |= TS_FILTER_BIT(es_pid);
+    }
+}
+
+/* Add a packet to the I/O vector, extending the last entry if the packet follows it. */
+static bool ts_filter_append(TsFilter *filter, const uint8_t *packet, bool copy)
+{
+    /* a flush releases the copies, so make room before copying */
+    if ((filter->iov_count == TS_FILTER_IOV_COUNT || (copy && filter->copy_count == TS_FILTER_COPY_COUNT)) &&
+            !ts_filter_flush(filter))
+        return false;
+    if (copy) {
+        packet = memcpy(filter->copies[filter->copy_count++], packet, TS_SIZE);
+        ++filter->stats.copied;
+    }
+
+    struct iovec *last = filter->iov_count ? &filter->iov[filter->iov_count - 1] : NULL;
+    if (last && (const uint8_t *)last->iov_base + last->iov_len == packet)
+        last->iov_len += TS_SIZE;
+    else {
+        last = &filter->iov[filter->iov_count++];
+        last->iov_base = (void *)packet;
+        last->iov_len = TS_SIZE;
+    }
+    filter->pending += TS_SIZE;
+    return true;
+}
+
+bool ts_filter_push_packet(TsFilter *filter, const uint8_t *packet, bool copy)
+{
+    uint16_t pid = ts_get_pid(packet);
+    if (!(filter->selected[pid >> 6] & TS_FILTER_BIT(pid)))
+        return true;
+
+    if (filter->pmt_pids[pid >> 6] & TS_FILTER_BIT(pid))
+        ts_filter_handle_pmt(filter, pid, packet);
+
+    if (pid == 0 && (filter->program_count || filter->pat_rewrite)) {
+        bool complete = ts_filter_handle_pat(filter, packet);
+        if (filter->pat_rewrite) {
+            if (!complete) {
+                ++filter->stats.pat_dropped;
+                return true;
+            }
+            /* the rewritten PAT has continuity counters of its own, as PAT packets may be dropped */
+            filter->pat_packet[3] = 0x10 | (filter->pat_cc++ & 0x0f);
+            ++filter->stats.pat_rewritten;
+            return ts_filter_append(filter, filter->pat_packet, true);
+        }
+    }
+
+    return ts_filter_append(filter, packet, copy);
+}
+
+bool ts_filter_flush(TsFilter *filter)
+{
+    struct iovec *iov = filter->iov;
+    size_t count = filter->iov_count;
+    size_t pending = filter->pending;
+    ssize_t written;
+
+    filter->iov_count = 0;
+    filter->pending = 0;
+    filter->copy_count = 0;
+
+    while (count) {
+        written = writev(filter->fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            ++filter->stats.write_errors;
+            return false;
+        }
+        ++filter->stats.writes;
+        filter->stats.bytes += written;
+        /* a short write continues in the middle of an entry */
+        while (count && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    filter->stats.packets += pending / TS_SIZE;
+    return true;
+}
+
+void ts_filter_get_stats(TsFilter *filter, TsFilterStats *stats)
+{
+    if (filter == NULL || stats == NULL)
+        return;
+    *stats = filter->stats;
+}
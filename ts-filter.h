@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Writes the packets of selected pids and programs to a file descriptor, e.g. a file or a pipe.
+ *  The packets are collected as an I/O vector pointing into the pushed buffers, runs of adjacent
+ *  packets in one entry, and written with writev() when the vector is full or on ts_filter_flush.
+ *  Packets are written as 188 byte TS packets, the timestamps of M2TS input and the parity of 204 byte
+ *  packets are dropped.
+ */
+typedef struct _TsFilter TsFilter;
+
+/** Counters of a filter. */
+typedef struct _TsFilterStats {
+    uint64_t packets; /**< Packets written. */
+    uint64_t bytes; /**< Bytes written. */
+    uint64_t writes; /**< Calls of writev(). */
+    uint64_t copied; /**< Packets copied because they did not stay valid until the next flush. */
+    uint64_t pat_rewritten; /**< PAT packets replaced by one listing the selected programs. */
+    uint64_t pat_dropped; /**< PAT packets dropped because they could not be rewritten. */
+    uint64_t write_errors; /**< Failed calls of writev(), the pending packets were dropped. */
+} TsFilterStats;
+
+/** Create a filter writing to a file descriptor.
+ *  @param[in] fd The blocking file descriptor to write to, not closed by the filter.
+ *  @return The new filter, selecting no pids.
+ */
+TsFilter *ts_filter_new(int fd);
+
+/** Free a filter. Pending packets are not written, call ts_filter_flush before.
+ *  @param[in] filter The filter to free.
+ */
+void ts_filter_free(TsFilter *filter);
+
+/** Select a pid.
+ *  @param[in] filter The filter.
+ *  @param[in] pid The pid to write.
+ */
+void ts_filter_add_pid(TsFilter *filter, uint16_t pid);
+
+/** Select a program: the PAT, its PMT and the PCR and elementary stream pids listed in the PMT.
+ *  The pids are learned from the PAT and PMT sections starting and ending in one packet and stay
+ *  selected when a new version of the PMT drops them.
+ *  @param[in] filter The filter.
+ *  @param[in] program_number The program number.
+ */
+void ts_filter_add_program(TsFilter *filter, uint16_t program_number);
+
+/** Replace the PAT by one listing only the selected programs, and the NIT if its pid is selected.
+ *  PAT packets that cannot be rewritten, e.g. because the section spans several packets, are dropped.
+ *  @param[in] filter The filter.
+ *  @param[in] enable Whether to rewrite the PAT.
+ */
+void ts_filter_enable_pat_rewrite(TsFilter *filter, bool enable);
+
+/** Add a packet to the output if its pid is selected.
+ *  @param[in] filter The filter.
+ *  @param[in] packet The packet starting with the sync byte.
+ *  @param[in] copy Whether to copy the packet, because it becomes invalid before the next ts_filter_flush.
+ *  @return False if writing failed, with errno set.
+ */
+bool ts_filter_push_packet(TsFilter *filter, const uint8_t *packet, bool copy);
+
+/** Write the pending packets. Call it before the pushed buffers become invalid.
+ *  @param[in] filter The filter.
+ *  @return False if writing failed, with errno set. The pending packets are dropped.
+ */
+bool ts_filter_flush(TsFilter *filter);
+
+/** Get the counters of a filter.
+ *  @param[in] filter The filter.
+ *  @param[out] stats The counters.
+ */
+void ts_filter_get_stats(TsFilter *filter, TsFilterStats *stats);
@@ -0,0 +1,528 @@
+#include "ts-index.h"
+#include "ts-crc32.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/pes.h>
+
+#define TS_INDEX_MAGIC 0x58495354 /* "TSIX" in little endian, a reader of the other byte order rejects it */
+#define TS_INDEX_VERSION 1
+#define TS_INDEX_PID_COUNT 8192
+#define TS_INDEX_PCR_WRAP ((UINT64_C(1) << 33) * 300)
+/* A larger step between two PCRs of a pid is a discontinuity. */
+#define TS_INDEX_PCR_JUMP (UINT64_C(10) * 27000000)
+
+enum {
+    TS_INDEX_TABLE_PSI = 0,
+    TS_INDEX_TABLE_RUN,
+    TS_INDEX_TABLE_PCR,
+    TS_INDEX_TABLE_RANDOM_ACCESS,
+    TS_INDEX_TABLE_COUNT
+};
+
+/* The file starts with the header, followed by the record arrays at the given file offsets.
+ * Every record type starts with the 64 bit offset and is a multiple of 8 bytes long. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t packet_length;
+    uint32_t segment_packets;
+    uint64_t packets;
+    uint16_t pcr_pid; /* the pid with the most PCR samples */
+    uint16_t reserved[3];
+    struct {
+        uint64_t offset;
+        uint64_t count;
+    } tables[TS_INDEX_TABLE_COUNT];
+} TsIndexHeader;
+
+static const size_t ts_index_record_size[TS_INDEX_TABLE_COUNT] = {
+    sizeof(TsIndexPsi), sizeof(TsIndexRun), sizeof(TsIndexPcr), sizeof(TsIndexRandomAccess)
+};
+
+/* The open run of a pid. */
+typedef struct {
+    uint64_t segment;
+    uint64_t first_offset;
+    uint64_t last_offset;
+    uint32_t count;
+} TsIndexRunState;
+
+typedef struct {
+    uint64_t pcr;
+    uint64_t time;
+    uint64_t offset;
+    uint64_t sample_time; /* time of the last sample */
+    bool sampled; /* the last PCR was sampled */
+} TsIndexPcrState;
+
+/* A growing array of records. */
+typedef struct {
+    uint8_t *data;
+    size_t count;
+    size_t size;
+} TsIndexArray;
+
+struct _TsIndexWriter {
+    uint64_t packets;
+    uint64_t pmt_pids[TS_INDEX_PID_COUNT / 64];
+    /* version + 1 of the last recorded PAT and PMT of each program, 0 if none */
+    uint8_t pat_version;
+    uint16_t pat_extension;
+    uint8_t pmt_versions[65536];
+
+    TsIndexRunState runs_state[TS_INDEX_PID_COUNT];
+    TsIndexPcrState *pcr_state[TS_INDEX_PID_COUNT];
+
+    TsIndexArray tables[TS_INDEX_TABLE_COUNT];
+};
+
+struct _TsIndex {
+    uint8_t *map;
+    size_t size;
+    const TsIndexHeader *header;
+    const uint8_t *tables[TS_INDEX_TABLE_COUNT];
+    size_t counts[TS_INDEX_TABLE_COUNT];
+};
+
+static void *ts_index_append(TsIndexWriter *writer, unsigned int table)
+{
+    TsIndexArray *array = &writer->tables[table];
+    size_t record_size = ts_index_record_size[table];
+    if (array->count == array->size) {
+        array->size = array->size ? 2 * array->size : 256;
+        array->data = util_realloc(array->data, array->size * record_size);
+    }
+    void *record = &array->data[array->count++ * record_size];
+    memset(record, 0, record_size);
+    return record;
+}
+
+TsIndexWriter *ts_index_writer_new(void)
+{
+    return util_alloc0(sizeof(TsIndexWriter));
+}
+
+void ts_index_writer_free(TsIndexWriter *writer)
+{
+    unsigned int j;
+    if (writer == NULL)
+        return;
+    for (j = 0; j < TS_INDEX_PID_COUNT; ++j)
+        util_free(writer->pcr_state[j]);
+    for (j = 0; j < TS_INDEX_TABLE_COUNT; ++j)
+        util_free(writer->tables[j].data);
+    util_free(writer);
+}
+
+static void ts_index_add_psi(TsIndexWriter *writer, uint16_t pid, uint64_t offset, const uint8_t *section)
+{
+    TsIndexPsi *psi = ts_index_append(writer, TS_INDEX_TABLE_PSI);
+    psi->offset = offset;
+    psi->pid = pid;
+    psi->extension = (section[3] << 8) | section[4];
+    psi->table_id = section[0];
+    psi->version = (section[5] >> 1) & 0x1f;
+}
+
+/* Record new versions of PAT and PMT sections starting in the packet and learn the PMT pids. */
+static void ts_index_handle_psi(TsIndexWriter *writer, uint16_t pid, const uint8_t *packet, uint64_t offset)
+{
+    const uint8_t *end = packet + TS_SIZE;
+    const uint8_t *section = ts_payload((uint8_t *)packet);
+    const uint8_t *program;
+    uint16_t extension;
+    uint8_t version;
+    size_t length;
+
+    if (section >= end || section + 1 + section[0] + 8 > end)
+        return;
+    section += 1 + section[0];
+    length = 3 + (((section[1] & 0x0f) << 8) | section[2]);
+    /* only current sections starting and ending in this packet, as PAT and PMT usually do */
+    if (section + length > end || length < 12 || !(section[5] & 0x01) || section[0] != (pid == 0 ? 0x00 : 0x02))
+        return;
+    extension = (section[3] << 8) | section[4];
+    version = ((section[5] >> 1) & 0x1f) + 1;
+
+    if (pid == 0) {
+        if (writer->pat_version == version && writer->pat_extension == extension)
+            return;
+        if (ts_crc32(section, length) != 0)
+            return;
+        writer->pat_version = version;
+        writer->pat_extension = extension;
+        for (program = &section[8]; program + 4 <= section + length - 4; program += 4) {
+            /* program 0 points to the NIT */
+            if (program[0] || program[1]) {
+                uint16_t pmt_pid = ((program[2] & 0x1f) << 8) | program[3];
+                writer->pmt_pids[pmt_pid >> 6] |= UINT64_C(1) << (pmt_pid & 63);
+            }
+        }
+    } else {
+        if (writer->pmt_versions[extension] == version || ts_crc32(section, length) != 0)
+            return;
+        writer->pmt_versions[extension] = version;
+    }
+    ts_index_add_psi(writer, pid, offset, section);
+}
+
+static void ts_index_flush_run(TsIndexWriter *writer, uint16_t pid)
+{
+    TsIndexRunState *state = &writer->runs_state[pid];
+    TsIndexRun *run = ts_index_append(writer, TS_INDEX_TABLE_RUN);
+    run->first_offset = state->first_offset;
+    run->last_offset = state->last_offset;
+    run->count = state->count;
+    run->pid = pid;
+    state->count = 0;
+}
+
+static void ts_index_add_pcr_sample(TsIndexWriter *writer, uint16_t pid, uint16_t flags)
+{
+    TsIndexPcrState *state = writer->pcr_state[pid];
+    TsIndexPcr *sample = ts_index_append(writer, TS_INDEX_TABLE_PCR);
+    sample->offset = state->offset;
+    sample->pcr = state->pcr;
+    sample->time = state->time;
+    sample->pid = pid;
+    sample->flags = flags;
+    state->sample_time = state->time;
+    state->sampled = true;
+}
+
+static void ts_index_handle_pcr(TsIndexWriter *writer, uint16_t pid, const uint8_t *packet, uint64_t offset)
+{
+    TsIndexPcrState *state = writer->pcr_state[pid];
+    uint64_t pcr = tsaf_get_pcr(packet) * 300 + tsaf_get_pcrext(packet);
+    uint64_t step;
+
+    if (state == NULL) {
+        state = writer->pcr_state[pid] = util_alloc0(sizeof(TsIndexPcrState));
+        state->pcr = pcr;
+        state->offset = offset;
+        ts_index_add_pcr_sample(writer, pid, 0);
+        return;
+    }
+    step = (pcr + TS_INDEX_PCR_WRAP - state->pcr) % TS_INDEX_PCR_WRAP;
+    state->pcr = pcr;
+    state->offset = offset;
+    state->sampled = false;
+    if (step > TS_INDEX_PCR_JUMP || tsaf_has_discontinuity(packet)) {
+        ts_index_add_pcr_sample(writer, pid, TS_INDEX_PCR_DISCONTINUITY);
+        return;
+    }
+    state->time += step;
+    if (state->time - state->sample_time >= TS_INDEX_PCR_INTERVAL)
+        ts_index_add_pcr_sample(writer, pid, 0);
+}
+
+static void ts_index_handle_random_access(TsIndexWriter *writer, uint16_t pid, const uint8_t *packet,
+                                          uint64_t offset)
+{
+    const uint8_t *payload = ts_payload((uint8_t *)packet);
+    TsIndexRandomAccess *point = ts_index_append(writer, TS_INDEX_TABLE_RANDOM_ACCESS);
+    point->offset = offset;
+    point->pid = pid;
+    /* the optional PES header up to the PTS, stream ids without it fail pes_validate_header */
+    if (payload + PES_HEADER_SIZE_PTS <= packet + TS_SIZE && pes_validate(payload) &&
+            pes_validate_header(payload) && pes_has_pts(payload) &&
+            pes_get_headerlength(payload) >= PES_HEADER_SIZE_PTS - PES_HEADER_SIZE_NOPTS) {
+        point->pts = pes_get_pts(payload);
+        point->flags = TS_INDEX_RANDOM_ACCESS_PTS;
+    }
+}
+
+void ts_index_writer_push_packet(TsIndexWriter *writer, const uint8_t *packet, uint64_t offset)
+{
+    uint16_t pid = ts_get_pid(packet);
+    uint64_t segment = writer->packets++ / TS_INDEX_SEGMENT_PACKETS;
+    TsIndexRunState *state = &writer->runs_state[pid];
+
+    if (state->count && state->segment != segment)
+        ts_index_flush_run(writer, pid);
+    if (state->count++ == 0) {
+        state->segment = segment;
+        state->first_offset = offset;
+    }
+    state->last_offset = offset;
+
+    if (ts_get_transporterror(packet))
+        return;
+    if (ts_get_unitstart(packet) &&
+            (pid == 0 || (writer->pmt_pids[pid >> 6] & (UINT64_C(1) << (pid & 63)))))
+        ts_index_handle_psi(writer, pid, packet, offset);
+    if (ts_has_adaptation(packet) && ts_get_adaptation(packet) > 0) {
+        if (ts_get_adaptation(packet) >= 7 && tsaf_has_pcr(packet))
+            ts_index_handle_pcr(writer, pid, packet, offset);
+        if (ts_get_unitstart(packet) && tsaf_has_randomaccess(packet))
+            ts_index_handle_random_access(writer, pid, packet, offset);
+    }
+}
+
+/* Order records of all types by pid and offset. */
+static int ts_index_compare_run(const void *a, const void *b)
+{
+    const TsIndexRun *x = a;
+    const TsIndexRun *y = b;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->first_offset < y->first_offset ? -1 : x->first_offset > y->first_offset;
+}
+
+static int ts_index_compare_pcr(const void *a, const void *b)
+{
+    const TsIndexPcr *x = a;
+    const TsIndexPcr *y = b;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int ts_index_compare_random_access(const void *a, const void *b)
+{
+    const TsIndexRandomAccess *x = a;
+    const TsIndexRandomAccess *y = b;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+bool ts_index_writer_write(TsIndexWriter *writer, const char *filename, size_t packet_length)
+{
+    TsIndexHeader header;
+    size_t counts[TS_INDEX_PID_COUNT] = { 0 };
+    const TsIndexPcr *pcr;
+    uint64_t offset = sizeof(TsIndexHeader);
+    unsigned int j;
+    size_t k;
+    FILE *file;
+    int error;
+
+    /* close the open runs and sample the last PCRs, collecting continues with new ones */
+    for (j = 0; j < TS_INDEX_PID_COUNT; ++j) {
+        if (writer->runs_state[j].count)
+            ts_index_flush_run(writer, j);
+        if (writer->pcr_state[j] && !writer->pcr_state[j]->sampled)
+            ts_index_add_pcr_sample(writer, j, 0);
+    }
+    qsort(writer->tables[TS_INDEX_TABLE_RUN].data, writer->tables[TS_INDEX_TABLE_RUN].count,
+          sizeof(TsIndexRun), ts_index_compare_run);
+    qsort(writer->tables[TS_INDEX_TABLE_PCR].data, writer->tables[TS_INDEX_TABLE_PCR].count,
+          sizeof(TsIndexPcr), ts_index_compare_pcr);
+    qsort(writer->tables[TS_INDEX_TABLE_RANDOM_ACCESS].data, writer->tables[TS_INDEX_TABLE_RANDOM_ACCESS].count,
+          sizeof(TsIndexRandomAccess), ts_index_compare_random_access);
+
+    memset(&header, 0, sizeof(TsIndexHeader));
+    header.magic = TS_INDEX_MAGIC;
+    header.version = TS_INDEX_VERSION;
+    header.packet_length = packet_length;
+    header.segment_packets = TS_INDEX_SEGMENT_PACKETS;
+    header.packets = writer->packets;
+    header.pcr_pid = TS_INDEX_ANY_PID;
+    pcr = (const TsIndexPcr *)writer->tables[TS_INDEX_TABLE_PCR].data;
+    for (k = 0; k < writer->tables[TS_INDEX_TABLE_PCR].count; ++k) {
+        if (++counts[pcr[k].pid] > (header.pcr_pid == TS_INDEX_ANY_PID ? 0 : counts[header.pcr_pid]))
+            header.pcr_pid = pcr[k].pid;
+    }
+    for (j = 0; j < TS_INDEX_TABLE_COUNT; ++j) {
+        header.tables[j].offset = offset;
+        header.tables[j].count = writer->tables[j].count;
+        offset += writer->tables[j].count * ts_index_record_size[j];
+    }
+
+    /* write next to the file and replace it, readers never see a partial index */
+    size_t name_length = strlen(filename);
+    char *temporary = util_alloc(name_length + 5);
+    memcpy(temporary, filename, name_length);
+    memcpy(&temporary[name_length], ".tmp", 5);
+    if ((file = fopen(temporary, "wb")) == NULL) {
+        util_free(temporary);
+        return false;
+    }
+    bool result = fwrite(&header, sizeof(TsIndexHeader), 1, file) == 1;
+    for (j = 0; result && j < TS_INDEX_TABLE_COUNT; ++j) {
+        if (writer->tables[j].count)
+            result = fwrite(writer->tables[j].data, ts_index_record_size[j], writer->tables[j].count, file) ==
+                     writer->tables[j].count;
+    }
+    error = errno;
+    if (fclose(file) != 0 && result) {
+        result = false;
+        error = errno;
+    }
+    if (result && rename(temporary, filename) != 0) {
+        result = false;
+        error = errno;
+    }
+    if (!result)
+        unlink(temporary);
+    util_free(temporary);
+    errno = error;
+    return result;
+}
+
+TsIndex *ts_index_open(const char *filename)
+{
+    TsIndex *index;
+    struct stat st;
+    void *map;
+    unsigned int j;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TsIndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    index = util_alloc0(sizeof(TsIndex));
+    index->map = map;
+    index->size = st.st_size;
+    index->header = map;
+    if (index->header->magic != TS_INDEX_MAGIC || index->header->version != TS_INDEX_VERSION)
+        goto invalid;
+    for (j = 0; j < TS_INDEX_TABLE_COUNT; ++j) {
+        uint64_t offset = index->header->tables[j].offset;
+        uint64_t count = index->header->tables[j].count;
+        if (offset % 8 || offset > index->size || count > (index->size - offset) / ts_index_record_size[j])
+            goto invalid;
+        index->tables[j] = &index->map[offset];
+        index->counts[j] = count;
+    }
+    return index;
+
+invalid:
+    ts_index_close(index);
+    return NULL;
+}
+
+void ts_index_close(TsIndex *index)
+{
+    if (index == NULL)
+        return;
+    munmap(index->map, index->size);
+    util_free(index);
+}
+
+void ts_index_get_info(TsIndex *index, TsIndexInfo *info)
+{
+    info->packet_length = index->header->packet_length;
+    info->packets = index->header->packets;
+    info->psi_count = index->counts[TS_INDEX_TABLE_PSI];
+    info->run_count = index->counts[TS_INDEX_TABLE_RUN];
+    info->pcr_count = index->counts[TS_INDEX_TABLE_PCR];
+    info->random_access_count = index->counts[TS_INDEX_TABLE_RANDOM_ACCESS];
+}
+
+/* The first record of a table sorted by pid and offset that is not before (pid, offset).
+ * Every record starts with its offset, the pid is at pid_offset. */
+static size_t ts_index_lower_bound(TsIndex *index, unsigned int table, size_t pid_offset, uint32_t pid,
+                                   uint64_t offset)
+{
+    const uint8_t *records = index->tables[table];
+    size_t size = ts_index_record_size[table];
+    size_t low = 0;
+    size_t high = index->counts[table];
+    size_t middle;
+    uint64_t record_offset;
+    uint16_t record_pid;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        memcpy(&record_offset, &records[middle * size], sizeof(uint64_t));
+        memcpy(&record_pid, &records[middle * size + pid_offset], sizeof(uint16_t));
+        if (record_pid < pid || (record_pid == pid && record_offset < offset))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+size_t ts_index_get_psi(TsIndex *index, const TsIndexPsi **entries)
+{
+    *entries = (const TsIndexPsi *)index->tables[TS_INDEX_TABLE_PSI];
+    return index->counts[TS_INDEX_TABLE_PSI];
+}
+
+size_t ts_index_get_pid_runs(TsIndex *index, uint16_t pid, const TsIndexRun **runs)
+{
+    size_t first = ts_index_lower_bound(index, TS_INDEX_TABLE_RUN, offsetof(TsIndexRun, pid), pid, 0);
+    size_t end = ts_index_lower_bound(index, TS_INDEX_TABLE_RUN, offsetof(TsIndexRun, pid), pid + 1, 0);
+    *runs = (const TsIndexRun *)index->tables[TS_INDEX_TABLE_RUN] + first;
+    return end - first;
+}
+
+const TsIndexRun *ts_index_find_pid(TsIndex *index, uint16_t pid, uint64_t offset)
+{
+    const TsIndexRun *runs = (const TsIndexRun *)index->tables[TS_INDEX_TABLE_RUN];
+    size_t j = ts_index_lower_bound(index, TS_INDEX_TABLE_RUN, offsetof(TsIndexRun, pid), pid, offset);
+    /* the run before may still reach offset */
+    if (j > 0 && runs[j - 1].pid == pid && runs[j - 1].last_offset >= offset)
+        return &runs[j - 1];
+    if (j < index->counts[TS_INDEX_TABLE_RUN] && runs[j].pid == pid)
+        return &runs[j];
+    return NULL;
+}
+
+bool ts_index_find_time(TsIndex *index, uint16_t pid, uint64_t time, uint64_t *offset)
+{
+    const TsIndexPcr *samples = (const TsIndexPcr *)index->tables[TS_INDEX_TABLE_PCR];
+    size_t first, end, low, high, middle;
+
+    if (pid == TS_INDEX_ANY_PID)
+        pid = index->header->pcr_pid;
+    first = ts_index_lower_bound(index, TS_INDEX_TABLE_PCR, offsetof(TsIndexPcr, pid), pid, 0);
+    end = ts_index_lower_bound(index, TS_INDEX_TABLE_PCR, offsetof(TsIndexPcr, pid), pid + 1, 0);
+    if (first == end)
+        return false;
+
+    /* the last sample not after time, time grows with the offset */
+    low = first;
+    high = end;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (samples[middle].time <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == first) {
+        *offset = samples[first].offset;
+        return true;
+    }
+    const TsIndexPcr *before = &samples[low - 1];
+    *offset = before->offset;
+    if (low == end || (samples[low].flags & TS_INDEX_PCR_DISCONTINUITY) || samples[low].time == before->time)
+        return true;
+
+    /* assume a constant rate between the samples and stay on a packet boundary */
+    const TsIndexPcr *after = &samples[low];
+    uint64_t distance = (uint64_t)((double)(after->offset - before->offset) * (time - before->time) /
+                                   (after->time - before->time));
+    size_t packet_length = index->header->packet_length ? index->header->packet_length : TS_SIZE;
+    *offset += distance / packet_length * packet_length;
+    return true;
+}
+
+const TsIndexRandomAccess *ts_index_find_random_access(TsIndex *index, uint16_t pid, uint64_t offset)
+{
+    const TsIndexRandomAccess *points = (const TsIndexRandomAccess *)index->tables[TS_INDEX_TABLE_RANDOM_ACCESS];
+    size_t j = ts_index_lower_bound(index, TS_INDEX_TABLE_RANDOM_ACCESS, offsetof(TsIndexRandomAccess, pid),
+                                    pid, offset + 1);
+    if (j > 0 && points[j - 1].pid == pid)
+        return &points[j - 1];
+    return NULL;
+}
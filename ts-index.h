@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Seek index of a recorded stream, written during the analysis and queried later through a read-only
+ *  mapping of the index file. All record arrays are sorted, so lookups are binary searches.
+ *  Offsets are stream offsets of packets as passed to the packet handlers.
+ */
+typedef struct _TsIndexWriter TsIndexWriter;
+typedef struct _TsIndex TsIndex;
+
+/** Packets of the stream covered by one TsIndexRun per pid. */
+#define TS_INDEX_SEGMENT_PACKETS 4096
+/** Minimum distance in 27 MHz ticks of the PCR samples of a pid. */
+#define TS_INDEX_PCR_INTERVAL 27000000
+/** Pass to ts_index_find_time to use the pid with the most PCR samples. */
+#define TS_INDEX_ANY_PID 0x1fff
+
+/** A new version of a PAT or PMT, recorded once per version. */
+typedef struct _TsIndexPsi {
+    uint64_t offset; /**< The packet starting the section. */
+    uint16_t pid;
+    uint16_t extension; /**< transport_stream_id of the PAT, program_number of a PMT. */
+    uint8_t table_id;
+    uint8_t version;
+    uint8_t reserved[2];
+} TsIndexPsi;
+
+/** The packets of a pid within one segment of TS_INDEX_SEGMENT_PACKETS packets. */
+typedef struct _TsIndexRun {
+    uint64_t first_offset; /**< The first packet of the pid in the segment. */
+    uint64_t last_offset; /**< The last packet of the pid in the segment. */
+    uint32_t count; /**< The packets of the pid in the segment. */
+    uint16_t pid;
+    uint16_t reserved;
+} TsIndexRun;
+
+/** The PCR jumped, time continues from the previous sample. */
+#define TS_INDEX_PCR_DISCONTINUITY 0x01
+
+/** A PCR sample, taken at most every TS_INDEX_PCR_INTERVAL, at discontinuities and at the last PCR of a pid. */
+typedef struct _TsIndexPcr {
+    uint64_t offset; /**< The packet carrying the PCR. */
+    uint64_t pcr; /**< The PCR in 27 MHz ticks. */
+    uint64_t time; /**< Stream time in 27 MHz ticks since the first PCR of the pid, without discontinuities. */
+    uint16_t pid;
+    uint16_t flags; /**< TS_INDEX_PCR_* */
+    uint32_t reserved;
+} TsIndexPcr;
+
+/** pts is valid. */
+#define TS_INDEX_RANDOM_ACCESS_PTS 0x01
+
+/** A packet starting a PES packet with the random_access_indicator set. */
+typedef struct _TsIndexRandomAccess {
+    uint64_t offset;
+    uint64_t pts; /**< The PTS of the PES packet in 90 kHz ticks if it starts in the packet. */
+    uint16_t pid;
+    uint16_t flags; /**< TS_INDEX_RANDOM_ACCESS_* */
+    uint32_t reserved;
+} TsIndexRandomAccess;
+
+/** Summary of an index. */
+typedef struct _TsIndexInfo {
+    size_t packet_length; /**< 188, 192 or 204. */
+    uint64_t packets; /**< Packets indexed. */
+    size_t psi_count;
+    size_t run_count;
+    size_t pcr_count;
+    size_t random_access_count;
+} TsIndexInfo;
+
+/** Create a writer collecting the index in memory.
+ *  @return The new writer.
+ */
+TsIndexWriter *ts_index_writer_new(void);
+
+/** Free a writer.
+ *  @param[in] writer The writer to free.
+ */
+void ts_index_writer_free(TsIndexWriter *writer);
+
+/** Add a packet to the index. Packets must be pushed in stream order.
+ *  @param[in] writer The writer.
+ *  @param[in] packet The 188 byte packet starting with the sync byte.
+ *  @param[in] offset The stream offset of the packet.
+ */
+void ts_index_writer_push_packet(TsIndexWriter *writer, const uint8_t *packet, uint64_t offset);
+
+/** Write the index file. The writer can continue to collect and write again.
+ *  @param[in] writer The writer.
+ *  @param[in] filename The name of the index file, replaced atomically if it exists.
+ *  @param[in] packet_length The packet length of the stream.
+ *  @return False if the file could not be written, with errno set.
+ */
+bool ts_index_writer_write(TsIndexWriter *writer, const char *filename, size_t packet_length);
+
+/** Map an index file.
+ *  @param[in] filename The name of the index file.
+ *  @return The index, or NULL if the file cannot be read or is no valid index.
+ */
+TsIndex *ts_index_open(const char *filename);
+
+/** Unmap an index file. Pointers into the index become invalid.
+ *  @param[in] index The index to close.
+ */
+void ts_index_close(TsIndex *index);
+
+/** Get the summary of an index.
+ *  @param[in] index The index.
+ *  @param[out] info The summary.
+ */
+void ts_index_get_info(TsIndex *index, TsIndexInfo *info);
+
+/** Get the PAT and PMT versions in stream order.
+ *  @param[in] index The index.
+ *  @param[out] entries The records.
+ *  @return The number of records.
+ */
+size_t ts_index_get_psi(TsIndex *index, const TsIndexPsi **entries);
+
+/** Get the runs of a pid in stream order.
+ *  @param[in] index The index.
+ *  @param[in] pid The pid.
+ *  @param[out] runs The runs of the pid.
+ *  @return The number of runs, 0 if the pid has no packets.
+ */
+size_t ts_index_get_pid_runs(TsIndex *index, uint16_t pid, const TsIndexRun **runs);
+
+/** Find the run containing the first packet of a pid at or after an offset.
+ *  @param[in] index The index.
+ *  @param[in] pid The pid.
+ *  @param[in] offset The stream offset.
+ *  @return The run, or NULL if the pid has no packets after offset.
+ */
+const TsIndexRun *ts_index_find_pid(TsIndex *index, uint16_t pid, uint64_t offset);
+
+/** Find the offset of a point in stream time by interpolating between the PCR samples of a pid.
+ *  @param[in] index The index.
+ *  @param[in] pid The PCR pid or TS_INDEX_ANY_PID.
+ *  @param[in] time The stream time in 27 MHz ticks since the first PCR.
+ *  @param[out] offset The offset of a packet close to time, not after it.
+ *  @return False if the pid has no PCR samples.
+ */
+bool ts_index_find_time(TsIndex *index, uint16_t pid, uint64_t time, uint64_t *offset);
+
+/** Find the last random access point of a pid at or before an offset, where decoding can start.
+ *  @param[in] index The index.
+ *  @param[in] pid The pid.
+ *  @param[in] offset The stream offset.
+ *  @return The random access point, or NULL if there is none before offset.
+ */
+const TsIndexRandomAccess *ts_index_find_random_access(TsIndex *index, uint16_t pid, uint64_t offset);
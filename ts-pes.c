@@ -0,0 +1,364 @@
+#include "ts-pes.h"
+#include "utils.h"
+
+#include <memory.h>
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/pes.h>
+
+/* PIDs are 13 bit. */
+#define TS_PID_COUNT 8192
+
+/* Initial size of a pooled buffer. Buffers keep the size of the largest PES packet they held. */
+#define TS_PES_BUFFER_MIN 4096
+/* The length of a pending PES packet before its header was read and without PES_packet_length. */
+#define TS_PES_LENGTH_UNKNOWN 0
+#define TS_PES_LENGTH_UNBOUNDED SIZE_MAX
+
+typedef struct _TsPesBuffer {
+    uint8_t *data;
+    size_t size;
+    struct _TsPesBuffer *next; /* in the pool */
+} TsPesBuffer;
+
+typedef struct _TsPesStream {
+    TsHandlePesFunc callback;
+    void *userdata;
+
+    /* The pending PES packet, NULL while waiting for the next one to start. */
+    TsPesBuffer *buffer;
+    size_t length;
+    size_t expected; /* total length from the PES header */
+    size_t offset;
+    uint8_t flags;
+
+    uint8_t cc; /* last continuity counter */
+    bool cc_valid;
+} TsPesStream;
+
+struct _TsPesAssembler {
+    /* Bitmap of the added pids and their state. */
+    uint64_t pids[TS_PID_COUNT / 64];
+    TsPesStream *streams[TS_PID_COUNT];
+
+    /* Unused buffers, the last returned is handed out first. */
+    TsPesBuffer *pool;
+
+    TsPesStats stats;
+};
+
+TsPesAssembler *ts_pes_assembler_new(void)
+{
+    return util_alloc0(sizeof(TsPesAssembler));
+}
+
+static void ts_pes_buffer_free(TsPesBuffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+    util_free(buffer->data);
+    util_free(buffer);
+}
+
+void ts_pes_assembler_free(TsPesAssembler *assembler)
+{
+    if (assembler == NULL)
+        return;
+    size_t j;
+    for (j = 0; j < TS_PID_COUNT; ++j) {
+        if (assembler->streams[j]) {
+            ts_pes_buffer_free(assembler->streams[j]->buffer);
+            util_free(assembler->streams[j]);
+        }
+    }
+    TsPesBuffer *buffer;
+    while ((buffer = assembler->pool) != NULL) {
+        assembler->pool = buffer->next;
+        ts_pes_buffer_free(buffer);
+    }
+    util_free(assembler);
+}
+
+static TsPesBuffer *ts_pes_buffer_get(TsPesAssembler *assembler)
+{
+    TsPesBuffer *buffer = assembler->pool;
+    if (buffer) {
+        assembler->pool = buffer->next;
+        return buffer;
+    }
+    ++assembler->stats.buffers;
+    return util_alloc0(sizeof(TsPesBuffer));
+}
+
+static void ts_pes_buffer_put(TsPesAssembler *assembler, TsPesBuffer *buffer)
+{
+    buffer->next = assembler->pool;
+    assembler->pool = buffer;
+}
+
+/* Grow a buffer to hold at least size bytes. */
+static void ts_pes_buffer_reserve(TsPesAssembler *assembler, TsPesBuffer *buffer, size_t size)
+{
+    if (buffer->size >= size)
+        return;
+    size_t new_size = buffer->size ? buffer->size : TS_PES_BUFFER_MIN;
+    while (new_size < size)
+        new_size *= 2;
+    buffer->data = util_realloc(buffer->data, new_size);
+    assembler->stats.buffer_bytes += new_size - buffer->size;
+    buffer->size = new_size;
+}
+
+bool ts_pes_assembler_add_pid(TsPesAssembler *assembler, uint16_t pid, TsHandlePesFunc callback, void *userdata)
+{
+    if (assembler == NULL || pid >= TS_PID_COUNT || callback == NULL)
+        return false;
+    if (!assembler->streams[pid]) {
+        assembler->streams[pid] = util_alloc0(sizeof(TsPesStream));
+        assembler->pids[pid >> 6] |= UINT64_C(1) << (pid & 63);
+    }
+    assembler->streams[pid]->callback = callback;
+    assembler->streams[pid]->userdata = userdata;
+    return true;
+}
+
+void ts_pes_assembler_remove_pid(TsPesAssembler *assembler, uint16_t pid)
+{
+    if (assembler == NULL || pid >= TS_PID_COUNT || assembler->streams[pid] == NULL)
+        return;
+    if (assembler->streams[pid]->buffer)
+        ts_pes_buffer_put(assembler, assembler->streams[pid]->buffer);
+    util_free(assembler->streams[pid]);
+    assembler->streams[pid] = NULL;
+    assembler->pids[pid >> 6] &= ~(UINT64_C(1) << (pid & 63));
+}
+
+/* Stream ids without the optional PES header, see table 2-21 of ISO/IEC 13818-1. */
+static bool ts_pes_has_header(uint8_t stream_id)
+{
+    switch (stream_id) {
+        case 0xbc: /* program_stream_map */
+        case 0xbe: /* padding_stream */
+        case 0xbf: /* private_stream_2 */
+        case 0xf0: /* ECM */
+        case 0xf1: /* EMM */
+        case 0xf2: /* DSMCC */
+        case 0xf8: /* H.222.1 type E */
+        case 0xff: /* program_stream_directory */
+            return false;
+        default:
+            return true;
+    }
+}
+
+/* Parse the PES header. Returns false if it is invalid. */
+static bool ts_pes_parse(TsPesPacket *pes, const uint8_t *data, size_t length)
+{
+    size_t header_length = PES_HEADER_SIZE;
+
+    if (length < PES_HEADER_SIZE || !pes_validate(data))
+        return false;
+    pes->stream_id = pes_get_streamid(data);
+    pes->has_pts = false;
+    pes->has_dts = false;
+    pes->pts = 0;
+    pes->dts = 0;
+
+    if (ts_pes_has_header(pes->stream_id)) {
+        if (length < PES_HEADER_SIZE_NOPTS || !pes_validate_header(data))
+            return false;
+        header_length = PES_HEADER_SIZE_NOPTS + pes_get_headerlength(data);
+        if (header_length > length)
+            return false;
+        if (pes_has_pts(data) && header_length >= PES_HEADER_SIZE_PTS) {
+            pes->has_pts = true;
+            pes->pts = pes_get_pts(data);
+            if (pes_has_dts(data) && header_length >= PES_HEADER_SIZE_PTSDTS) {
+                pes->has_dts = true;
+                pes->dts = pes_get_dts(data);
+            }
+        }
+    }
+
+    pes->data = data;
+    pes->length = length;
+    pes->payload = data + header_length;
+    pes->payload_length = length - header_length;
+    return true;
+}
+
+/* Pass a PES packet to the callback, copied is false if data points into the transport stream packet. */
+static bool ts_pes_deliver(TsPesAssembler *assembler, uint16_t pid, TsPesStream *stream,
+                           const uint8_t *data, size_t length, size_t offset, uint8_t flags, bool copied)
+{
+    TsPesPacket pes;
+    if (!ts_pes_parse(&pes, data, length)) {
+        ++assembler->stats.dropped;
+        return true;
+    }
+    pes.pid = pid;
+    pes.flags = flags;
+    pes.offset = offset;
+
+    ++assembler->stats.packets;
+    if (!copied)
+        ++assembler->stats.zero_copy;
+    if (flags & TS_PES_FLAG_DISCONTINUITY)
+        ++assembler->stats.discontinuities;
+    if (flags & TS_PES_FLAG_TRUNCATED)
+        ++assembler->stats.truncated;
+    return stream->callback(&pes, stream->userdata);
+}
+
+/* Deliver the pending PES packet of a stream and return its buffer to the pool. */
+static bool ts_pes_stream_finish(TsPesAssembler *assembler, uint16_t pid, TsPesStream *stream, uint8_t flags)
+{
+    TsPesBuffer *buffer = stream->buffer;
+    if (buffer == NULL)
+        return true;
+    stream->buffer = NULL;
+    bool result = ts_pes_deliver(assembler, pid, stream, buffer->data, stream->length, stream->offset,
+                                 stream->flags | flags, true);
+    ts_pes_buffer_put(assembler, buffer);
+    return result;
+}
+
+/* Drop the pending PES packet of a stream. */
+static void ts_pes_stream_drop(TsPesAssembler *assembler, TsPesStream *stream)
+{
+    if (stream->buffer == NULL)
+        return;
+    ts_pes_buffer_put(assembler, stream->buffer);
+    stream->buffer = NULL;
+    ++assembler->stats.dropped;
+}
+
+static bool ts_pes_stream_append(TsPesAssembler *assembler, uint16_t pid, TsPesStream *stream,
+                                 const uint8_t *data, size_t len)
+{
+    if (stream->expected == TS_PES_LENGTH_UNBOUNDED) {
+        if (stream->length + len > TS_PES_SIZE_MAX)
+            len = TS_PES_SIZE_MAX - stream->length;
+    }
+    else if (stream->expected != TS_PES_LENGTH_UNKNOWN && stream->length + len > stream->expected)
+        len = stream->expected - stream->length;
+
+    ts_pes_buffer_reserve(assembler, stream->buffer, stream->length + len);
+    memcpy(&stream->buffer->data[stream->length], data, len);
+    stream->length += len;
+    assembler->stats.bytes_copied += len;
+
+    if (stream->expected == TS_PES_LENGTH_UNKNOWN && stream->length >= PES_HEADER_SIZE) {
+        if (!pes_validate(stream->buffer->data)) {
+            ts_pes_stream_drop(assembler, stream);
+            return true;
+        }
+        size_t pes_length = pes_get_length(stream->buffer->data);
+        if (pes_length == 0)
+            stream->expected = TS_PES_LENGTH_UNBOUNDED;
+        else {
+            /* reserve the whole packet at once */
+            stream->expected = PES_HEADER_SIZE + pes_length;
+            ts_pes_buffer_reserve(assembler, stream->buffer, stream->expected);
+            if (stream->length > stream->expected)
+                stream->length = stream->expected;
+        }
+    }
+
+    if (stream->length == stream->expected)
+        return ts_pes_stream_finish(assembler, pid, stream, 0);
+    if (stream->length == TS_PES_SIZE_MAX)
+        return ts_pes_stream_finish(assembler, pid, stream, TS_PES_FLAG_TRUNCATED);
+    return true;
+}
+
+bool ts_pes_assembler_push(TsPesAssembler *assembler, const uint8_t *packet, size_t offset)
+{
+    uint16_t pid = ts_get_pid(packet);
+    if (!(assembler->pids[pid >> 6] & (UINT64_C(1) << (pid & 63))))
+        return true;
+    TsPesStream *stream = assembler->streams[pid];
+
+    if (ts_get_transporterror(packet)) {
+        /* the header cannot be trusted, restart the continuity check */
+        stream->flags |= TS_PES_FLAG_DISCONTINUITY;
+        stream->cc_valid = false;
+        return true;
+    }
+
+    bool adaptation = ts_has_adaptation(packet) && ts_get_adaptation(packet) > 0;
+    if (adaptation && tsaf_has_discontinuity(packet))
+        stream->cc_valid = false;
+    if (!ts_has_payload(packet))
+        return true;
+
+    uint8_t cc = ts_get_cc(packet);
+    if (stream->cc_valid) {
+        /* a duplicate would add its payload twice */
+        if (cc == stream->cc)
+            return true;
+        if (cc != ((stream->cc + 1) & 0xf))
+            stream->flags |= TS_PES_FLAG_DISCONTINUITY;
+    }
+    stream->cc = cc;
+    stream->cc_valid = true;
+
+    const uint8_t *payload = ts_payload((uint8_t *)packet);
+    if (payload >= packet + TS_SIZE)
+        return true;
+    size_t len = packet + TS_SIZE - payload;
+
+    if (ts_get_scrambling(packet)) {
+        ts_pes_stream_drop(assembler, stream);
+        return true;
+    }
+
+    if (ts_get_unitstart(packet)) {
+        /* the lost packets belonged to the pending PES packet, which ends here */
+        if (stream->buffer && !ts_pes_stream_finish(assembler, pid, stream,
+                    stream->expected == TS_PES_LENGTH_UNBOUNDED ? 0 : TS_PES_FLAG_TRUNCATED))
+            return false;
+
+        stream->flags = adaptation && tsaf_has_randomaccess(packet) ? TS_PES_FLAG_RANDOM_ACCESS : 0;
+        stream->offset = offset;
+
+        /* Fast path: the whole PES packet is in this payload, pass it on without copying. */
+        if (len >= PES_HEADER_SIZE && pes_validate(payload) && pes_get_length(payload) &&
+                PES_HEADER_SIZE + (size_t)pes_get_length(payload) <= len) {
+            return ts_pes_deliver(assembler, pid, stream, payload, PES_HEADER_SIZE + pes_get_length(payload),
+                                  offset, stream->flags, false);
+        }
+
+        stream->buffer = ts_pes_buffer_get(assembler);
+        stream->length = 0;
+        stream->expected = TS_PES_LENGTH_UNKNOWN;
+    }
+    else if (stream->buffer == NULL) {
+        /* wait for the start of the next PES packet */
+        return true;
+    }
+
+    return ts_pes_stream_append(assembler, pid, stream, payload, len);
+}
+
+bool ts_pes_assembler_flush(TsPesAssembler *assembler)
+{
+    if (assembler == NULL)
+        return true;
+    bool result = true;
+    size_t j;
+    for (j = 0; j < TS_PID_COUNT; ++j) {
+        TsPesStream *stream = assembler->streams[j];
+        if (stream == NULL || stream->buffer == NULL)
+            continue;
+        if (!ts_pes_stream_finish(assembler, j, stream,
+                    stream->expected == TS_PES_LENGTH_UNBOUNDED ? 0 : TS_PES_FLAG_TRUNCATED))
+            result = false;
+    }
+    return result;
+}
+
+void ts_pes_assembler_get_stats(TsPesAssembler *assembler, TsPesStats *stats)
+{
+    if (assembler && stats)
+        *stats = assembler->stats;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Reassemble PES packets from the transport stream packets of selected pids. */
+typedef struct _TsPesAssembler TsPesAssembler;
+
+/** Packets of this PES packet were lost, found by the continuity counter or a transport error. */
+#define TS_PES_FLAG_DISCONTINUITY 0x01
+/** The PES packet is incomplete: the next one started before PES_packet_length was reached, the stream
+ *  ended or a PES packet without PES_packet_length exceeded TS_PES_SIZE_MAX. */
+#define TS_PES_FLAG_TRUNCATED 0x02
+/** The random_access_indicator was set in the first transport stream packet. */
+#define TS_PES_FLAG_RANDOM_ACCESS 0x04
+
+/** PES packets without PES_packet_length are cut at this size. */
+#define TS_PES_SIZE_MAX ((size_t)16 << 20)
+
+/** A complete PES packet. */
+typedef struct _TsPesPacket {
+    uint16_t pid; /**< The pid carrying the PES packet. */
+    uint8_t stream_id; /**< The stream_id from the PES header. */
+    uint8_t flags; /**< TS_PES_FLAG_* */
+    bool has_pts; /**< pts is valid. */
+    bool has_dts; /**< dts is valid. */
+    uint64_t pts; /**< Presentation time stamp in 90 kHz ticks. */
+    uint64_t dts; /**< Decoding time stamp in 90 kHz ticks. */
+    const uint8_t *data; /**< The whole PES packet starting with the start code. */
+    size_t length; /**< The length of data. */
+    const uint8_t *payload; /**< The elementary stream data following the PES header. */
+    size_t payload_length; /**< The length of payload. */
+    size_t offset; /**< The stream offset of the transport stream packet the PES packet started in. */
+} TsPesPacket;
+
+/** Handle a PES packet.
+ *  The data is only valid until the callback returns, it points either into a pooled buffer or,
+ *  if the PES packet fitted into one transport stream packet, directly into that packet.
+ *  Returns false to stop the analysis.
+ */
+typedef bool (*TsHandlePesFunc)(const TsPesPacket *, void *);
+
+/** Counters of an assembler. */
+typedef struct _TsPesStats {
+    uint64_t packets; /**< PES packets delivered. */
+    uint64_t zero_copy; /**< PES packets delivered without copying. */
+    uint64_t bytes_copied; /**< Bytes copied to pooled buffers. */
+    uint64_t discontinuities; /**< PES packets delivered with TS_PES_FLAG_DISCONTINUITY. */
+    uint64_t truncated; /**< PES packets delivered with TS_PES_FLAG_TRUNCATED. */
+    uint64_t dropped; /**< PES packets dropped, without start code, with an invalid header or scrambled. */
+    uint64_t buffers; /**< Buffers allocated for the pool. */
+    size_t buffer_bytes; /**< Memory held by the pool. */
+} TsPesStats;
+
+/** Create an assembler without any pids.
+ *  @return The new assembler.
+ */
+TsPesAssembler *ts_pes_assembler_new(void);
+
+/** Free an assembler. Pending PES packets are not delivered.
+ *  @param[in] assembler The assembler to free.
+ */
+void ts_pes_assembler_free(TsPesAssembler *assembler);
+
+/** Reassemble the PES packets of a pid. Adding a pid again replaces the callback.
+ *  @param[in] assembler The assembler.
+ *  @param[in] pid The pid.
+ *  @param[in] callback The function receiving the PES packets.
+ *  @param[in] userdata The userdata passed to callback.
+ *  @return False if pid is not a valid 13 bit pid or callback is NULL.
+ */
+bool ts_pes_assembler_add_pid(TsPesAssembler *assembler, uint16_t pid, TsHandlePesFunc callback, void *userdata);
+
+/** Stop reassembling the PES packets of a pid, dropping a pending PES packet.
+ *  Must not be called from a TsHandlePesFunc.
+ *  @param[in] assembler The assembler.
+ *  @param[in] pid The pid.
+ */
+void ts_pes_assembler_remove_pid(TsPesAssembler *assembler, uint16_t pid);
+
+/** Push a transport stream packet. Packets of other pids are ignored.
+ *  @param[in] assembler The assembler.
+ *  @param[in] packet The 188 byte packet starting with the sync byte.
+ *  @param[in] offset The stream offset of the packet.
+ *  @return False if a callback returned false.
+ */
+bool ts_pes_assembler_push(TsPesAssembler *assembler, const uint8_t *packet, size_t offset);
+
+/** Deliver the pending PES packets, e.g. at the end of the stream. PES packets without a
+ *  PES_packet_length, as usual for video, are only complete when the next one starts.
+ *  @param[in] assembler The assembler.
+ *  @return False if a callback returned false.
+ */
+bool ts_pes_assembler_flush(TsPesAssembler *assembler);
+
+/** Get the counters of an assembler.
+ *  @param[in] assembler The assembler.
+ *  @param[out] stats The counters.
+ */
+void ts_pes_assembler_get_stats(TsPesAssembler *assembler, TsPesStats *stats);
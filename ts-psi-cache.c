@@ -0,0 +1,185 @@
+#include "ts-psi-cache.h"
+#include "utils.h"
+
+#include <memory.h>
+#include <bitstream/mpeg/ts.h>
+
+TsPsiCache *ts_psi_cache_new(void)
+{
+    TsPsiCache *cache = util_alloc0(sizeof(TsPsiCache));
+    cache->cached = cache->buffers[0];
+    cache->record = cache->buffers[1];
+    cache->decoder_cc = 0xf;
+    return cache;
+}
+
+void ts_psi_cache_free(TsPsiCache *cache)
+{
+    util_free(cache);
+}
+
+/* Compare two packets of the pid, except for the continuity counter. */
+static inline bool ts_psi_cache_equal(const uint8_t *packet, const uint8_t *cached)
+{
+    return packet[1] == cached[1] && (packet[3] & 0xf0) == (cached[3] & 0xf0) &&
+           memcmp(&packet[4], &cached[4], TS_PSI_CACHE_PACKET_SIZE - 4) == 0;
+}
+
+static bool ts_psi_cache_is_stuffing(const uint8_t *data, size_t len)
+{
+    size_t j;
+    for (j = 0; j < len; ++j) {
+        if (data[j] != 0xff)
+            return false;
+    }
+    return true;
+}
+
+/* Pass a copy of the packet to the decoder, numbered consecutively unless packets were lost.
+ * The cached section is no longer the last one the decoder saw, unless the recording completes. */
+static void ts_psi_cache_decode(TsPsiCache *cache, dvbpsi_t *handle, const uint8_t *packet)
+{
+    uint8_t copy[TS_PSI_CACHE_PACKET_SIZE];
+    memcpy(copy, packet, TS_PSI_CACHE_PACKET_SIZE);
+    cache->decoder_cc = (cache->decoder_cc + (cache->loss ? 2 : 1)) & 0xf;
+    copy[3] = (copy[3] & 0xf0) | cache->decoder_cc;
+    cache->loss = false;
+    cache->cached_count = 0;
+    dvbpsi_packet_push(handle, copy);
+}
+
+/* Record a packet carrying len bytes of the section at data, keeping the section once it is complete. */
+static TsPsiCacheState ts_psi_cache_record(TsPsiCache *cache, const uint8_t *packet, const uint8_t *data, size_t len)
+{
+    memcpy(cache->record[cache->record_count++], packet, TS_PSI_CACHE_PACKET_SIZE);
+    if (cache->record_missing > len) {
+        cache->record_missing -= len;
+        return cache->record_count < TS_PSI_CACHE_PACKETS ? TS_PSI_CACHE_RECORDING : TS_PSI_CACHE_IDLE;
+    }
+
+    /* another section must not follow in the last packet */
+    if (ts_psi_cache_is_stuffing(&data[cache->record_missing], len - cache->record_missing)) {
+        uint8_t (*cached)[TS_PSI_CACHE_PACKET_SIZE] = cache->cached;
+        cache->cached = cache->record;
+        cache->record = cached;
+        cache->cached_count = cache->record_count;
+    }
+    return TS_PSI_CACHE_IDLE;
+}
+
+/* Start recording with the first packet of a section. */
+static TsPsiCacheState ts_psi_cache_record_start(TsPsiCache *cache, const uint8_t *packet)
+{
+    const uint8_t *payload = ts_payload((uint8_t *)packet);
+    /* the section has to start right after the pointer_field, with its length in this packet */
+    if (payload + 4 > packet + TS_PSI_CACHE_PACKET_SIZE || payload[0] != 0)
+        return TS_PSI_CACHE_IDLE;
+    cache->record_count = 0;
+    cache->record_missing = 3 + (((payload[2] & 0x0f) << 8) | payload[3]);
+    return ts_psi_cache_record(cache, packet, &payload[1], packet + TS_PSI_CACHE_PACKET_SIZE - payload - 1);
+}
+
+static TsPsiCacheState ts_psi_cache_record_next(TsPsiCache *cache, const uint8_t *packet)
+{
+    const uint8_t *payload = ts_payload((uint8_t *)packet);
+    if (payload >= packet + TS_PSI_CACHE_PACKET_SIZE)
+        return TS_PSI_CACHE_IDLE;
+    return ts_psi_cache_record(cache, packet, payload, packet + TS_PSI_CACHE_PACKET_SIZE - payload);
+}
+
+size_t ts_psi_cache_push(TsPsiCache *cache, dvbpsi_t *handle, const uint8_t *packet)
+{
+    size_t pushed = 0;
+    size_t j;
+
+    if (ts_get_transporterror(packet)) {
+        /* the header cannot be trusted, handle the packet as lost */
+        cache->loss = true;
+        cache->cc_valid = false;
+        cache->state = TS_PSI_CACHE_IDLE;
+        return 0;
+    }
+    if (ts_has_adaptation(packet) && ts_get_adaptation(packet) > 0 && tsaf_has_discontinuity(packet))
+        cache->cc_valid = false;
+    if (!ts_has_payload(packet))
+        return 0;
+
+    uint8_t cc = ts_get_cc(packet);
+    if (cache->cc_valid) {
+        if (cc == cache->cc)
+            return 0; /* duplicate */
+        if (cc != ((cache->cc + 1) & 0xf)) {
+            cache->loss = true;
+            cache->state = TS_PSI_CACHE_IDLE;
+        }
+    }
+    cache->cc = cc;
+    cache->cc_valid = true;
+
+    if (ts_get_unitstart(packet)) {
+        /* an unfinished repetition or recording is abandoned */
+        if (cache->cached_count && ts_psi_cache_equal(packet, cache->cached[0])) {
+            cache->matched = 1;
+            cache->state = TS_PSI_CACHE_MATCHING;
+            if (cache->cached_count == 1) {
+                ++cache->sections_skipped;
+                ++cache->packets_skipped;
+                cache->state = TS_PSI_CACHE_IDLE;
+            }
+            return 0;
+        }
+        ts_psi_cache_decode(cache, handle, packet);
+        cache->state = ts_psi_cache_record_start(cache, packet);
+        return 1;
+    }
+
+    if (cache->state == TS_PSI_CACHE_MATCHING) {
+        if (ts_psi_cache_equal(packet, cache->cached[cache->matched])) {
+            if (++cache->matched == cache->cached_count) {
+                ++cache->sections_skipped;
+                cache->packets_skipped += cache->cached_count;
+                cache->state = TS_PSI_CACHE_IDLE;
+            }
+            return 0;
+        }
+        /* not a repetition after all, pass on the skipped packets, they equal the cached ones */
+        ts_psi_cache_decode(cache, handle, cache->cached[0]);
+        cache->state = ts_psi_cache_record_start(cache, cache->cached[0]);
+        for (j = 1; j < cache->matched; ++j) {
+            ts_psi_cache_decode(cache, handle, cache->cached[j]);
+            cache->state = ts_psi_cache_record_next(cache, cache->cached[j]);
+        }
+        pushed = cache->matched;
+    }
+
+    ts_psi_cache_decode(cache, handle, packet);
+    if (cache->state == TS_PSI_CACHE_RECORDING)
+        cache->state = ts_psi_cache_record_next(cache, packet);
+    return pushed + 1;
+}
+
+void ts_psi_cache_save(TsPsiCache *cache, TsPsiCacheCheckpoint *checkpoint)
+{
+    memset(checkpoint, 0, sizeof(TsPsiCacheCheckpoint));
+    memcpy(checkpoint->packets, cache->cached, cache->cached_count * TS_PSI_CACHE_PACKET_SIZE);
+    checkpoint->count = cache->cached_count;
+    checkpoint->cc = cache->cc;
+    checkpoint->cc_valid = cache->cc_valid;
+    checkpoint->sections_skipped = cache->sections_skipped;
+    checkpoint->packets_skipped = cache->packets_skipped;
+}
+
+void ts_psi_cache_restore(TsPsiCache *cache, dvbpsi_t *handle, const TsPsiCacheCheckpoint *checkpoint)
+{
+    size_t count = checkpoint->count < TS_PSI_CACHE_PACKETS ? checkpoint->count : TS_PSI_CACHE_PACKETS;
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ts_psi_cache_decode(cache, handle, checkpoint->packets[j]);
+    memcpy(cache->cached, checkpoint->packets, count * TS_PSI_CACHE_PACKET_SIZE);
+    cache->cached_count = count;
+    cache->state = TS_PSI_CACHE_IDLE;
+    cache->cc = checkpoint->cc;
+    cache->cc_valid = checkpoint->cc_valid;
+    cache->sections_skipped = checkpoint->sections_skipped;
+    cache->packets_skipped = checkpoint->packets_skipped;
+}
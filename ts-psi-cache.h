@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <dvbpsi/dvbpsi.h>
+
+#define TS_PSI_CACHE_PACKET_SIZE 188
+/* Packets of the longest section kept, PAT and PMT sections have at most 1024 bytes. */
+#define TS_PSI_CACHE_PACKETS 6
+
+typedef enum {
+    TS_PSI_CACHE_IDLE = 0,
+    TS_PSI_CACHE_MATCHING, /* a repetition of the cached section is being skipped */
+    TS_PSI_CACHE_RECORDING /* a new section is being passed to the decoder and recorded */
+} TsPsiCacheState;
+
+/* The packets of the last section passed to the decoder of a PSI pid. Repetitions are recognized by
+ * comparing their packets, which covers table_id, extension, version and CRC32, and are not passed on.
+ * Only sections starting a payload and followed by stuffing are kept, as multiplexers send PAT/PMT. */
+typedef struct _TsPsiCache {
+    /* The cached section and the one being recorded, swapped when the recording is complete. */
+    uint8_t buffers[2][TS_PSI_CACHE_PACKETS][TS_PSI_CACHE_PACKET_SIZE];
+    uint8_t (*cached)[TS_PSI_CACHE_PACKET_SIZE];
+    uint8_t (*record)[TS_PSI_CACHE_PACKET_SIZE];
+    size_t cached_count; /* 0 if nothing is cached */
+    size_t record_count;
+    size_t record_missing; /* section bytes still to be recorded */
+
+    TsPsiCacheState state;
+    size_t matched; /* packets of the repetition skipped so far */
+
+    /* continuity counter of the stream and of the packets passed to the decoder */
+    uint8_t cc;
+    bool cc_valid;
+    uint8_t decoder_cc;
+    bool loss; /* packets were lost since the last packet passed to the decoder */
+
+    uint64_t sections_skipped;
+    uint64_t packets_skipped;
+} TsPsiCache;
+
+/* What a checkpoint keeps of a cache: the cached section and the continuity of the stream. */
+typedef struct _TsPsiCacheCheckpoint {
+    uint8_t packets[TS_PSI_CACHE_PACKETS][TS_PSI_CACHE_PACKET_SIZE];
+    uint32_t count;
+    uint8_t cc;
+    bool cc_valid;
+    uint64_t sections_skipped;
+    uint64_t packets_skipped;
+} TsPsiCacheCheckpoint;
+
+TsPsiCache *ts_psi_cache_new(void);
+void ts_psi_cache_free(TsPsiCache *cache);
+
+/* Pass a packet of the pid to the decoder unless it belongs to a repetition of the cached section.
+ * The decoder gets copies with continuity counters that hide the skipped packets.
+ * Returns the number of packets passed, more than one if a supposed repetition turned out to differ. */
+size_t ts_psi_cache_push(TsPsiCache *cache, dvbpsi_t *handle, const uint8_t *packet);
+
+void ts_psi_cache_save(TsPsiCache *cache, TsPsiCacheCheckpoint *checkpoint);
+
+/* Restore a new cache and pass the cached section to the new decoder of the pid, so that the decoder
+ * knows the current version and its repetitions are skipped again. A section being received is lost. */
+void ts_psi_cache_restore(TsPsiCache *cache, dvbpsi_t *handle, const TsPsiCacheCheckpoint *checkpoint);
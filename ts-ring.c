@@ -0,0 +1,149 @@
+#include "ts-ring.h"
+#include "utils.h"
+
+#include <sched.h>
+#include <time.h>
+
+/* Keep the producer and consumer state on different cache lines. */
+#define TS_RING_CACHE_LINE 64
+
+/* Waiting for the other thread: busy polls, then yields, then short sleeps. */
+#define TS_RING_SPIN 64
+#define TS_RING_YIELD 16
+#define TS_RING_SLEEP_NS 50000
+
+struct _TsRing {
+    uint8_t *memory;
+    size_t *lengths;
+    size_t slab_size;
+    size_t slab_count;
+
+    uint8_t pad0[TS_RING_CACHE_LINE];
+
+    /* Written by the producer: slabs committed so far, the last tail it saw and the counters. */
+    uint64_t head;
+    uint64_t cached_tail;
+    bool closed;
+    TsRingStats stats;
+
+    uint8_t pad1[TS_RING_CACHE_LINE];
+
+    /* Written by the consumer: slabs released so far and the last head it saw. */
+    uint64_t tail;
+    uint64_t cached_head;
+
+    uint8_t pad2[TS_RING_CACHE_LINE];
+};
+
+static void ts_ring_backoff(unsigned int *attempt)
+{
+    if (*attempt < TS_RING_SPIN) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else if (*attempt < TS_RING_SPIN + TS_RING_YIELD) {
+        sched_yield();
+    }
+    else {
+        struct timespec delay = { 0, TS_RING_SLEEP_NS };
+        nanosleep(&delay, NULL);
+    }
+    ++*attempt;
+}
+
+TsRing *ts_ring_new(size_t slab_count, size_t slab_size)
+{
+    TsRing *ring = util_alloc0(sizeof(TsRing));
+    if (slab_count < 2)
+        slab_count = 2;
+    if (slab_size == 0)
+        slab_size = TS_RING_PACKET_ALIGN;
+    ring->slab_size = (slab_size + TS_RING_PACKET_ALIGN - 1) / TS_RING_PACKET_ALIGN * TS_RING_PACKET_ALIGN;
+    ring->slab_count = slab_count;
+    ring->memory = util_alloc(ring->slab_count * ring->slab_size);
+    ring->lengths = util_alloc0(ring->slab_count * sizeof(size_t));
+    ring->stats.slab_count = slab_count;
+    return ring;
+}
+
+void ts_ring_free(TsRing *ring)
+{
+    if (ring == NULL)
+        return;
+    util_free(ring->memory);
+    util_free(ring->lengths);
+    util_free(ring);
+}
+
+size_t ts_ring_get_slab_size(TsRing *ring)
+{
+    return ring->slab_size;
+}
+
+uint8_t *ts_ring_acquire(TsRing *ring, bool wait)
+{
+    unsigned int attempt = 0;
+    while (ring->head - ring->cached_tail >= ring->slab_count) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->cached_tail < ring->slab_count)
+            break;
+        if (!wait) {
+            ++ring->stats.overruns;
+            return NULL;
+        }
+        ts_ring_backoff(&attempt);
+    }
+    return &ring->memory[(ring->head % ring->slab_count) * ring->slab_size];
+}
+
+void ts_ring_commit(TsRing *ring, size_t len)
+{
+    ring->lengths[ring->head % ring->slab_count] = len;
+
+    size_t filled = ring->head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    if (filled > ring->stats.high_water_mark)
+        ring->stats.high_water_mark = filled;
+    ++ring->stats.slabs_written;
+    ring->stats.bytes_written += len;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void ts_ring_close(TsRing *ring)
+{
+    __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+const uint8_t *ts_ring_peek(TsRing *ring, size_t *len, bool wait)
+{
+    unsigned int attempt = 0;
+    while (ring->cached_head == ring->tail) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->cached_head != ring->tail)
+            break;
+        if (!wait)
+            return NULL;
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            /* slabs committed before closing are visible now */
+            ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (ring->cached_head == ring->tail)
+                return NULL;
+            break;
+        }
+        ts_ring_backoff(&attempt);
+    }
+    *len = ring->lengths[ring->tail % ring->slab_count];
+    return &ring->memory[(ring->tail % ring->slab_count) * ring->slab_size];
+}
+
+void ts_ring_release(TsRing *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void ts_ring_get_stats(TsRing *ring, TsRingStats *stats)
+{
+    if (ring && stats)
+        *stats = ring->stats;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A lock-free ring of fixed size slabs passing data from one producer thread to one consumer thread. */
+typedef struct _TsRing TsRing;
+
+/** Slab size divisible by the 188, 192 and 204 byte packet lengths, their least common multiple 2^6*3*17*47. */
+#define TS_RING_PACKET_ALIGN 153408
+
+/** Counters of a ring. */
+typedef struct _TsRingStats {
+    uint64_t slabs_written; /**< Slabs committed by the producer. */
+    uint64_t bytes_written; /**< Bytes committed by the producer. */
+    uint64_t overruns; /**< Failed attempts to acquire a slab because the ring was full. */
+    size_t high_water_mark; /**< Maximum number of slabs filled at once. */
+    size_t slab_count; /**< Number of slabs in the ring. */
+} TsRingStats;
+
+/** Create a ring.
+ *  @param[in] slab_count The number of slabs, at least 2.
+ *  @param[in] slab_size The size of a slab, rounded up to a multiple of TS_RING_PACKET_ALIGN.
+ *  @return The new ring.
+ */
+TsRing *ts_ring_new(size_t slab_count, size_t slab_size);
+
+/** Free a ring. Both threads must be done with it.
+ *  @param[in] ring The ring to free.
+ */
+void ts_ring_free(TsRing *ring);
+
+/** Get the size of the slabs.
+ *  @param[in] ring The ring.
+ *  @return The slab size.
+ */
+size_t ts_ring_get_slab_size(TsRing *ring);
+
+/** Get an empty slab to fill, producer only.
+ *  @param[in] ring The ring.
+ *  @param[in] wait Wait for the consumer if the ring is full. Otherwise an overrun is counted.
+ *  @return The slab, or NULL if the ring is full and wait is false.
+ */
+uint8_t *ts_ring_acquire(TsRing *ring, bool wait);
+
+/** Pass the slab returned by the last ts_ring_acquire to the consumer, producer only.
+ *  @param[in] ring The ring.
+ *  @param[in] len The number of bytes written to the slab.
+ */
+void ts_ring_commit(TsRing *ring, size_t len);
+
+/** Signal the consumer that no more slabs will be committed, producer only.
+ *  @param[in] ring The ring.
+ */
+void ts_ring_close(TsRing *ring);
+
+/** Get the oldest filled slab, consumer only.
+ *  @param[in] ring The ring.
+ *  @param[out] len The number of bytes in the slab.
+ *  @param[in] wait Wait for the producer if the ring is empty.
+ *  @return The slab, or NULL if the ring is empty and wait is false or the ring is closed.
+ */
+const uint8_t *ts_ring_peek(TsRing *ring, size_t *len, bool wait);
+
+/** Return the slab returned by the last ts_ring_peek to the producer, consumer only.
+ *  @param[in] ring The ring.
+ */
+void ts_ring_release(TsRing *ring);
+
+/** Get the counters of a ring. Only exact after both threads stopped using it.
+ *  @param[in] ring The ring.
+ *  @param[out] stats The counters.
+ */
+void ts_ring_get_stats(TsRing *ring, TsRingStats *stats);
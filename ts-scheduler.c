@@ -0,0 +1,399 @@
+#include "ts-scheduler.h"
+#include "utils.h"
+
+#include <memory.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Queued data is kept in chunks from a pool shared by all streams. */
+#define TS_SCHEDULER_CHUNK_SIZE ((size_t)64 << 10)
+
+typedef struct _TsSchedulerChunk {
+    struct _TsSchedulerChunk *next;
+    size_t len;
+    uint8_t data[TS_SCHEDULER_CHUNK_SIZE];
+} TsSchedulerChunk;
+
+typedef struct {
+    pthread_t thread;
+    TsScheduler *scheduler;
+    unsigned int index;
+
+    /* streams ready to run, linked by next_ready */
+    pthread_mutex_t lock;
+    TsSchedulerStream *head;
+    TsSchedulerStream *tail;
+} TsSchedulerWorker;
+
+struct _TsSchedulerStream {
+    TsScheduler *scheduler;
+    TsAnalyzer *analyzer;
+    PidInfoManager *pmgr;
+    TsSchedulerWorker *home; /* the worker the stream is queued at when data arrives */
+
+    pthread_mutex_t lock;
+    pthread_cond_t analyzed; /* signalled when queued data was analyzed */
+    TsSchedulerChunk *head;
+    TsSchedulerChunk *tail;
+    size_t queue_limit;
+    /* Queued at a worker or running. Only one worker runs a stream, which keeps its data in order. */
+    bool scheduled;
+    TsSchedulerStreamStats stats;
+
+    TsSchedulerStream *next_ready;
+    /* all streams of the scheduler */
+    TsSchedulerStream *prev;
+    TsSchedulerStream *next;
+};
+
+struct _TsScheduler {
+    TsSchedulerWorker *workers;
+    unsigned int thread_count;
+    unsigned int next_home;
+
+    /* stream list and sleeping workers */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    TsSchedulerStream *streams;
+    size_t stream_count;
+    size_t ready; /* streams in the worker queues, updated atomically */
+    bool stopping;
+
+    pthread_mutex_t pool_lock;
+    TsSchedulerChunk *free_chunks;
+    uint64_t chunks;
+
+    uint64_t runs; /* updated atomically */
+    uint64_t steals;
+};
+
+static TsSchedulerChunk *ts_scheduler_chunk_get(TsScheduler *scheduler)
+{
+    TsSchedulerChunk *chunk;
+    pthread_mutex_lock(&scheduler->pool_lock);
+    chunk = scheduler->free_chunks;
+    if (chunk)
+        scheduler->free_chunks = chunk->next;
+    else
+        ++scheduler->chunks;
+    pthread_mutex_unlock(&scheduler->pool_lock);
+
+    if (chunk == NULL)
+        chunk = util_alloc(sizeof(TsSchedulerChunk));
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+static void ts_scheduler_chunk_put(TsScheduler *scheduler, TsSchedulerChunk *chunk)
+{
+    pthread_mutex_lock(&scheduler->pool_lock);
+    chunk->next = scheduler->free_chunks;
+    scheduler->free_chunks = chunk;
+    pthread_mutex_unlock(&scheduler->pool_lock);
+}
+
+/* Append a stream to the queue of a worker and wake up a sleeping worker. */
+static void ts_scheduler_enqueue(TsScheduler *scheduler, TsSchedulerWorker *worker, TsSchedulerStream *stream)
+{
+    pthread_mutex_lock(&worker->lock);
+    stream->next_ready = NULL;
+    if (worker->tail)
+        worker->tail->next_ready = stream;
+    else
+        __atomic_store_n(&worker->head, stream, __ATOMIC_RELAXED);
+    worker->tail = stream;
+    pthread_mutex_unlock(&worker->lock);
+
+    __atomic_add_fetch(&scheduler->ready, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&scheduler->lock);
+    pthread_cond_signal(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static TsSchedulerStream *ts_scheduler_dequeue(TsScheduler *scheduler, TsSchedulerWorker *worker)
+{
+    TsSchedulerStream *stream;
+    /* do not lock queues that are empty anyway */
+    if (__atomic_load_n(&worker->head, __ATOMIC_RELAXED) == NULL)
+        return NULL;
+    pthread_mutex_lock(&worker->lock);
+    stream = worker->head;
+    if (stream) {
+        __atomic_store_n(&worker->head, stream->next_ready, __ATOMIC_RELAXED);
+        if (worker->head == NULL)
+            worker->tail = NULL;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (stream)
+        __atomic_sub_fetch(&scheduler->ready, 1, __ATOMIC_RELAXED);
+    return stream;
+}
+
+/* Take the next stream from the own queue, or steal one from the other workers. */
+static TsSchedulerStream *ts_scheduler_next(TsScheduler *scheduler, TsSchedulerWorker *worker)
+{
+    TsSchedulerStream *stream = ts_scheduler_dequeue(scheduler, worker);
+    unsigned int j;
+    for (j = 1; stream == NULL && j < scheduler->thread_count; ++j) {
+        stream = ts_scheduler_dequeue(scheduler, &scheduler->workers[(worker->index + j) % scheduler->thread_count]);
+        if (stream)
+            __atomic_add_fetch(&scheduler->steals, 1, __ATOMIC_RELAXED);
+    }
+    return stream;
+}
+
+/* Analyze the queued data of a stream, up to TS_SCHEDULER_QUANTUM bytes. */
+static void ts_scheduler_run(TsScheduler *scheduler, TsSchedulerWorker *worker, TsSchedulerStream *stream)
+{
+    TsSchedulerChunk *chunk;
+    size_t done = 0;
+
+    __atomic_add_fetch(&scheduler->runs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&stream->lock);
+    ++stream->stats.runs;
+    while (done < TS_SCHEDULER_QUANTUM && (chunk = stream->head) != NULL) {
+        stream->head = chunk->next;
+        if (stream->head == NULL)
+            stream->tail = NULL;
+        pthread_mutex_unlock(&stream->lock);
+
+        ts_analyzer_push_buffer(stream->analyzer, chunk->data, chunk->len);
+        done += chunk->len;
+
+        pthread_mutex_lock(&stream->lock);
+        stream->stats.queued -= chunk->len;
+        stream->stats.bytes_analyzed += chunk->len;
+        pthread_cond_broadcast(&stream->analyzed);
+        ts_scheduler_chunk_put(scheduler, chunk);
+    }
+
+    if (stream->head == NULL) {
+        stream->scheduled = false;
+        pthread_cond_broadcast(&stream->analyzed);
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    /* let the other streams run first */
+    ts_scheduler_enqueue(scheduler, worker, stream);
+}
+
+static void *ts_scheduler_worker(void *userdata)
+{
+    TsSchedulerWorker *worker = userdata;
+    TsScheduler *scheduler = worker->scheduler;
+    TsSchedulerStream *stream;
+    bool stop = false;
+
+    while (!stop) {
+        if ((stream = ts_scheduler_next(scheduler, worker)) != NULL) {
+            ts_scheduler_run(scheduler, worker, stream);
+            continue;
+        }
+        pthread_mutex_lock(&scheduler->lock);
+        while (__atomic_load_n(&scheduler->ready, __ATOMIC_ACQUIRE) == 0 && !scheduler->stopping)
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+        stop = scheduler->stopping && __atomic_load_n(&scheduler->ready, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    return NULL;
+}
+
+TsScheduler *ts_scheduler_new(unsigned int threads)
+{
+    TsScheduler *scheduler = util_alloc0(sizeof(TsScheduler));
+    unsigned int j;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    pthread_mutex_init(&scheduler->pool_lock, NULL);
+
+    scheduler->workers = util_alloc0(threads * sizeof(TsSchedulerWorker));
+    for (j = 0; j < threads; ++j) {
+        scheduler->workers[j].scheduler = scheduler;
+        scheduler->workers[j].index = j;
+        pthread_mutex_init(&scheduler->workers[j].lock, NULL);
+    }
+    scheduler->thread_count = threads;
+    for (j = 0; j < threads; ++j) {
+        /* like a failed allocation */
+        if (pthread_create(&scheduler->workers[j].thread, NULL, ts_scheduler_worker, &scheduler->workers[j]) != 0)
+            exit(1);
+    }
+    return scheduler;
+}
+
+void ts_scheduler_free(TsScheduler *scheduler)
+{
+    TsSchedulerChunk *chunk;
+    unsigned int j;
+
+    if (scheduler == NULL)
+        return;
+    while (scheduler->streams)
+        ts_scheduler_remove_stream(scheduler->streams);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (j = 0; j < scheduler->thread_count; ++j)
+        pthread_join(scheduler->workers[j].thread, NULL);
+    for (j = 0; j < scheduler->thread_count; ++j)
+        pthread_mutex_destroy(&scheduler->workers[j].lock);
+
+    while ((chunk = scheduler->free_chunks) != NULL) {
+        scheduler->free_chunks = chunk->next;
+        util_free(chunk);
+    }
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->wake);
+    pthread_mutex_destroy(&scheduler->pool_lock);
+    util_free(scheduler->workers);
+    util_free(scheduler);
+}
+
+TsSchedulerStream *ts_scheduler_add_stream(TsScheduler *scheduler, TsAnalyzerClass *klass, void *userdata,
+                                           size_t queue_limit)
+{
+    TsSchedulerStream *stream = util_alloc0(sizeof(TsSchedulerStream));
+    stream->scheduler = scheduler;
+    stream->pmgr = pid_info_manager_new();
+    stream->analyzer = ts_analyzer_new(klass, userdata);
+    ts_analyzer_set_pid_info_manager(stream->analyzer, stream->pmgr);
+    stream->queue_limit = queue_limit ? queue_limit : TS_SCHEDULER_QUEUE_LIMIT;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->analyzed, NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+    /* spread the streams over the workers, stealing evens out the rest */
+    stream->home = &scheduler->workers[scheduler->next_home++ % scheduler->thread_count];
+    stream->next = scheduler->streams;
+    if (scheduler->streams)
+        scheduler->streams->prev = stream;
+    scheduler->streams = stream;
+    ++scheduler->stream_count;
+    pthread_mutex_unlock(&scheduler->lock);
+    return stream;
+}
+
+void ts_scheduler_remove_stream(TsSchedulerStream *stream)
+{
+    TsScheduler *scheduler;
+    if (stream == NULL)
+        return;
+    scheduler = stream->scheduler;
+    ts_scheduler_stream_drain(stream);
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (stream->prev)
+        stream->prev->next = stream->next;
+    else
+        scheduler->streams = stream->next;
+    if (stream->next)
+        stream->next->prev = stream->prev;
+    --scheduler->stream_count;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    ts_analyzer_free(stream->analyzer);
+    pid_info_manager_free(stream->pmgr);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->analyzed);
+    util_free(stream);
+}
+
+TsAnalyzer *ts_scheduler_stream_get_analyzer(TsSchedulerStream *stream)
+{
+    return stream ? stream->analyzer : NULL;
+}
+
+PidInfoManager *ts_scheduler_stream_get_pid_info_manager(TsSchedulerStream *stream)
+{
+    return stream ? stream->pmgr : NULL;
+}
+
+bool ts_scheduler_push(TsSchedulerStream *stream, const uint8_t *data, size_t len, bool wait)
+{
+    TsSchedulerChunk *chunk;
+    size_t count;
+    bool schedule;
+
+    if (stream == NULL || len == 0)
+        return true;
+    pthread_mutex_lock(&stream->lock);
+    /* a push larger than the limit is accepted into an empty queue */
+    while (stream->stats.queued > 0 && stream->stats.queued + len > stream->queue_limit) {
+        if (!wait) {
+            stream->stats.bytes_dropped += len;
+            pthread_mutex_unlock(&stream->lock);
+            return false;
+        }
+        pthread_cond_wait(&stream->analyzed, &stream->lock);
+    }
+
+    stream->stats.queued += len;
+    stream->stats.bytes_pushed += len;
+    while (len > 0) {
+        /* the last chunk is still queued, never in the hands of a worker */
+        chunk = stream->tail;
+        if (chunk == NULL || chunk->len == TS_SCHEDULER_CHUNK_SIZE) {
+            chunk = ts_scheduler_chunk_get(stream->scheduler);
+            if (stream->tail)
+                stream->tail->next = chunk;
+            else
+                stream->head = chunk;
+            stream->tail = chunk;
+        }
+        count = TS_SCHEDULER_CHUNK_SIZE - chunk->len;
+        if (count > len)
+            count = len;
+        memcpy(&chunk->data[chunk->len], data, count);
+        chunk->len += count;
+        data += count;
+        len -= count;
+    }
+    schedule = !stream->scheduled;
+    stream->scheduled = true;
+    pthread_mutex_unlock(&stream->lock);
+
+    if (schedule)
+        ts_scheduler_enqueue(stream->scheduler, stream->home, stream);
+    return true;
+}
+
+void ts_scheduler_stream_drain(TsSchedulerStream *stream)
+{
+    if (stream == NULL)
+        return;
+    pthread_mutex_lock(&stream->lock);
+    while (stream->scheduled)
+        pthread_cond_wait(&stream->analyzed, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void ts_scheduler_stream_get_stats(TsSchedulerStream *stream, TsSchedulerStreamStats *stats)
+{
+    pthread_mutex_lock(&stream->lock);
+    *stats = stream->stats;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void ts_scheduler_get_stats(TsScheduler *scheduler, TsSchedulerStats *stats)
+{
+    memset(stats, 0, sizeof(TsSchedulerStats));
+    stats->threads = scheduler->thread_count;
+    pthread_mutex_lock(&scheduler->lock);
+    stats->streams = scheduler->stream_count;
+    pthread_mutex_unlock(&scheduler->lock);
+    pthread_mutex_lock(&scheduler->pool_lock);
+    stats->chunks = scheduler->chunks;
+    pthread_mutex_unlock(&scheduler->pool_lock);
+    stats->runs = __atomic_load_n(&scheduler->runs, __ATOMIC_RELAXED);
+    stats->steals = __atomic_load_n(&scheduler->steals, __ATOMIC_RELAXED);
+}
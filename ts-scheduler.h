@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ts-analyzer.h"
+
+/** Analyze many streams on a fixed pool of worker threads.
+ *  Each stream has its own analyzer and pid info manager. The data pushed to a stream is queued and
+ *  analyzed in push order by one worker at a time, so the callbacks of one stream never run
+ *  concurrently, while those of different streams do. A stream with queued data waits in the queue
+ *  of one worker; idle workers steal from the queues of the others, and a stream is put back to the
+ *  end of the queue after TS_SCHEDULER_QUANTUM bytes so that a busy stream does not starve the others.
+ */
+typedef struct _TsScheduler TsScheduler;
+
+/** A stream hosted by a scheduler. */
+typedef struct _TsSchedulerStream TsSchedulerStream;
+
+/** Bytes analyzed in one go before the worker turns to other streams. */
+#define TS_SCHEDULER_QUANTUM ((size_t)1 << 20)
+/** Default limit of the data queued for a stream. */
+#define TS_SCHEDULER_QUEUE_LIMIT ((size_t)16 << 20)
+
+/** Counters of a stream. */
+typedef struct _TsSchedulerStreamStats {
+    uint64_t bytes_pushed; /**< Bytes accepted by ts_scheduler_push. */
+    uint64_t bytes_analyzed; /**< Bytes passed to the analyzer. */
+    uint64_t bytes_dropped; /**< Bytes not accepted because the queue was full. */
+    uint64_t runs; /**< Times a worker picked up the stream. */
+    size_t queued; /**< Bytes waiting to be analyzed. */
+} TsSchedulerStreamStats;
+
+/** Counters of a scheduler. */
+typedef struct _TsSchedulerStats {
+    unsigned int threads; /**< Number of workers. */
+    size_t streams; /**< Streams currently hosted. */
+    uint64_t runs; /**< Times a worker picked up a stream. */
+    uint64_t steals; /**< Runs of streams taken from the queue of another worker. */
+    uint64_t chunks; /**< Buffers allocated for queued data. */
+} TsSchedulerStats;
+
+/** Create a scheduler and start its workers.
+ *  @param[in] threads The number of workers, 0 for one per cpu.
+ *  @return The new scheduler.
+ */
+TsScheduler *ts_scheduler_new(unsigned int threads);
+
+/** Analyze the queued data of all streams, remove them and stop the workers.
+ *  @param[in] scheduler The scheduler to free.
+ */
+void ts_scheduler_free(TsScheduler *scheduler);
+
+/** Add a stream with a new analyzer using klass and a new pid info manager.
+ *  @param[in] scheduler The scheduler.
+ *  @param[in] klass The handlers of the analyzer, called from the workers.
+ *  @param[in] userdata The userdata passed to the handlers.
+ *  @param[in] queue_limit The maximum of queued bytes, 0 for TS_SCHEDULER_QUEUE_LIMIT.
+ *  @return The new stream.
+ */
+TsSchedulerStream *ts_scheduler_add_stream(TsScheduler *scheduler, TsAnalyzerClass *klass, void *userdata,
+                                           size_t queue_limit);
+
+/** Analyze the queued data of a stream and remove it, freeing its analyzer and pid info manager.
+ *  @param[in] stream The stream to remove.
+ */
+void ts_scheduler_remove_stream(TsSchedulerStream *stream);
+
+/** Get the analyzer of a stream. It may only be used while the stream is drained, e.g. to enable
+ *  checks before the first push or to read results after ts_scheduler_stream_drain.
+ *  @param[in] stream The stream.
+ *  @return The analyzer.
+ */
+TsAnalyzer *ts_scheduler_stream_get_analyzer(TsSchedulerStream *stream);
+
+/** Get the pid info manager of a stream, with the same restrictions as the analyzer.
+ *  @param[in] stream The stream.
+ *  @return The pid info manager.
+ */
+PidInfoManager *ts_scheduler_stream_get_pid_info_manager(TsSchedulerStream *stream);
+
+/** Queue data for a stream. The data is copied. Only one thread may push to a stream at a time.
+ *  @param[in] stream The stream.
+ *  @param[in] data The data.
+ *  @param[in] len The number of bytes.
+ *  @param[in] wait Wait if the queue limit would be exceeded. Otherwise the data is dropped and counted.
+ *  @return False if the data was dropped.
+ */
+bool ts_scheduler_push(TsSchedulerStream *stream, const uint8_t *data, size_t len, bool wait);
+
+/** Wait until all data queued for a stream was analyzed.
+ *  @param[in] stream The stream.
+ */
+void ts_scheduler_stream_drain(TsSchedulerStream *stream);
+
+/** Get the counters of a stream.
+ *  @param[in] stream The stream.
+ *  @param[out] stats The counters.
+ */
+void ts_scheduler_stream_get_stats(TsSchedulerStream *stream, TsSchedulerStreamStats *stats);
+
+/** Get the counters of a scheduler.
+ *  @param[in] scheduler The scheduler.
+ *  @param[out] stats The counters.
+ */
+void ts_scheduler_get_stats(TsScheduler *scheduler, TsSchedulerStats *stats);
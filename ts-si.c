@@ -0,0 +1,1039 @@
+#include "ts-si.h"
+#include "ts-crc32.h"
+#include "utils.h"
+
+#include <memory.h>
+#include <bitstream/mpeg/ts.h>
+
+#define TS_SI_NONE UINT32_MAX
+/* SDT, EIT and NIT sections are private sections of at most 4096 bytes. */
+#define TS_SI_SECTION_MAX 4096
+#define TS_SI_ARENA_BLOCK (64 * 1024)
+
+#define TS_SI_TABLE_NIT_ACTUAL 0x40
+#define TS_SI_TABLE_NIT_OTHER 0x41
+#define TS_SI_TABLE_SDT_ACTUAL 0x42
+#define TS_SI_TABLE_SDT_OTHER 0x46
+#define TS_SI_TABLE_EIT_PF_ACTUAL 0x4e
+#define TS_SI_TABLE_EIT_PF_OTHER 0x4f
+#define TS_SI_TABLE_EIT_SCHEDULE_ACTUAL 0x50
+#define TS_SI_TABLE_EIT_LAST 0x6f
+
+#define TS_SI_DESC_NETWORK_NAME 0x40
+#define TS_SI_DESC_SERVICE 0x48
+#define TS_SI_DESC_SHORT_EVENT 0x4d
+
+static const char ts_si_empty[] = "";
+
+/* Strings are appended to blocks and never freed one by one. Replaced strings are only counted,
+ * the live ones are copied to fresh blocks once most of the arena is dead. */
+typedef struct _TsSiArenaBlock {
+    struct _TsSiArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} TsSiArenaBlock;
+
+typedef struct {
+    TsSiArenaBlock *blocks; /* the block strings are appended to comes first */
+    size_t size; /* bytes of all blocks */
+    size_t used; /* bytes of all strings */
+    size_t dead; /* bytes of replaced strings */
+} TsSiArena;
+
+/* An array of fixed size items that only grows. Released items are linked by their first member,
+ * which every item type starts with, and handed out again. */
+typedef struct {
+    uint8_t *items;
+    size_t item_size;
+    size_t capacity;
+    size_t used; /* items handed out at least once */
+    size_t count; /* items in use */
+    uint32_t free;
+} TsSiPool;
+
+/* Open addressing hash table from 64 bit keys to pool indices, without removal. */
+typedef struct {
+    uint64_t *keys;
+    uint32_t *values; /* TS_SI_NONE for empty slots */
+    size_t mask;
+    size_t count;
+} TsSiIndex;
+
+typedef struct {
+    uint32_t next; /* unused, services are never released */
+    uint32_t sections; /* EIT sections of the service */
+    TsSiService service;
+} TsSiServiceEntry;
+
+typedef struct {
+    uint32_t next; /* unused, networks are never released */
+    uint32_t sections; /* NIT sections of the network */
+    TsSiNetwork network;
+} TsSiNetworkEntry;
+
+typedef struct {
+    uint32_t next; /* the next section of the same service or network */
+    uint32_t items; /* events of EIT sections, transport streams of NIT sections */
+    uint32_t crc; /* the CRC_32 field */
+    uint8_t table_id;
+    uint8_t version; /* 0xff after the section was dropped */
+} TsSiSectionEntry;
+
+typedef struct {
+    uint32_t next; /* the next event of the section */
+    TsSiEvent event;
+} TsSiEventEntry;
+
+typedef struct {
+    uint32_t next; /* the next transport stream of the section */
+    TsSiTransportStream transport_stream;
+} TsSiTransportStreamEntry;
+
+/* Reassembly of the sections of one pid. */
+typedef struct {
+    uint8_t data[TS_SI_SECTION_MAX];
+    size_t used;
+    size_t length; /* 0 until the section header is complete */
+    bool active;
+    uint8_t cc;
+    bool cc_valid;
+} TsSiGatherer;
+
+struct _TsSi {
+    TsSiGatherer gatherers[TS_SI_PID_EIT - TS_SI_PID_NIT + 1];
+    TsSiArena arena;
+
+    TsSiPool services;
+    TsSiIndex service_index;
+    TsSiPool networks;
+    TsSiIndex network_index;
+    TsSiPool sections;
+    TsSiIndex section_index;
+    TsSiPool events;
+    TsSiPool transport_streams;
+
+    /* events of a service being enumerated */
+    const TsSiEvent **scratch;
+    size_t scratch_size;
+
+    TsSiStats stats;
+};
+
+static void ts_si_pool_init(TsSiPool *pool, size_t item_size)
+{
+    pool->item_size = item_size;
+    pool->free = TS_SI_NONE;
+}
+
+static inline void *ts_si_pool_item(const TsSiPool *pool, uint32_t index)
+{
+    return &pool->items[(size_t)index * pool->item_size];
+}
+
+static uint32_t ts_si_pool_alloc(TsSiPool *pool)
+{
+    uint32_t index = pool->free;
+    if (index != TS_SI_NONE) {
+        pool->free = *(uint32_t *)ts_si_pool_item(pool, index);
+    } else {
+        if (pool->used == pool->capacity) {
+            pool->capacity = pool->capacity ? 2 * pool->capacity : 64;
+            pool->items = util_realloc(pool->items, pool->capacity * pool->item_size);
+        }
+        index = pool->used++;
+    }
+    ++pool->count;
+    memset(ts_si_pool_item(pool, index), 0, pool->item_size);
+    return index;
+}
+
+static void ts_si_pool_release(TsSiPool *pool, uint32_t index)
+{
+    *(uint32_t *)ts_si_pool_item(pool, index) = pool->free;
+    pool->free = index;
+    --pool->count;
+}
+
+static inline TsSiServiceEntry *ts_si_service(TsSi *si, uint32_t index)
+{
+    return ts_si_pool_item(&si->services, index);
+}
+
+static inline TsSiNetworkEntry *ts_si_network(TsSi *si, uint32_t index)
+{
+    return ts_si_pool_item(&si->networks, index);
+}
+
+static inline TsSiSectionEntry *ts_si_section(TsSi *si, uint32_t index)
+{
+    return ts_si_pool_item(&si->sections, index);
+}
+
+static inline TsSiEventEntry *ts_si_event(TsSi *si, uint32_t index)
+{
+    return ts_si_pool_item(&si->events, index);
+}
+
+static inline TsSiTransportStreamEntry *ts_si_transport_stream(TsSi *si, uint32_t index)
+{
+    return ts_si_pool_item(&si->transport_streams, index);
+}
+
+static inline size_t ts_si_hash(uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ull;
+    return (size_t)(key ^ (key >> 29));
+}
+
+static uint32_t ts_si_index_find(const TsSiIndex *index, uint64_t key)
+{
+    size_t j;
+    if (index->values == NULL)
+        return TS_SI_NONE;
+    for (j = ts_si_hash(key) & index->mask; index->values[j] != TS_SI_NONE; j = (j + 1) & index->mask) {
+        if (index->keys[j] == key)
+            return index->values[j];
+    }
+    return TS_SI_NONE;
+}
+
+static void ts_si_index_put(TsSiIndex *index, uint64_t key, uint32_t value)
+{
+    size_t j = ts_si_hash(key) & index->mask;
+    while (index->values[j] != TS_SI_NONE)
+        j = (j + 1) & index->mask;
+    index->keys[j] = key;
+    index->values[j] = value;
+}
+
+static void ts_si_index_insert(TsSiIndex *index, uint64_t key, uint32_t value)
+{
+    /* keep the load below 3/4 */
+    if (index->values == NULL || (index->count + 1) * 4 > (index->mask + 1) * 3) {
+        TsSiIndex old = *index;
+        size_t capacity = index->values ? 2 * (index->mask + 1) : 64;
+        size_t j;
+        index->keys = util_alloc(capacity * sizeof(uint64_t));
+        index->values = util_alloc(capacity * sizeof(uint32_t));
+        memset(index->values, 0xff, capacity * sizeof(uint32_t));
+        index->mask = capacity - 1;
+        for (j = 0; old.values && j <= old.mask; ++j) {
+            if (old.values[j] != TS_SI_NONE)
+                ts_si_index_put(index, old.keys[j], old.values[j]);
+        }
+        util_free(old.keys);
+        util_free(old.values);
+    }
+    ts_si_index_put(index, key, value);
+    ++index->count;
+}
+
+static void ts_si_index_clear(TsSiIndex *index)
+{
+    util_free(index->keys);
+    util_free(index->values);
+}
+
+static char *ts_si_arena_reserve(TsSiArena *arena, size_t size)
+{
+    TsSiArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > TS_SI_ARENA_BLOCK ? size : TS_SI_ARENA_BLOCK;
+        block = util_alloc(sizeof(TsSiArenaBlock) + block_size);
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        arena->size += block_size;
+    }
+    return &block->data[block->used];
+}
+
+static void ts_si_arena_commit(TsSiArena *arena, size_t size)
+{
+    arena->blocks->used += size;
+    arena->used += size;
+}
+
+static void ts_si_arena_clear(TsSiArena *arena)
+{
+    TsSiArenaBlock *block, *next;
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        util_free(block);
+    }
+    memset(arena, 0, sizeof(TsSiArena));
+}
+
+static const char *ts_si_arena_copy(TsSiArena *arena, const char *string)
+{
+    if (string == ts_si_empty)
+        return string;
+    size_t size = strlen(string) + 1;
+    char *copy = ts_si_arena_reserve(arena, size);
+    memcpy(copy, string, size);
+    ts_si_arena_commit(arena, size);
+    return copy;
+}
+
+/* Convert DVB text (EN 300 468 annex A) to UTF-8, returns the length written to out,
+ * which must hold 2 * len bytes. Control codes are dropped except for CR/LF. */
+static size_t ts_si_convert(const uint8_t *text, size_t len, char *out)
+{
+    const uint8_t *end = text + len;
+    char *start = out;
+    bool ucs2 = false;
+    bool utf8 = false;
+    uint16_t c;
+
+    if (len > 0 && text[0] < 0x20) {
+        switch (text[0]) {
+            case 0x10: /* ISO 8859 part in the next two bytes */
+                text += 3;
+                break;
+            case 0x11:
+                ucs2 = true;
+                ++text;
+                break;
+            case 0x15:
+                utf8 = true;
+                ++text;
+                break;
+            case 0x1f: /* encoding_type_id in the next byte */
+                text += 2;
+                break;
+            default:
+                ++text;
+        }
+    }
+
+    if (utf8) {
+        for (; text < end; ++text) {
+            if (*text >= 0x20 || *text == '\n')
+                *out++ = *text;
+        }
+    } else if (ucs2) {
+        for (; text + 1 < end; text += 2) {
+            c = (text[0] << 8) | text[1];
+            if (c == 0xe08a) {
+                *out++ = '\n';
+            } else if (c < 0x20 || (c >= 0xe080 && c <= 0xe09f) || (c >= 0xd800 && c <= 0xdfff)) {
+                continue;
+            } else if (c < 0x80) {
+                *out++ = c;
+            } else if (c < 0x800) {
+                *out++ = 0xc0 | (c >> 6);
+                *out++ = 0x80 | (c & 0x3f);
+            } else {
+                *out++ = 0xe0 | (c >> 12);
+                *out++ = 0x80 | ((c >> 6) & 0x3f);
+                *out++ = 0x80 | (c & 0x3f);
+            }
+        }
+    } else {
+        for (; text < end; ++text) {
+            if (*text == 0x8a) {
+                *out++ = '\n';
+            } else if (*text < 0x20 || (*text >= 0x7f && *text < 0xa0)) {
+                continue;
+            } else if (*text < 0x80) {
+                *out++ = *text;
+            } else {
+                *out++ = 0xc0 | (*text >> 6);
+                *out++ = 0x80 | (*text & 0x3f);
+            }
+        }
+    }
+    return out - start;
+}
+
+/* Convert DVB text into the arena. If it equals *reuse, that string is taken over instead of
+ * storing a copy and *reuse is emptied. */
+static const char *ts_si_string(TsSi *si, const uint8_t *text, size_t len, const char **reuse)
+{
+    char *string = ts_si_arena_reserve(&si->arena, 2 * len + 1);
+    size_t length = ts_si_convert(text, len, string);
+    if (length == 0)
+        return ts_si_empty;
+    string[length] = 0;
+    if (reuse && strcmp(string, *reuse) == 0) {
+        string = (char *)*reuse;
+        *reuse = ts_si_empty;
+        return string;
+    }
+    ts_si_arena_commit(&si->arena, length + 1);
+    return string;
+}
+
+/* A string is no longer referenced. */
+static void ts_si_drop_string(TsSi *si, const char *string)
+{
+    if (string != ts_si_empty)
+        si->arena.dead += strlen(string) + 1;
+}
+
+static inline uint64_t ts_si_service_key(uint16_t original_network_id, uint16_t transport_stream_id,
+                                         uint16_t service_id)
+{
+    return (uint64_t)original_network_id << 32 | (uint64_t)transport_stream_id << 16 | service_id;
+}
+
+static uint32_t ts_si_get_service_entry(TsSi *si, uint16_t original_network_id, uint16_t transport_stream_id,
+                                        uint16_t service_id)
+{
+    uint64_t key = ts_si_service_key(original_network_id, transport_stream_id, service_id);
+    uint32_t index = ts_si_index_find(&si->service_index, key);
+    if (index != TS_SI_NONE)
+        return index;
+
+    index = ts_si_pool_alloc(&si->services);
+    ts_si_index_insert(&si->service_index, key, index);
+    TsSiServiceEntry *entry = ts_si_service(si, index);
+    entry->sections = TS_SI_NONE;
+    entry->service.original_network_id = original_network_id;
+    entry->service.transport_stream_id = transport_stream_id;
+    entry->service.service_id = service_id;
+    entry->service.provider_name = ts_si_empty;
+    entry->service.name = ts_si_empty;
+    return index;
+}
+
+static uint32_t ts_si_get_network_entry(TsSi *si, uint16_t network_id)
+{
+    uint32_t index = ts_si_index_find(&si->network_index, network_id);
+    if (index != TS_SI_NONE)
+        return index;
+
+    index = ts_si_pool_alloc(&si->networks);
+    ts_si_index_insert(&si->network_index, network_id, index);
+    TsSiNetworkEntry *entry = ts_si_network(si, index);
+    entry->sections = TS_SI_NONE;
+    entry->network.network_id = network_id;
+    entry->network.name = ts_si_empty;
+    return index;
+}
+
+static void ts_si_release_events(TsSi *si, uint32_t index)
+{
+    TsSiEventEntry *entry;
+    uint32_t next;
+    for (; index != TS_SI_NONE; index = next) {
+        entry = ts_si_event(si, index);
+        next = entry->next;
+        ts_si_drop_string(si, entry->event.name);
+        ts_si_drop_string(si, entry->event.text);
+        ts_si_pool_release(&si->events, index);
+    }
+}
+
+static void ts_si_release_transport_streams(TsSi *si, uint32_t index)
+{
+    uint32_t next;
+    for (; index != TS_SI_NONE; index = next) {
+        next = ts_si_transport_stream(si, index)->next;
+        ts_si_pool_release(&si->transport_streams, index);
+    }
+}
+
+static inline bool ts_si_is_eit(uint8_t table_id)
+{
+    return table_id >= TS_SI_TABLE_EIT_PF_ACTUAL && table_id <= TS_SI_TABLE_EIT_LAST;
+}
+
+static inline bool ts_si_is_nit(uint8_t table_id)
+{
+    return table_id == TS_SI_TABLE_NIT_ACTUAL || table_id == TS_SI_TABLE_NIT_OTHER;
+}
+
+static inline unsigned int ts_si_bcd(uint8_t value)
+{
+    return (value >> 4) * 10 + (value & 0x0f);
+}
+
+/* start_time: 16 bit modified julian date and hours, minutes and seconds in BCD */
+static int64_t ts_si_time(const uint8_t *data)
+{
+    if ((data[0] & data[1] & data[2] & data[3] & data[4]) == 0xff)
+        return -1;
+    int64_t mjd = (data[0] << 8) | data[1];
+    /* MJD 40587 is 1970-01-01 */
+    return (mjd - 40587) * 86400 + ts_si_bcd(data[2]) * 3600 + ts_si_bcd(data[3]) * 60 + ts_si_bcd(data[4]);
+}
+
+static uint32_t ts_si_duration(const uint8_t *data)
+{
+    if ((data[0] & data[1] & data[2]) == 0xff)
+        return 0;
+    return ts_si_bcd(data[0]) * 3600 + ts_si_bcd(data[1]) * 60 + ts_si_bcd(data[2]);
+}
+
+/* Find an event of the previous version of a section to take over its strings. */
+static TsSiEvent *ts_si_find_event(TsSi *si, uint32_t index, uint16_t event_id)
+{
+    for (; index != TS_SI_NONE; index = ts_si_event(si, index)->next) {
+        if (ts_si_event(si, index)->event.event_id == event_id)
+            return &ts_si_event(si, index)->event;
+    }
+    return NULL;
+}
+
+static void ts_si_parse_event_descriptors(TsSi *si, TsSiEvent *event, TsSiEvent *previous, const uint8_t *data,
+                                          const uint8_t *end)
+{
+    const uint8_t *descriptor_end, *text;
+    size_t name_length, text_length;
+    for (; data + 2 <= end; data = descriptor_end) {
+        descriptor_end = data + 2 + data[1];
+        if (descriptor_end > end)
+            return;
+        if (data[0] != TS_SI_DESC_SHORT_EVENT || data[1] < 5)
+            continue;
+        name_length = data[5];
+        if (data + 7 + name_length > descriptor_end)
+            return;
+        memcpy(event->language, &data[2], 3);
+        event->name = ts_si_string(si, &data[6], name_length, previous ? &previous->name : NULL);
+        text = &data[7 + name_length];
+        text_length = data[6 + name_length];
+        if (text + text_length > descriptor_end)
+            text_length = descriptor_end - text;
+        event->text = ts_si_string(si, text, text_length, previous ? &previous->text : NULL);
+        /* further short_event_descriptors are other languages */
+        return;
+    }
+}
+
+static void ts_si_parse_eit(TsSi *si, uint32_t section, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = &data[len - 4];
+    const uint8_t *descriptors, *descriptors_end;
+    uint16_t service_id = (data[3] << 8) | data[4];
+    uint16_t transport_stream_id = (data[8] << 8) | data[9];
+    uint16_t original_network_id = (data[10] << 8) | data[11];
+    uint32_t previous = ts_si_section(si, section)->items;
+    uint32_t last = TS_SI_NONE;
+    uint32_t index;
+    TsSiEvent *event;
+    TsSiEventKind kind = TS_SI_EVENT_SCHEDULE;
+
+    if (data[0] <= TS_SI_TABLE_EIT_PF_OTHER && data[6] <= 1)
+        kind = data[6] == 0 ? TS_SI_EVENT_PRESENT : TS_SI_EVENT_FOLLOWING;
+
+    ts_si_section(si, section)->items = TS_SI_NONE;
+    for (data = &data[14]; data + 12 <= end; data = descriptors_end) {
+        descriptors = &data[12];
+        descriptors_end = descriptors + (((data[10] & 0x0f) << 8) | data[11]);
+        if (descriptors_end > end)
+            break;
+
+        index = ts_si_pool_alloc(&si->events);
+        if (last == TS_SI_NONE)
+            ts_si_section(si, section)->items = index;
+        else
+            ts_si_event(si, last)->next = index;
+        last = index;
+
+        event = &ts_si_event(si, index)->event;
+        ts_si_event(si, index)->next = TS_SI_NONE;
+        event->service_id = service_id;
+        event->transport_stream_id = transport_stream_id;
+        event->original_network_id = original_network_id;
+        event->event_id = (data[0] << 8) | data[1];
+        event->kind = kind;
+        event->start_time = ts_si_time(&data[2]);
+        event->duration = ts_si_duration(&data[7]);
+        event->running_status = data[10] >> 5;
+        event->free_ca_mode = data[10] & 0x10;
+        event->name = ts_si_empty;
+        event->text = ts_si_empty;
+        ts_si_parse_event_descriptors(si, event, ts_si_find_event(si, previous, event->event_id), descriptors,
+                                      descriptors_end);
+    }
+    ts_si_release_events(si, previous);
+}
+
+static void ts_si_parse_sdt(TsSi *si, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = &data[len - 4];
+    const uint8_t *descriptor, *descriptor_end, *descriptors_end, *name;
+    uint16_t transport_stream_id = (data[3] << 8) | data[4];
+    uint16_t original_network_id = (data[8] << 8) | data[9];
+    bool actual = data[0] == TS_SI_TABLE_SDT_ACTUAL;
+    TsSiService *service;
+    const char *old;
+
+    for (data = &data[11]; data + 5 <= end; data = descriptors_end) {
+        descriptors_end = &data[5] + (((data[3] & 0x0f) << 8) | data[4]);
+        if (descriptors_end > end)
+            break;
+
+        service = &ts_si_service(si, ts_si_get_service_entry(si, original_network_id, transport_stream_id,
+                                                             (data[0] << 8) | data[1]))->service;
+        service->actual |= actual;
+        service->described = true;
+        service->eit_schedule = data[2] & 0x02;
+        service->eit_present_following = data[2] & 0x01;
+        service->running_status = data[3] >> 5;
+        service->free_ca_mode = data[3] & 0x10;
+
+        for (descriptor = &data[5]; descriptor + 2 <= descriptors_end; descriptor = descriptor_end) {
+            descriptor_end = descriptor + 2 + descriptor[1];
+            if (descriptor_end > descriptors_end)
+                break;
+            /* service_type, provider name and service name, each name preceded by its length */
+            if (descriptor[0] != TS_SI_DESC_SERVICE || descriptor[1] < 3)
+                continue;
+            name = &descriptor[4] + descriptor[3];
+            if (name >= descriptor_end || name + 1 + name[0] > descriptor_end)
+                continue;
+            service->service_type = descriptor[2];
+            old = service->provider_name;
+            service->provider_name = ts_si_string(si, &descriptor[4], descriptor[3], &old);
+            ts_si_drop_string(si, old);
+            old = service->name;
+            service->name = ts_si_string(si, &name[1], name[0], &old);
+            ts_si_drop_string(si, old);
+        }
+    }
+}
+
+static void ts_si_parse_nit(TsSi *si, uint32_t section, const uint8_t *data, size_t len)
+{
+    const uint8_t *end = &data[len - 4];
+    const uint8_t *descriptor, *descriptor_end, *descriptors_end;
+    TsSiNetwork *network = &ts_si_network(si, ts_si_get_network_entry(si, (data[3] << 8) | data[4]))->network;
+    TsSiTransportStream *transport_stream;
+    uint32_t last = TS_SI_NONE;
+    uint32_t index;
+    const char *old;
+
+    network->actual |= data[0] == TS_SI_TABLE_NIT_ACTUAL;
+
+    descriptors_end = &data[10] + (((data[8] & 0x0f) << 8) | data[9]);
+    if (descriptors_end + 2 > end)
+        return;
+    for (descriptor = &data[10]; descriptor + 2 <= descriptors_end; descriptor = descriptor_end) {
+        descriptor_end = descriptor + 2 + descriptor[1];
+        if (descriptor_end > descriptors_end)
+            break;
+        if (descriptor[0] == TS_SI_DESC_NETWORK_NAME) {
+            old = network->name;
+            network->name = ts_si_string(si, &descriptor[2], descriptor[1], &old);
+            ts_si_drop_string(si, old);
+        }
+    }
+
+    ts_si_release_transport_streams(si, ts_si_section(si, section)->items);
+    ts_si_section(si, section)->items = TS_SI_NONE;
+    /* skip the transport_stream_loop_length, the loop ends with the section */
+    for (data = descriptors_end + 2; data + 6 <= end; data = &data[6] + (((data[4] & 0x0f) << 8) | data[5])) {
+        index = ts_si_pool_alloc(&si->transport_streams);
+        if (last == TS_SI_NONE)
+            ts_si_section(si, section)->items = index;
+        else
+            ts_si_transport_stream(si, last)->next = index;
+        last = index;
+
+        ts_si_transport_stream(si, index)->next = TS_SI_NONE;
+        transport_stream = &ts_si_transport_stream(si, index)->transport_stream;
+        transport_stream->network_id = network->network_id;
+        transport_stream->transport_stream_id = (data[0] << 8) | data[1];
+        transport_stream->original_network_id = (data[2] << 8) | data[3];
+    }
+}
+
+/* Forget the sections of a sub-table after its last_section_number, which are gone with the new version. */
+static void ts_si_drop_sections(TsSi *si, uint64_t key, unsigned int first)
+{
+    TsSiSectionEntry *section;
+    uint32_t index;
+    unsigned int j;
+    for (j = first; j <= 0xff; ++j) {
+        index = ts_si_index_find(&si->section_index, (key & ~(uint64_t)0xff) | j);
+        if (index == TS_SI_NONE)
+            continue;
+        section = ts_si_section(si, index);
+        if (ts_si_is_eit(section->table_id))
+            ts_si_release_events(si, section->items);
+        else if (ts_si_is_nit(section->table_id))
+            ts_si_release_transport_streams(si, section->items);
+        section->items = TS_SI_NONE;
+        section->version = 0xff;
+    }
+}
+
+/* Copy the live strings to a fresh arena. */
+static void ts_si_compact(TsSi *si)
+{
+    TsSiArena old = si->arena;
+    TsSiService *service;
+    TsSiSectionEntry *section;
+    TsSiEvent *event;
+    uint32_t j, index;
+
+    memset(&si->arena, 0, sizeof(TsSiArena));
+    for (j = 0; j < si->services.used; ++j) {
+        service = &ts_si_service(si, j)->service;
+        service->provider_name = ts_si_arena_copy(&si->arena, service->provider_name);
+        service->name = ts_si_arena_copy(&si->arena, service->name);
+    }
+    for (j = 0; j < si->networks.used; ++j)
+        ts_si_network(si, j)->network.name = ts_si_arena_copy(&si->arena, ts_si_network(si, j)->network.name);
+    for (j = 0; j < si->sections.used; ++j) {
+        section = ts_si_section(si, j);
+        if (!ts_si_is_eit(section->table_id))
+            continue;
+        for (index = section->items; index != TS_SI_NONE; index = ts_si_event(si, index)->next) {
+            event = &ts_si_event(si, index)->event;
+            event->name = ts_si_arena_copy(&si->arena, event->name);
+            event->text = ts_si_arena_copy(&si->arena, event->text);
+        }
+    }
+    ts_si_arena_clear(&old);
+}
+
+bool ts_si_push_section(TsSi *si, const uint8_t *section, size_t len)
+{
+    uint8_t table_id, version;
+    uint16_t owner;
+    uint32_t aux = 0;
+    uint32_t crc, index;
+    uint64_t key;
+    size_t header;
+    TsSiSectionEntry *entry;
+
+    if (len < 3 || len != 3 + (size_t)(((section[1] & 0x0f) << 8) | section[2]))
+        return false;
+    table_id = section[0];
+    if (ts_si_is_nit(table_id))
+        header = 10;
+    else if (table_id == TS_SI_TABLE_SDT_ACTUAL || table_id == TS_SI_TABLE_SDT_OTHER)
+        header = 11;
+    else if (ts_si_is_eit(table_id))
+        header = 14;
+    else
+        return true;
+
+    ++si->stats.sections;
+    if (!(section[1] & 0x80) || len < header + 4)
+        return false;
+    /* current_next_indicator, the section is not valid yet */
+    if (!(section[5] & 0x01))
+        return true;
+
+    owner = (section[3] << 8) | section[4];
+    version = (section[5] >> 1) & 0x1f;
+    crc = (uint32_t)section[len - 4] << 24 | section[len - 3] << 16 | section[len - 2] << 8 | section[len - 1];
+    /* SDT: original_network_id, EIT: transport_stream_id and original_network_id */
+    if (header == 11)
+        aux = (section[8] << 8) | section[9];
+    else if (header == 14)
+        aux = (uint32_t)section[8] << 24 | section[9] << 16 | section[10] << 8 | section[11];
+    key = (uint64_t)table_id << 56 | (uint64_t)owner << 40 | (uint64_t)aux << 8 | section[6];
+
+    index = ts_si_index_find(&si->section_index, key);
+    if (index != TS_SI_NONE) {
+        entry = ts_si_section(si, index);
+        if (entry->version == version && entry->crc == crc) {
+            ++si->stats.sections_repeated;
+            return true;
+        }
+    }
+    if (ts_crc32(section, len) != 0) {
+        ++si->stats.crc_errors;
+        return false;
+    }
+
+    if (index == TS_SI_NONE) {
+        index = ts_si_pool_alloc(&si->sections);
+        ts_si_index_insert(&si->section_index, key, index);
+        entry = ts_si_section(si, index);
+        entry->items = TS_SI_NONE;
+        entry->next = TS_SI_NONE;
+        entry->table_id = table_id;
+        if (header == 14) {
+            TsSiServiceEntry *service = ts_si_service(si, ts_si_get_service_entry(si, aux & 0xffff, aux >> 16, owner));
+            ts_si_section(si, index)->next = service->sections;
+            service->sections = index;
+        } else if (header == 10) {
+            TsSiNetworkEntry *network = ts_si_network(si, ts_si_get_network_entry(si, owner));
+            ts_si_section(si, index)->next = network->sections;
+            network->sections = index;
+        }
+    }
+    entry = ts_si_section(si, index);
+    entry->version = version;
+    entry->crc = crc;
+
+    if (header == 14)
+        ts_si_parse_eit(si, index, section, len);
+    else if (header == 11)
+        ts_si_parse_sdt(si, section, len);
+    else
+        ts_si_parse_nit(si, index, section, len);
+    if (section[7] < 0xff)
+        ts_si_drop_sections(si, key, section[7] + 1);
+    ++si->stats.sections_parsed;
+
+    if (si->arena.dead > TS_SI_ARENA_BLOCK && si->arena.dead * 2 > si->arena.used)
+        ts_si_compact(si);
+    return true;
+}
+
+/* Gather up to len bytes of the current section, returns the bytes used. */
+static size_t ts_si_gather(TsSi *si, TsSiGatherer *gatherer, const uint8_t *data, size_t len)
+{
+    size_t used = 0;
+    size_t count;
+
+    if (gatherer->length == 0) {
+        used = len < 3 - gatherer->used ? len : 3 - gatherer->used;
+        memcpy(&gatherer->data[gatherer->used], data, used);
+        gatherer->used += used;
+        if (gatherer->used < 3)
+            return used;
+        gatherer->length = 3 + (((gatherer->data[1] & 0x0f) << 8) | gatherer->data[2]);
+        if (gatherer->length > TS_SI_SECTION_MAX) {
+            gatherer->active = false;
+            return len;
+        }
+    }
+
+    count = gatherer->length - gatherer->used;
+    if (count > len - used)
+        count = len - used;
+    memcpy(&gatherer->data[gatherer->used], &data[used], count);
+    gatherer->used += count;
+    if (gatherer->used == gatherer->length) {
+        gatherer->active = false;
+        ts_si_push_section(si, gatherer->data, gatherer->length);
+    }
+    return used + count;
+}
+
+void ts_si_push_packet(TsSi *si, const uint8_t *packet)
+{
+    uint16_t pid = ts_get_pid(packet);
+    TsSiGatherer *gatherer;
+    const uint8_t *data, *end;
+    size_t pointer, length;
+    uint8_t cc;
+
+    if (pid < TS_SI_PID_NIT || pid > TS_SI_PID_EIT)
+        return;
+    gatherer = &si->gatherers[pid - TS_SI_PID_NIT];
+
+    if (ts_get_transporterror(packet)) {
+        if (gatherer->active)
+            ++si->stats.discontinuities;
+        gatherer->active = false;
+        gatherer->cc_valid = false;
+        return;
+    }
+    if (ts_has_adaptation(packet) && ts_get_adaptation(packet) > 0 && tsaf_has_discontinuity(packet))
+        gatherer->cc_valid = false;
+    if (!ts_has_payload(packet))
+        return;
+
+    cc = ts_get_cc(packet);
+    if (gatherer->cc_valid) {
+        if (cc == gatherer->cc)
+            return; /* duplicate */
+        if (cc != ((gatherer->cc + 1) & 0xf) && gatherer->active) {
+            ++si->stats.discontinuities;
+            gatherer->active = false;
+        }
+    }
+    gatherer->cc = cc;
+    gatherer->cc_valid = true;
+
+    data = ts_payload((uint8_t *)packet);
+    end = packet + TS_SIZE;
+    if (data >= end)
+        return;
+    if (!ts_get_unitstart(packet)) {
+        if (gatherer->active)
+            ts_si_gather(si, gatherer, data, end - data);
+        return;
+    }
+
+    pointer = *data++;
+    if (data + pointer > end) {
+        gatherer->active = false;
+        return;
+    }
+    /* the pointer_field covers the end of the previous section */
+    if (gatherer->active) {
+        ts_si_gather(si, gatherer, data, pointer);
+        gatherer->active = false;
+    }
+    /* further sections may follow back to back until stuffing */
+    for (data += pointer; data < end && *data != 0xff;) {
+        if (end - data >= 3) {
+            length = 3 + (((data[1] & 0x0f) << 8) | data[2]);
+            if (data + length <= end) {
+                /* the whole section is in this packet, no need to copy it */
+                ts_si_push_section(si, data, length);
+                data += length;
+                continue;
+            }
+        }
+        gatherer->active = true;
+        gatherer->used = 0;
+        gatherer->length = 0;
+        ts_si_gather(si, gatherer, data, end - data);
+        return;
+    }
+}
+
+static int ts_si_compare_events(const void *a, const void *b)
+{
+    /* present, following, schedule */
+    static const int order[] = { 2, 0, 1 };
+    const TsSiEvent *x = *(const TsSiEvent **)a;
+    const TsSiEvent *y = *(const TsSiEvent **)b;
+    if (order[x->kind] != order[y->kind])
+        return order[x->kind] - order[y->kind];
+    if (x->start_time != y->start_time)
+        return x->start_time < y->start_time ? -1 : 1;
+    return (int)x->event_id - (int)y->event_id;
+}
+
+static TsSiServiceEntry *ts_si_find_service(TsSi *si, const TsSiService *service)
+{
+    uint32_t index = ts_si_index_find(&si->service_index,
+                                      ts_si_service_key(service->original_network_id,
+                                                        service->transport_stream_id, service->service_id));
+    return index != TS_SI_NONE ? ts_si_service(si, index) : NULL;
+}
+
+void ts_si_enumerate_events(TsSi *si, const TsSiService *service, TsSiEventEnumFunc callback, void *userdata)
+{
+    TsSiServiceEntry *entry = ts_si_find_service(si, service);
+    uint32_t section, index;
+    size_t count = 0;
+    size_t j;
+
+    if (entry == NULL || callback == NULL)
+        return;
+    for (section = entry->sections; section != TS_SI_NONE; section = ts_si_section(si, section)->next) {
+        for (index = ts_si_section(si, section)->items; index != TS_SI_NONE; index = ts_si_event(si, index)->next) {
+            if (count == si->scratch_size) {
+                si->scratch_size = si->scratch_size ? 2 * si->scratch_size : 256;
+                si->scratch = util_realloc(si->scratch, si->scratch_size * sizeof(TsSiEvent *));
+            }
+            si->scratch[count++] = &ts_si_event(si, index)->event;
+        }
+    }
+    if (count == 0)
+        return;
+    qsort(si->scratch, count, sizeof(TsSiEvent *), ts_si_compare_events);
+    for (j = 0; j < count; ++j) {
+        if (!callback(si->scratch[j], userdata))
+            return;
+    }
+}
+
+bool ts_si_get_present_following(TsSi *si, const TsSiService *service, const TsSiEvent **present,
+                                 const TsSiEvent **following)
+{
+    TsSiServiceEntry *entry = ts_si_find_service(si, service);
+    TsSiSectionEntry *section;
+    uint32_t index;
+
+    *present = NULL;
+    *following = NULL;
+    for (index = entry ? entry->sections : TS_SI_NONE; index != TS_SI_NONE; index = section->next) {
+        section = ts_si_section(si, index);
+        if (section->table_id > TS_SI_TABLE_EIT_PF_OTHER || section->items == TS_SI_NONE)
+            continue;
+        TsSiEvent *event = &ts_si_event(si, section->items)->event;
+        if (event->kind == TS_SI_EVENT_PRESENT && *present == NULL)
+            *present = event;
+        else if (event->kind == TS_SI_EVENT_FOLLOWING && *following == NULL)
+            *following = event;
+    }
+    return *present || *following;
+}
+
+const TsSiService *ts_si_get_service(TsSi *si, uint16_t original_network_id, uint16_t transport_stream_id,
+                                     uint16_t service_id)
+{
+    uint32_t index = ts_si_index_find(&si->service_index,
+                                      ts_si_service_key(original_network_id, transport_stream_id, service_id));
+    return index != TS_SI_NONE ? &ts_si_service(si, index)->service : NULL;
+}
+
+void ts_si_enumerate_services(TsSi *si, TsSiServiceEnumFunc callback, void *userdata)
+{
+    uint32_t j;
+    for (j = 0; callback && j < si->services.used; ++j) {
+        if (!callback(&ts_si_service(si, j)->service, userdata))
+            return;
+    }
+}
+
+void ts_si_enumerate_networks(TsSi *si, TsSiNetworkEnumFunc callback, void *userdata)
+{
+    uint32_t j;
+    for (j = 0; callback && j < si->networks.used; ++j) {
+        if (!callback(&ts_si_network(si, j)->network, userdata))
+            return;
+    }
+}
+
+void ts_si_enumerate_transport_streams(TsSi *si, const TsSiNetwork *network, TsSiTransportStreamEnumFunc callback,
+                                       void *userdata)
+{
+    uint32_t section = ts_si_index_find(&si->network_index, network->network_id);
+    uint32_t index;
+
+    if (section == TS_SI_NONE || callback == NULL)
+        return;
+    for (section = ts_si_network(si, section)->sections; section != TS_SI_NONE;
+         section = ts_si_section(si, section)->next) {
+        for (index = ts_si_section(si, section)->items; index != TS_SI_NONE;
+             index = ts_si_transport_stream(si, index)->next) {
+            if (!callback(&ts_si_transport_stream(si, index)->transport_stream, userdata))
+                return;
+        }
+    }
+}
+
+void ts_si_get_stats(TsSi *si, TsSiStats *stats)
+{
+    *stats = si->stats;
+    stats->services = si->services.count;
+    stats->events = si->events.count;
+    stats->networks = si->networks.count;
+    stats->string_bytes = si->arena.size;
+}
+
+TsSi *ts_si_new(void)
+{
+    TsSi *si = util_alloc0(sizeof(TsSi));
+    ts_si_pool_init(&si->services, sizeof(TsSiServiceEntry));
+    ts_si_pool_init(&si->networks, sizeof(TsSiNetworkEntry));
+    ts_si_pool_init(&si->sections, sizeof(TsSiSectionEntry));
+    ts_si_pool_init(&si->events, sizeof(TsSiEventEntry));
+    ts_si_pool_init(&si->transport_streams, sizeof(TsSiTransportStreamEntry));
+    return si;
+}
+
+void ts_si_free(TsSi *si)
+{
+    if (si == NULL)
+        return;
+    ts_si_arena_clear(&si->arena);
+    util_free(si->services.items);
+    util_free(si->networks.items);
+    util_free(si->sections.items);
+    util_free(si->events.items);
+    util_free(si->transport_streams.items);
+    ts_si_index_clear(&si->service_index);
+    ts_si_index_clear(&si->network_index);
+    ts_si_index_clear(&si->section_index);
+    util_free(si->scratch);
+    util_free(si);
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** The pids of the DVB service information tables parsed by TsSi. */
+#define TS_SI_PID_NIT 0x10
+#define TS_SI_PID_SDT 0x11
+#define TS_SI_PID_EIT 0x12
+
+/** Decoder of the DVB network information (NIT), service description (SDT) and event information
+ *  (EIT) tables. Sections are gathered and parsed without allocations per section: strings are kept
+ *  in an arena and services, events and networks in pools that only grow with their number.
+ *  Repetitions of a section are recognized by version and CRC_32 field and not parsed again.
+ *
+ *  Strings are converted to UTF-8. Text in UTF-8 or UCS-2 is converted exactly, the single byte
+ *  character tables (ISO 6937 and ISO 8859) are approximated by ISO 8859-1.
+ *
+ *  The pointers passed to or returned by the functions below are only valid until the next packet
+ *  is pushed.
+ */
+typedef struct _TsSi TsSi;
+
+/** running_status of services and events */
+typedef enum {
+    TS_SI_RUNNING_UNDEFINED = 0,
+    TS_SI_RUNNING_NOT_RUNNING,
+    TS_SI_RUNNING_STARTS_SOON,
+    TS_SI_RUNNING_PAUSING,
+    TS_SI_RUNNING_RUNNING,
+    TS_SI_RUNNING_OFF_AIR
+} TsSiRunningStatus;
+
+/** A service described by the SDT, or only known from the EIT. */
+typedef struct _TsSiService {
+    uint16_t original_network_id;
+    uint16_t transport_stream_id;
+    uint16_t service_id;
+    bool actual; /**< Described by the SDT of the actual transport stream. */
+    bool described; /**< Described by an SDT at all, otherwise only events were received. */
+    uint8_t service_type; /**< From the service_descriptor, 0 if there is none. */
+    uint8_t running_status; /**< TsSiRunningStatus */
+    bool free_ca_mode; /**< Some components are scrambled. */
+    bool eit_schedule; /**< EIT schedule information is present in the stream. */
+    bool eit_present_following; /**< EIT present/following information is present in the stream. */
+    const char *provider_name; /**< Never NULL, empty if unknown. */
+    const char *name; /**< Never NULL, empty if unknown. */
+} TsSiService;
+
+/** Where an event was taken from. */
+typedef enum {
+    TS_SI_EVENT_SCHEDULE = 0,
+    TS_SI_EVENT_PRESENT,
+    TS_SI_EVENT_FOLLOWING
+} TsSiEventKind;
+
+/** An event of a service. */
+typedef struct _TsSiEvent {
+    uint16_t original_network_id;
+    uint16_t transport_stream_id;
+    uint16_t service_id;
+    uint16_t event_id;
+    TsSiEventKind kind;
+    int64_t start_time; /**< UTC in seconds since 1970, -1 if undefined. */
+    uint32_t duration; /**< In seconds. */
+    uint8_t running_status; /**< TsSiRunningStatus */
+    bool free_ca_mode; /**< Some components are scrambled. */
+    char language[4]; /**< ISO 639-2 code of the short_event_descriptor, empty if there is none. */
+    const char *name; /**< Never NULL, empty if unknown. */
+    const char *text; /**< The short description, never NULL, empty if unknown. */
+} TsSiEvent;
+
+/** A network described by the NIT. */
+typedef struct _TsSiNetwork {
+    uint16_t network_id;
+    bool actual; /**< Described by the NIT of the actual network. */
+    const char *name; /**< Never NULL, empty if unknown. */
+} TsSiNetwork;
+
+/** A transport stream listed by the NIT of a network. */
+typedef struct _TsSiTransportStream {
+    uint16_t network_id;
+    uint16_t transport_stream_id;
+    uint16_t original_network_id;
+} TsSiTransportStream;
+
+/** Counters of a decoder. */
+typedef struct _TsSiStats {
+    uint64_t sections; /**< Complete sections received. */
+    uint64_t sections_parsed; /**< New or changed sections parsed. */
+    uint64_t sections_repeated; /**< Repetitions of a section, not parsed again. */
+    uint64_t crc_errors; /**< Sections dropped because of a wrong CRC_32. */
+    uint64_t discontinuities; /**< Incomplete sections dropped because packets were lost. */
+    size_t services;
+    size_t events;
+    size_t networks;
+    size_t string_bytes; /**< Arena memory holding strings, including replaced ones not yet reclaimed. */
+} TsSiStats;
+
+/** Return true to continue the enumeration. */
+typedef bool (*TsSiServiceEnumFunc)(const TsSiService *, void *);
+typedef bool (*TsSiEventEnumFunc)(const TsSiEvent *, void *);
+typedef bool (*TsSiNetworkEnumFunc)(const TsSiNetwork *, void *);
+typedef bool (*TsSiTransportStreamEnumFunc)(const TsSiTransportStream *, void *);
+
+/** Create a decoder.
+ *  @return The new decoder.
+ */
+TsSi *ts_si_new(void);
+
+/** Free a decoder and everything it decoded.
+ *  @param[in] si The decoder to free.
+ */
+void ts_si_free(TsSi *si);
+
+/** Push a transport stream packet. Packets of pids other than TS_SI_PID_NIT, TS_SI_PID_SDT and
+ *  TS_SI_PID_EIT are ignored.
+ *  @param[in] si The decoder.
+ *  @param[in] packet The 188 byte packet starting with the sync byte.
+ */
+void ts_si_push_packet(TsSi *si, const uint8_t *packet);
+
+/** Push a complete section, e.g. gathered by other means. Other tables than NIT, SDT and EIT are ignored.
+ *  @param[in] si The decoder.
+ *  @param[in] section The section starting with the table_id.
+ *  @param[in] len The length of the section including the CRC_32.
+ *  @return False if the section is malformed or its CRC_32 is wrong.
+ */
+bool ts_si_push_section(TsSi *si, const uint8_t *section, size_t len);
+
+/** Enumerate the services in the order they became known.
+ *  @param[in] si The decoder.
+ *  @param[in] callback Called for each service.
+ *  @param[in] userdata The userdata passed to callback.
+ */
+void ts_si_enumerate_services(TsSi *si, TsSiServiceEnumFunc callback, void *userdata);
+
+/** Find a service.
+ *  @param[in] si The decoder.
+ *  @param[in] original_network_id The original_network_id of the service.
+ *  @param[in] transport_stream_id The transport_stream_id of the service.
+ *  @param[in] service_id The service_id, which is also the program_number in the PAT.
+ *  @return The service or NULL if it is unknown.
+ */
+const TsSiService *ts_si_get_service(TsSi *si, uint16_t original_network_id, uint16_t transport_stream_id,
+                                     uint16_t service_id);
+
+/** Enumerate the events of a service by start time, present/following events before the schedule.
+ *  @param[in] si The decoder.
+ *  @param[in] service The service.
+ *  @param[in] callback Called for each event.
+ *  @param[in] userdata The userdata passed to callback.
+ */
+void ts_si_enumerate_events(TsSi *si, const TsSiService *service, TsSiEventEnumFunc callback, void *userdata);
+
+/** Get the present and following events of a service from the EIT present/following.
+ *  @param[in] si The decoder.
+ *  @param[in] service The service.
+ *  @param[out] present The present event or NULL.
+ *  @param[out] following The following event or NULL.
+ *  @return False if neither is known.
+ */
+bool ts_si_get_present_following(TsSi *si, const TsSiService *service, const TsSiEvent **present,
+                                 const TsSiEvent **following);
+
+/** Enumerate the networks in the order they became known.
+ *  @param[in] si The decoder.
+ *  @param[in] callback Called for each network.
+ *  @param[in] userdata The userdata passed to callback.
+ */
+void ts_si_enumerate_networks(TsSi *si, TsSiNetworkEnumFunc callback, void *userdata);
+
+/** Enumerate the transport streams listed by the NIT of a network.
+ *  @param[in] si The decoder.
+ *  @param[in] network The network.
+ *  @param[in] callback Called for each transport stream.
+ *  @param[in] userdata The userdata passed to callback.
+ */
+void ts_si_enumerate_transport_streams(TsSi *si, const TsSiNetwork *network, TsSiTransportStreamEnumFunc callback,
+                                       void *userdata);
+
+/** Get the counters of a decoder.
+ *  @param[in] si The decoder.
+ *  @param[out] stats The counters.
+ */
+void ts_si_get_stats(TsSi *si, TsSiStats *stats);
@@ -0,0 +1,86 @@
+#include "ts-snapshot.h"
+#include "utils.h"
+
+/* Keep the writer and reader state on different cache lines. */
+#define TS_SNAPSHOT_CACHE_LINE 64
+
+/* Set in middle while it holds a snapshot the reader has not taken yet. */
+#define TS_SNAPSHOT_FRESH 0x4
+#define TS_SNAPSHOT_INDEX 0x3
+
+struct _TsSnapshot {
+    uint8_t *buffers[3];
+
+    uint8_t pad0[TS_SNAPSHOT_CACHE_LINE];
+
+    /* The buffer handed over between the threads, exchanged atomically by both. */
+    uint32_t middle;
+
+    uint8_t pad1[TS_SNAPSHOT_CACHE_LINE];
+
+    /* Written by the writer. */
+    uint32_t write;
+    uint64_t published;
+
+    uint8_t pad2[TS_SNAPSHOT_CACHE_LINE];
+
+    /* Written by the reader. */
+    uint32_t read;
+    uint64_t read_count;
+
+    uint8_t pad3[TS_SNAPSHOT_CACHE_LINE];
+};
+
+TsSnapshot *ts_snapshot_new(size_t size)
+{
+    TsSnapshot *snapshot = util_alloc0(sizeof(TsSnapshot));
+    size_t j;
+    for (j = 0; j < 3; ++j)
+        snapshot->buffers[j] = util_alloc0(size ? size : 1);
+    snapshot->write = 0;
+    snapshot->middle = 1;
+    snapshot->read = 2;
+    return snapshot;
+}
+
+void ts_snapshot_free(TsSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+    size_t j;
+    for (j = 0; j < 3; ++j)
+        util_free(snapshot->buffers[j]);
+    util_free(snapshot);
+}
+
+void *ts_snapshot_get_buffer(TsSnapshot *snapshot)
+{
+    return snapshot->buffers[snapshot->write];
+}
+
+void ts_snapshot_publish(TsSnapshot *snapshot)
+{
+    /* release: the reader sees the content once it sees the index */
+    uint32_t middle = __atomic_exchange_n(&snapshot->middle, snapshot->write | TS_SNAPSHOT_FRESH, __ATOMIC_ACQ_REL);
+    snapshot->write = middle & TS_SNAPSHOT_INDEX;
+    __atomic_store_n(&snapshot->published, snapshot->published + 1, __ATOMIC_RELAXED);
+}
+
+void *ts_snapshot_read(TsSnapshot *snapshot)
+{
+    if (!(__atomic_load_n(&snapshot->middle, __ATOMIC_ACQUIRE) & TS_SNAPSHOT_FRESH))
+        return NULL;
+    /* only the writer sets the flag again, so the exchange takes a fresh snapshot */
+    uint32_t middle = __atomic_exchange_n(&snapshot->middle, snapshot->read, __ATOMIC_ACQ_REL);
+    snapshot->read = middle & TS_SNAPSHOT_INDEX;
+    __atomic_store_n(&snapshot->read_count, snapshot->read_count + 1, __ATOMIC_RELAXED);
+    return snapshot->buffers[snapshot->read];
+}
+
+void ts_snapshot_get_stats(TsSnapshot *snapshot, TsSnapshotStats *stats)
+{
+    if (snapshot == NULL || stats == NULL)
+        return;
+    stats->published = __atomic_load_n(&snapshot->published, __ATOMIC_RELAXED);
+    stats->read = __atomic_load_n(&snapshot->read_count, __ATOMIC_RELAXED);
+}
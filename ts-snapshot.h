@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A lock-free triple buffer passing snapshots of a fixed size from one writer thread to one reader thread.
+ *  The writer fills its buffer and publishes it, the reader takes the latest published one. Neither
+ *  ever waits for the other: the writer always has a buffer of its own and a snapshot published while
+ *  the reader is busy replaces the one not yet read.
+ */
+typedef struct _TsSnapshot TsSnapshot;
+
+/** Counters of a triple buffer. */
+typedef struct _TsSnapshotStats {
+    uint64_t published; /**< Snapshots published by the writer. */
+    uint64_t read; /**< Snapshots taken by the reader. */
+} TsSnapshotStats;
+
+/** Create a triple buffer.
+ *  @param[in] size The size of a snapshot.
+ *  @return The new triple buffer with zeroed buffers.
+ */
+TsSnapshot *ts_snapshot_new(size_t size);
+
+/** Free a triple buffer. Both threads must be done with it.
+ *  @param[in] snapshot The triple buffer to free.
+ */
+void ts_snapshot_free(TsSnapshot *snapshot);
+
+/** Get the buffer of the writer, writer only. Its content is that of an earlier snapshot.
+ *  @param[in] snapshot The triple buffer.
+ *  @return The buffer to fill, valid until the next ts_snapshot_publish.
+ */
+void *ts_snapshot_get_buffer(TsSnapshot *snapshot);
+
+/** Pass the filled buffer to the reader and take another one, writer only.
+ *  @param[in] snapshot The triple buffer.
+ */
+void ts_snapshot_publish(TsSnapshot *snapshot);
+
+/** Take the latest published snapshot, reader only.
+ *  @param[in] snapshot The triple buffer.
+ *  @return The snapshot, owned by the reader until the next call, or NULL if nothing was published
+ *          since the last call.
+ */
+void *ts_snapshot_read(TsSnapshot *snapshot);
+
+/** Get the counters of a triple buffer.
+ *  @param[in] snapshot The triple buffer.
+ *  @param[out] stats The counters.
+ */
+void ts_snapshot_get_stats(TsSnapshot *snapshot, TsSnapshotStats *stats);
@@ -0,0 +1,163 @@
+#include "ts-sync.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_SYNC_X86 1
+#endif
+
+#define TS_SYNC_BYTE 0x47
+
+typedef size_t (*TsSyncFindFunc)(const uint8_t *, size_t, size_t, size_t);
+typedef size_t (*TsSyncCountFunc)(const uint8_t *, size_t, size_t, size_t);
+
+static size_t ts_sync_find_scalar_from(const uint8_t *buffer, size_t len, size_t stride, size_t count, size_t offset)
+{
+    size_t span = (count - 1) * stride;
+    size_t k;
+    for (; offset + span < len; ++offset) {
+        for (k = 0; k < count && buffer[offset + k * stride] == TS_SYNC_BYTE; ++k);
+        if (k == count)
+            return offset;
+    }
+    return len;
+}
+
+static size_t ts_sync_find_scalar(const uint8_t *buffer, size_t len, size_t stride, size_t count)
+{
+    return ts_sync_find_scalar_from(buffer, len, stride, count, 0);
+}
+
+static size_t ts_sync_count_valid_scalar(const uint8_t *buffer, size_t len, size_t stride, size_t max)
+{
+    size_t j;
+    for (j = 0; j < max && buffer[j * stride] == TS_SYNC_BYTE; ++j);
+    return j;
+}
+
+#ifdef TS_SYNC_X86
+/* Compare a block of candidate offsets and the bytes one, two, … strides behind them at once.
+ * A bit remains set in the mask only if all count positions hold a sync byte. */
+__attribute__((target("sse2")))
+static size_t ts_sync_find_sse2(const uint8_t *buffer, size_t len, size_t stride, size_t count)
+{
+    const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+    size_t span = (count - 1) * stride;
+    size_t offset = 0;
+    size_t k;
+    uint32_t mask;
+    for (; offset + span + 16 <= len; offset += 16) {
+        mask = 0xffff;
+        for (k = 0; k < count && mask; ++k) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&buffer[offset + k * stride]);
+            mask &= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, sync));
+        }
+        if (mask)
+            return offset + __builtin_ctz(mask);
+    }
+    return ts_sync_find_scalar_from(buffer, len, stride, count, offset);
+}
+
+__attribute__((target("avx2")))
+static size_t ts_sync_find_avx2(const uint8_t *buffer, size_t len, size_t stride, size_t count)
+{
+    const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+    size_t span = (count - 1) * stride;
+    size_t offset = 0;
+    size_t k;
+    uint32_t mask;
+    for (; offset + span + 32 <= len; offset += 32) {
+        mask = 0xffffffff;
+        for (k = 0; k < count && mask; ++k) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&buffer[offset + k * stride]);
+            mask &= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sync));
+        }
+        if (mask)
+            return offset + __builtin_ctz(mask);
+    }
+    return ts_sync_find_scalar_from(buffer, len, stride, count, offset);
+}
+
+/* Gather the first bytes of eight packets per step. Each lane loads four bytes, so the last
+ * packets are checked by the scalar loop to stay inside the buffer. */
+__attribute__((target("avx2")))
+static size_t ts_sync_count_valid_avx2(const uint8_t *buffer, size_t len, size_t stride, size_t max)
+{
+    const __m256i index = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride,
+                                            4 * stride, 5 * stride, 6 * stride, 7 * stride);
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m256i sync = _mm256_set1_epi32(TS_SYNC_BYTE);
+    size_t j = 0;
+    uint32_t mask;
+    for (; j + 8 <= max && (j + 7) * stride + 4 <= len; j += 8) {
+        __m256i v = _mm256_i32gather_epi32((const int *)&buffer[j * stride], index, 1);
+        v = _mm256_cmpeq_epi32(_mm256_and_si256(v, low), sync);
+        mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(v));
+        if (mask != 0xff)
+            return j + __builtin_ctz(~mask);
+    }
+    return j + ts_sync_count_valid_scalar(&buffer[j * stride], len - j * stride, stride, max - j);
+}
+#endif
+
+static TsSyncFindFunc ts_sync_find_impl;
+static TsSyncCountFunc ts_sync_count_valid_impl;
+
+/* Select the kernels for the cpu we are running on. */
+__attribute__((constructor))
+static void ts_sync_init(void)
+{
+    TsSyncFindFunc find = ts_sync_find_scalar;
+    TsSyncCountFunc count = ts_sync_count_valid_scalar;
+#ifdef TS_SYNC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        find = ts_sync_find_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        find = ts_sync_find_avx2;
+        count = ts_sync_count_valid_avx2;
+    }
+#endif
+    ts_sync_count_valid_impl = count;
+    ts_sync_find_impl = find;
+}
+
+size_t ts_sync_find(const uint8_t *buffer, size_t len, size_t stride, size_t count)
+{
+    if (count == 0)
+        return 0;
+    return ts_sync_find_impl(buffer, len, stride, count);
+}
+
+size_t ts_sync_count_valid(const uint8_t *buffer, size_t len, size_t stride, size_t max)
+{
+    return ts_sync_count_valid_impl(buffer, len, stride, max);
+}
+
+size_t ts_sync_detect(const uint8_t *buffer, size_t len, size_t *packet_length)
+{
+    static const size_t lengths[] = { 188, 192, 204 };
+    size_t best = len;
+    size_t best_length = 0;
+    size_t limit;
+    size_t offset;
+    size_t j;
+    for (j = 0; j < sizeof(lengths) / sizeof(lengths[0]); ++j) {
+        /* Only look for runs starting before the best one found so far. */
+        limit = best == len ? len : best + (TS_SYNC_CONFIRM_COUNT - 1) * lengths[j];
+        if (limit > len)
+            limit = len;
+        offset = ts_sync_find(buffer, limit, lengths[j], TS_SYNC_CONFIRM_COUNT);
+        if (offset < limit && offset < best) {
+            best = offset;
+            best_length = lengths[j];
+        }
+    }
+    if (best_length && packet_length)
+        *packet_length = best_length;
+    return best;
+}
+
+size_t ts_sync_get_prefix_length(size_t packet_length)
+{
+    return packet_length == 192 ? TS_SYNC_M2TS_PREFIX : 0;
+}
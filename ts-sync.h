@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Number of consecutive sync bytes required to lock onto a stream. */
+#define TS_SYNC_CONFIRM_COUNT 5
+
+/** Bytes before the sync byte of a 192 byte M2TS packet, the TP_extra_header with the arrival timestamp.
+ *  The 16 Reed-Solomon parity bytes of 204 byte packets follow the 188 bytes of the packet. */
+#define TS_SYNC_M2TS_PREFIX 4
+
+/** Find the first run of packets starting with a sync byte.
+ *  @param[in] buffer The buffer to search.
+ *  @param[in] len The length of the buffer.
+ *  @param[in] stride The packet length.
+ *  @param[in] count The number of consecutive sync bytes required.
+ *  @return The offset of the first sync byte of the run, or len if there is no such run
+ *          with all count sync bytes inside the buffer.
+ */
+size_t ts_sync_find(const uint8_t *buffer, size_t len, size_t stride, size_t count);
+
+/** Count the consecutive packets at the start of the buffer beginning with a sync byte.
+ *  @param[in] buffer The buffer to check.
+ *  @param[in] len The length of the buffer.
+ *  @param[in] stride The packet length.
+ *  @param[in] max The maximum number of packets to check, at most len / stride.
+ *  @return The number of valid packets before the first invalid one.
+ */
+size_t ts_sync_count_valid(const uint8_t *buffer, size_t len, size_t stride, size_t max);
+
+/** Find the first run of TS_SYNC_CONFIRM_COUNT packets of 188, 192 or 204 bytes.
+ *  @param[in] buffer The buffer to search.
+ *  @param[in] len The length of the buffer.
+ *  @param[out] packet_length The detected packet length. Unchanged if nothing was found.
+ *  @return The offset of the first sync byte, or len if there is none.
+ */
+size_t ts_sync_detect(const uint8_t *buffer, size_t len, size_t *packet_length);
+
+/** Get the number of bytes before the sync byte of a packet.
+ *  @param[in] packet_length The packet length.
+ *  @return TS_SYNC_M2TS_PREFIX for 192 byte packets, otherwise 0.
+ */
+size_t ts_sync_get_prefix_length(size_t packet_length);
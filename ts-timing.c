@@ -0,0 +1,169 @@
+#include "ts-timing.h"
+#include "utils.h"
+
+#include <memory.h>
+
+/* The PCR wraps after 2^33 * 300 ticks. */
+#define TS_TIMING_PCR_WRAP ((UINT64_C(1) << 33) * 300)
+/* Larger steps of the PCR are treated as discontinuity. */
+#define TS_TIMING_PCR_MAX_STEP 27000000
+/* Bits per packet and ticks per second for the rate calculations. */
+#define TS_TIMING_PACKET_BITS (188 * 8)
+#define TS_TIMING_CLOCK_RATE 27000000
+
+TsTiming *ts_timing_new(void)
+{
+    return util_alloc0(sizeof(TsTiming));
+}
+
+void ts_timing_free(TsTiming *timing)
+{
+    util_free(timing);
+}
+
+void ts_timing_update_clock(TsTiming *timing, uint64_t clock, bool discontinuity)
+{
+    if (!timing->clock_valid || discontinuity) {
+        /* start a new window, packets counted so far cannot be related to the clock */
+        memset(timing->counts, 0, sizeof(timing->counts));
+        timing->slot = 0;
+        timing->slot_count = 1;
+        timing->slot_start[0] = clock;
+        if (!timing->clock_valid)
+            timing->clock_start = clock;
+        timing->clock_valid = true;
+        timing->clock = clock;
+        return;
+    }
+
+    timing->clock = clock;
+    if (clock - timing->slot_start[timing->slot] < TS_TIMING_SLOT_LENGTH)
+        return;
+
+    /* reuse the oldest slot */
+    timing->slot = (timing->slot + 1) % TS_TIMING_SLOTS;
+    memset(timing->counts[timing->slot], 0, sizeof(timing->counts[0]));
+    timing->slot_start[timing->slot] = clock;
+    if (timing->slot_count < TS_TIMING_SLOTS)
+        ++timing->slot_count;
+}
+
+static TsTimingPcrPid *ts_timing_get_pcr_pid(TsTiming *timing, uint16_t pid, bool create)
+{
+    size_t j;
+    for (j = 0; j < timing->pcr_pid_count; ++j) {
+        if (timing->pcr_pids[j].pid == pid)
+            return &timing->pcr_pids[j];
+    }
+    if (!create || timing->pcr_pid_count == TS_TIMING_PCR_PIDS)
+        return NULL;
+    TsTimingPcrPid *state = &timing->pcr_pids[timing->pcr_pid_count++];
+    state->pid = pid;
+    return state;
+}
+
+void ts_timing_add_pcr(TsTiming *timing, uint16_t pid, uint64_t pcr, uint64_t packet)
+{
+    TsTimingPcrPid *state = ts_timing_get_pcr_pid(timing, pid, true);
+    if (state == NULL)
+        return;
+
+    ++state->pcr_count;
+
+    if (state->sample_count) {
+        TsPcrSample *last = &state->samples[(state->sample_pos + TS_TIMING_PCR_SAMPLES - 1) % TS_TIMING_PCR_SAMPLES];
+        uint64_t interval = (pcr + TS_TIMING_PCR_WRAP - last->pcr % TS_TIMING_PCR_WRAP) % TS_TIMING_PCR_WRAP;
+        if (interval > TS_TIMING_PCR_MAX_STEP) {
+            /* discontinuity, restart the measurement */
+            state->sample_count = 0;
+        }
+        else {
+            if (state->interval_count == 0 || interval < state->interval_min)
+                state->interval_min = interval;
+            if (interval > state->interval_max)
+                state->interval_max = interval;
+            state->interval_sum += interval;
+            ++state->interval_count;
+
+            /* deviation from the PCR expected at a constant rate over the window */
+            if (state->sample_count >= 2) {
+                TsPcrSample *oldest = &state->samples[(state->sample_pos + TS_TIMING_PCR_SAMPLES - state->sample_count) % TS_TIMING_PCR_SAMPLES];
+                if (last->packet > oldest->packet) {
+                    uint64_t expected = (packet - last->packet) * (last->pcr - oldest->pcr) / (last->packet - oldest->packet);
+                    uint64_t jitter = interval > expected ? interval - expected : expected - interval;
+                    if (jitter > state->jitter_max)
+                        state->jitter_max = jitter;
+                }
+            }
+
+            /* keep the samples unwrapped */
+            pcr = last->pcr + interval;
+        }
+    }
+
+    state->samples[state->sample_pos].pcr = pcr;
+    state->samples[state->sample_pos].packet = packet;
+    state->sample_pos = (state->sample_pos + 1) % TS_TIMING_PCR_SAMPLES;
+    if (state->sample_count < TS_TIMING_PCR_SAMPLES)
+        ++state->sample_count;
+}
+
+static uint64_t ts_timing_get_window_bitrate(TsTiming *timing, uint64_t packets)
+{
+    if (!timing->clock_valid)
+        return 0;
+    size_t oldest = (timing->slot + TS_TIMING_SLOTS - (timing->slot_count - 1)) % TS_TIMING_SLOTS;
+    uint64_t duration = timing->clock - timing->slot_start[oldest];
+    if (duration == 0)
+        return 0;
+    return packets * TS_TIMING_PACKET_BITS * TS_TIMING_CLOCK_RATE / duration;
+}
+
+uint64_t ts_timing_get_bitrate(TsTiming *timing, uint16_t pid)
+{
+    uint64_t packets = 0;
+    size_t j;
+    if (pid >= TS_TIMING_PID_COUNT)
+        return 0;
+    for (j = 0; j < TS_TIMING_SLOTS; ++j)
+        packets += timing->counts[j][pid];
+    return ts_timing_get_window_bitrate(timing, packets);
+}
+
+uint64_t ts_timing_get_total_bitrate(TsTiming *timing)
+{
+    uint64_t packets = 0;
+    size_t j;
+    size_t pid;
+    for (j = 0; j < TS_TIMING_SLOTS; ++j) {
+        for (pid = 0; pid < TS_TIMING_PID_COUNT; ++pid)
+            packets += timing->counts[j][pid];
+    }
+    return ts_timing_get_window_bitrate(timing, packets);
+}
+
+uint64_t ts_timing_get_pcr_bitrate(TsTiming *timing, uint16_t pid)
+{
+    TsTimingPcrPid *state = ts_timing_get_pcr_pid(timing, pid, false);
+    if (state == NULL || state->sample_count < 2)
+        return 0;
+    TsPcrSample *last = &state->samples[(state->sample_pos + TS_TIMING_PCR_SAMPLES - 1) % TS_TIMING_PCR_SAMPLES];
+    TsPcrSample *oldest = &state->samples[(state->sample_pos + TS_TIMING_PCR_SAMPLES - state->sample_count) % TS_TIMING_PCR_SAMPLES];
+    if (last->pcr == oldest->pcr)
+        return 0;
+    return (last->packet - oldest->packet) * TS_TIMING_PACKET_BITS * TS_TIMING_CLOCK_RATE / (last->pcr - oldest->pcr);
+}
+
+bool ts_timing_get_pcr_info(TsTiming *timing, uint16_t pid, TsPidTiming *info)
+{
+    TsTimingPcrPid *state = ts_timing_get_pcr_pid(timing, pid, false);
+    if (state == NULL)
+        return false;
+    info->pcr_count = state->pcr_count;
+    info->pcr_bitrate = ts_timing_get_pcr_bitrate(timing, pid);
+    info->pcr_interval_min = state->interval_min;
+    info->pcr_interval_max = state->interval_max;
+    info->pcr_interval_avg = state->interval_count ? state->interval_sum / state->interval_count : 0;
+    info->pcr_jitter_max = state->jitter_max;
+    return true;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ts-analyzer.h"
+
+/* PIDs are 13 bit. */
+#define TS_TIMING_PID_COUNT 8192
+
+/* The bitrates are measured over TS_TIMING_SLOTS slots of TS_TIMING_SLOT_LENGTH 27 MHz ticks. */
+#define TS_TIMING_SLOTS 10
+#define TS_TIMING_SLOT_LENGTH (27000000 / 10)
+
+/* Number of PCRs per pid used to measure the transport rate. */
+#define TS_TIMING_PCR_SAMPLES 32
+
+/* Maximum number of pids carrying a PCR. */
+#define TS_TIMING_PCR_PIDS 64
+
+typedef struct _TsPcrSample {
+    uint64_t pcr; /* unwrapped, 27 MHz */
+    uint64_t packet; /* index of the packet in the stream */
+} TsPcrSample;
+
+/* State of a pid carrying a PCR. */
+typedef struct _TsTimingPcrPid {
+    uint16_t pid;
+    TsPcrSample samples[TS_TIMING_PCR_SAMPLES];
+    size_t sample_pos; /* position of the next sample */
+    size_t sample_count;
+    uint64_t pcr_count;
+    uint64_t interval_min;
+    uint64_t interval_max;
+    uint64_t interval_sum;
+    uint64_t interval_count;
+    uint64_t jitter_max;
+} TsTimingPcrPid;
+
+/* Bitrate measurement with constant memory. */
+typedef struct _TsTiming {
+    /* Packets per pid and slot, slots form a ring ending with the current one. */
+    uint32_t counts[TS_TIMING_SLOTS][TS_TIMING_PID_COUNT];
+    uint64_t slot_start[TS_TIMING_SLOTS];
+    size_t slot;
+    size_t slot_count;
+
+    /* clock of the analyzer, valid after the first PCR */
+    uint64_t clock;
+    uint64_t clock_start;
+    bool clock_valid;
+
+    TsTimingPcrPid pcr_pids[TS_TIMING_PCR_PIDS];
+    size_t pcr_pid_count;
+} TsTiming;
+
+TsTiming *ts_timing_new(void);
+void ts_timing_free(TsTiming *timing);
+
+/* Count a packet in the current slot. */
+static inline void ts_timing_count_packet(TsTiming *timing, uint16_t pid)
+{
+    ++timing->counts[timing->slot][pid];
+}
+
+/* The clock of the analyzer advanced, or started over after a discontinuity. */
+void ts_timing_update_clock(TsTiming *timing, uint64_t clock, bool discontinuity);
+
+/* A pid carried a PCR.
+ * @param pcr The PCR in 27 MHz ticks.
+ * @param packet The index of the packet in the stream. */
+void ts_timing_add_pcr(TsTiming *timing, uint16_t pid, uint64_t pcr, uint64_t packet);
+
+/* The bitrate of a pid over the window. */
+uint64_t ts_timing_get_bitrate(TsTiming *timing, uint16_t pid);
+
+/* The bitrate of all pids over the window. */
+uint64_t ts_timing_get_total_bitrate(TsTiming *timing);
+
+/* The transport rate measured with the PCRs of a pid, 0 if unknown. */
+uint64_t ts_timing_get_pcr_bitrate(TsTiming *timing, uint16_t pid);
+
+/* Fill the PCR related fields of a pid. Returns false if the pid carries no PCR. */
+bool ts_timing_get_pcr_info(TsTiming *timing, uint16_t pid, TsPidTiming *info);
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include "ts-udp.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <memory.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Payload size assumed before the first datagram, 7 packets. */
+#define TS_UDP_DEFAULT_PAYLOAD (7 * 188)
+/* Fixed part of the RTP header. */
+#define TS_UDP_RTP_HEADER 12
+/* Room for datagrams larger than the expected payload, up to jumbo frames. */
+#define TS_UDP_OVERFLOW 9000
+/* Requested socket receive buffer, to survive short stalls of the analyzer. */
+#define TS_UDP_RCVBUF (8 << 20)
+/* Larger jumps of the RTP sequence number are treated as a restart of the sender. */
+#define TS_UDP_SEQ_MAX_GAP 3000
+/* Number of sequence numbers behind the latest one remembered to detect duplicates. */
+#define TS_UDP_SEQ_WINDOW 64
+
+struct _TsUdpReceiver {
+    int fd;
+
+    /* Layout of the receive buffers, adapted to the last datagram of each batch. */
+    bool rtp; /* expect an RTP header */
+    size_t payload_size; /* expected transport stream bytes per datagram */
+
+    /* Payloads of the expected size end up back to back in data. */
+    uint8_t *data;
+    uint8_t headers[TS_UDP_BATCH][TS_UDP_RTP_HEADER];
+    uint8_t *overflow;
+    /* A datagram of unexpected layout is copied here before parsing. */
+    uint8_t *scratch;
+
+    struct mmsghdr msgs[TS_UDP_BATCH];
+    struct iovec iovecs[TS_UDP_BATCH][3];
+
+    /* Latest RTP sequence number and the ones received before it, bit k is seq - k. */
+    bool seq_valid;
+    uint16_t seq;
+    uint64_t seq_received;
+
+    /* Layout of the last datagram */
+    bool last_rtp;
+    size_t last_payload_size;
+
+    TsUdpStats stats;
+};
+
+/* Point the iovecs of every message to its header, payload slot and overflow area. */
+static void ts_udp_receiver_setup(TsUdpReceiver *receiver)
+{
+    size_t j;
+    size_t k;
+    receiver->data = util_realloc(receiver->data, TS_UDP_BATCH * receiver->payload_size);
+    for (j = 0; j < TS_UDP_BATCH; ++j) {
+        k = 0;
+        if (receiver->rtp) {
+            receiver->iovecs[j][k].iov_base = receiver->headers[j];
+            receiver->iovecs[j][k++].iov_len = TS_UDP_RTP_HEADER;
+        }
+        receiver->iovecs[j][k].iov_base = &receiver->data[j * receiver->payload_size];
+        receiver->iovecs[j][k++].iov_len = receiver->payload_size;
+        receiver->iovecs[j][k].iov_base = &receiver->overflow[j * TS_UDP_OVERFLOW];
+        receiver->iovecs[j][k++].iov_len = TS_UDP_OVERFLOW;
+
+        memset(&receiver->msgs[j], 0, sizeof(struct mmsghdr));
+        receiver->msgs[j].msg_hdr.msg_iov = receiver->iovecs[j];
+        receiver->msgs[j].msg_hdr.msg_iovlen = k;
+    }
+}
+
+static bool ts_udp_join_group(int fd, struct addrinfo *ai, unsigned int ifindex)
+{
+    if (ai->ai_family == AF_INET) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)ai->ai_addr;
+        if (!IN_MULTICAST(ntohl(addr->sin_addr.s_addr)))
+            return true;
+        struct ip_mreqn mreq;
+        memset(&mreq, 0, sizeof(struct ip_mreqn));
+        mreq.imr_multiaddr = addr->sin_addr;
+        mreq.imr_ifindex = ifindex;
+        return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+    }
+    if (ai->ai_family == AF_INET6) {
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)ai->ai_addr;
+        if (!IN6_IS_ADDR_MULTICAST(&addr->sin6_addr))
+            return true;
+        struct ipv6_mreq mreq;
+        memset(&mreq, 0, sizeof(struct ipv6_mreq));
+        mreq.ipv6mr_multiaddr = addr->sin6_addr;
+        mreq.ipv6mr_interface = ifindex;
+        return setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) == 0;
+    }
+    return true;
+}
+
+TsUdpReceiver *ts_udp_receiver_new(const char *address, uint16_t port, const char *interface)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai = NULL;
+    char service[8];
+    unsigned int ifindex = 0;
+    int fd = -1;
+    int value;
+    int err;
+
+    if (interface && (ifindex = if_nametoindex(interface)) == 0)
+        return NULL;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%u", port);
+    if ((err = getaddrinfo(address && address[0] ? address : NULL, service, &hints, &ai)) != 0) {
+        errno = err == EAI_SYSTEM ? errno : EINVAL;
+        return NULL;
+    }
+
+    fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        goto error;
+    value = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    /* not fatal, the kernel limits the size anyway */
+    value = TS_UDP_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        goto error;
+    if (!ts_udp_join_group(fd, ai, ifindex))
+        goto error;
+    freeaddrinfo(ai);
+
+    TsUdpReceiver *receiver = util_alloc0(sizeof(TsUdpReceiver));
+    receiver->fd = fd;
+    receiver->payload_size = TS_UDP_DEFAULT_PAYLOAD;
+    receiver->overflow = util_alloc(TS_UDP_BATCH * TS_UDP_OVERFLOW);
+    receiver->scratch = util_alloc(TS_UDP_RTP_HEADER + 2 * TS_UDP_OVERFLOW);
+    ts_udp_receiver_setup(receiver);
+    return receiver;
+
+error:
+    err = errno;
+    if (fd >= 0)
+        close(fd);
+    freeaddrinfo(ai);
+    errno = err;
+    return NULL;
+}
+
+bool ts_udp_is_url(const char *url)
+{
+    return url && (strncmp(url, "udp://", 6) == 0 || strncmp(url, "rtp://", 6) == 0);
+}
+
+TsUdpReceiver *ts_udp_receiver_new_from_url(const char *url, const char *interface)
+{
+    char host[256];
+    const char *start;
+    const char *end;
+    const char *port;
+    char *port_end;
+    unsigned long port_number;
+
+    if (!ts_udp_is_url(url)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    start = url + 6;
+    /* udp://@group:port as used by vlc */
+    if (*start == '@')
+        ++start;
+    if (*start == '[') {
+        ++start;
+        end = strchr(start, ']');
+        if (end == NULL || end[1] != ':') {
+            errno = EINVAL;
+            return NULL;
+        }
+        port = end + 2;
+    }
+    else {
+        end = strrchr(start, ':');
+        if (end == NULL) {
+            errno = EINVAL;
+            return NULL;
+        }
+        port = end + 1;
+    }
+    if ((size_t)(end - start) >= sizeof(host)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(host, start, end - start);
+    host[end - start] = 0;
+
+    port_number = strtoul(port, &port_end, 10);
+    if (port_end == port || *port_end != 0 || port_number == 0 || port_number > 65535) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ts_udp_receiver_new(host, port_number, interface);
+}
+
+void ts_udp_receiver_free(TsUdpReceiver *receiver)
+{
+    if (receiver == NULL)
+        return;
+    close(receiver->fd);
+    util_free(receiver->data);
+    util_free(receiver->overflow);
+    util_free(receiver->scratch);
+    util_free(receiver);
+}
+
+static void ts_udp_update_seq(TsUdpReceiver *receiver, uint16_t seq)
+{
+    ++receiver->stats.rtp_datagrams;
+    if (receiver->seq_valid) {
+        uint16_t ahead = seq - receiver->seq;
+        uint16_t behind = receiver->seq - seq;
+        if (ahead == 0) {
+            ++receiver->stats.duplicates;
+            return;
+        }
+        if (behind < TS_UDP_SEQ_MAX_GAP) {
+            /* late, it was counted as lost when a later one arrived */
+            if (behind >= TS_UDP_SEQ_WINDOW) {
+                ++receiver->stats.reordered;
+            }
+            else if (receiver->seq_received & (UINT64_C(1) << behind)) {
+                ++receiver->stats.duplicates;
+            }
+            else {
+                receiver->seq_received |= UINT64_C(1) << behind;
+                ++receiver->stats.reordered;
+                if (receiver->stats.lost)
+                    --receiver->stats.lost;
+            }
+            return;
+        }
+        if (ahead < TS_UDP_SEQ_MAX_GAP) {
+            receiver->stats.lost += ahead - 1;
+            receiver->seq_received = ahead >= TS_UDP_SEQ_WINDOW ? 0 : receiver->seq_received << ahead;
+            receiver->seq_received |= 1;
+            receiver->seq = seq;
+            return;
+        }
+    }
+    /* first datagram or the sender restarted */
+    receiver->seq_valid = true;
+    receiver->seq = seq;
+    receiver->seq_received = 1;
+}
+
+/* Parse a datagram of unexpected layout: another payload size, RTP header extensions, padding,
+ * or switching between RTP and plain UDP. */
+static void ts_udp_handle_datagram(TsUdpReceiver *receiver, size_t index, TsUdpPushFunc push, void *userdata)
+{
+    struct mmsghdr *msg = &receiver->msgs[index];
+    size_t len = msg->msg_len;
+    size_t copied = 0;
+    size_t part;
+    size_t k;
+    const uint8_t *buffer = receiver->scratch;
+    size_t offset = 0;
+    bool rtp;
+
+    if (msg->msg_hdr.msg_flags & MSG_TRUNC)
+        ++receiver->stats.truncated;
+
+    for (k = 0; k < msg->msg_hdr.msg_iovlen && copied < len; ++k) {
+        part = len - copied < msg->msg_hdr.msg_iov[k].iov_len ? len - copied : msg->msg_hdr.msg_iov[k].iov_len;
+        memcpy(&receiver->scratch[copied], msg->msg_hdr.msg_iov[k].iov_base, part);
+        copied += part;
+    }
+    len = copied;
+    if (len == 0)
+        return;
+
+    /* RTP version 2, a sync byte 0x47 never matches */
+    rtp = (buffer[0] & 0xc0) == 0x80;
+    if (rtp) {
+        bool valid = true;
+        offset = TS_UDP_RTP_HEADER + 4 * (buffer[0] & 0x0f);
+        if (buffer[0] & 0x10) {
+            /* header extension */
+            if (offset + 4 <= len)
+                offset += 4 + 4 * ((buffer[offset + 2] << 8) | buffer[offset + 3]);
+            else
+                valid = false;
+        }
+        if (valid && offset <= len && (buffer[0] & 0x20)) {
+            /* padding, the last byte counts itself */
+            if (offset == len || buffer[len - 1] > len - offset)
+                valid = false;
+            else
+                len -= buffer[len - 1];
+        }
+        if (!valid || offset > len) {
+            ++receiver->stats.truncated;
+            return;
+        }
+        ts_udp_update_seq(receiver, (buffer[2] << 8) | buffer[3]);
+    }
+
+    receiver->last_rtp = rtp;
+    receiver->last_payload_size = len - offset;
+    if (len > offset) {
+        receiver->stats.bytes += len - offset;
+        push(userdata, &buffer[offset], len - offset);
+    }
+}
+
+int ts_udp_receiver_receive(TsUdpReceiver *receiver, int timeout_ms, TsUdpPushFunc push, void *userdata)
+{
+    struct pollfd pfd = { .fd = receiver->fd, .events = POLLIN };
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0)
+        return ret < 0 && errno != EINTR ? -1 : 0;
+
+    int count = recvmmsg(receiver->fd, receiver->msgs, TS_UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (count < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    if (count == 0)
+        return 0;
+    ++receiver->stats.batches;
+    receiver->stats.datagrams += count;
+
+    size_t header_size = receiver->rtp ? TS_UDP_RTP_HEADER : 0;
+    size_t payload_size = receiver->payload_size;
+    uint8_t *start = receiver->data; /* regular payloads not pushed yet */
+    uint8_t *end = receiver->data;
+    uint8_t *slot;
+    int j;
+    for (j = 0; j < count; ++j) {
+        slot = &receiver->data[j * payload_size];
+        if (!(receiver->msgs[j].msg_hdr.msg_flags & MSG_TRUNC) &&
+                receiver->msgs[j].msg_len == header_size + payload_size &&
+                (receiver->rtp ? receiver->headers[j][0] == 0x80 : slot[0] == 0x47)) {
+            /* the payload directly follows the previous one */
+            if (receiver->rtp)
+                ts_udp_update_seq(receiver, (receiver->headers[j][2] << 8) | receiver->headers[j][3]);
+            receiver->last_rtp = receiver->rtp;
+            receiver->last_payload_size = payload_size;
+            receiver->stats.bytes += payload_size;
+            end = slot + payload_size;
+            continue;
+        }
+        if (end > start)
+            push(userdata, start, end - start);
+        ts_udp_handle_datagram(receiver, j, push, userdata);
+        start = end = slot + payload_size;
+    }
+    if (end > start)
+        push(userdata, start, end - start);
+
+    /* receive the next batch in the layout of the last datagram */
+    if ((receiver->last_rtp != receiver->rtp || receiver->last_payload_size != receiver->payload_size) &&
+            receiver->last_payload_size > 0 && receiver->last_payload_size <= TS_UDP_OVERFLOW) {
+        receiver->rtp = receiver->last_rtp;
+        receiver->payload_size = receiver->last_payload_size;
+        ts_udp_receiver_setup(receiver);
+    }
+
+    return count;
+}
+
+void ts_udp_receiver_get_stats(TsUdpReceiver *receiver, TsUdpStats *stats)
+{
+    if (receiver && stats)
+        *stats = receiver->stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Receive a transport stream from UDP or RTP over UDP, unicast or multicast. */
+typedef struct _TsUdpReceiver TsUdpReceiver;
+
+/** Number of datagrams received with one system call. */
+#define TS_UDP_BATCH 64
+
+/** Counters of a receiver. */
+typedef struct _TsUdpStats {
+    uint64_t datagrams; /**< Datagrams received. */
+    uint64_t bytes; /**< Transport stream bytes passed on, without RTP headers. */
+    uint64_t rtp_datagrams; /**< Datagrams with an RTP header. */
+    uint64_t lost; /**< Datagrams missing according to the RTP sequence numbers. */
+    uint64_t reordered; /**< RTP datagrams arriving after a later one. */
+    uint64_t duplicates; /**< RTP datagrams received twice. */
+    uint64_t truncated; /**< Datagrams too large for the receive buffers or with invalid RTP headers. */
+    uint64_t batches; /**< Calls to recvmmsg() returning data. */
+} TsUdpStats;
+
+/** Callback for received data, e.g. ts_analyzer_push_buffer.
+ *  The data is only valid until the callback returns. */
+typedef void (*TsUdpPushFunc)(void *userdata, const uint8_t *data, size_t len);
+
+/** Create a receiver bound to an address.
+ *  @param[in] address The local address or the multicast group, IPv4 or IPv6.
+ *  @param[in] port The UDP port.
+ *  @param[in] interface The interface to join a multicast group on, NULL for the default.
+ *  @return The new receiver, NULL on error with errno set.
+ */
+TsUdpReceiver *ts_udp_receiver_new(const char *address, uint16_t port, const char *interface);
+
+/** Create a receiver from an url udp://address:port or rtp://address:port.
+ *  IPv6 addresses are enclosed in brackets. RTP headers are detected in both cases.
+ *  @param[in] url The url.
+ *  @param[in] interface The interface to join a multicast group on, NULL for the default.
+ *  @return The new receiver, NULL on error.
+ */
+TsUdpReceiver *ts_udp_receiver_new_from_url(const char *url, const char *interface);
+
+/** Check whether a string is a url understood by ts_udp_receiver_new_from_url.
+ *  @param[in] url The string to check.
+ *  @return True if url starts with udp:// or rtp://.
+ */
+bool ts_udp_is_url(const char *url);
+
+/** Free a receiver and close its socket.
+ *  @param[in] receiver The receiver to free.
+ */
+void ts_udp_receiver_free(TsUdpReceiver *receiver);
+
+/** Receive up to TS_UDP_BATCH datagrams.
+ *  The payloads of datagrams of the usual size are received back to back into one buffer, so
+ *  that a batch is usually passed to push in one call.
+ *  @param[in] receiver The receiver.
+ *  @param[in] timeout_ms The time to wait for data in milliseconds, -1 to wait forever.
+ *  @param[in] push The callback for the received transport stream data.
+ *  @param[in] userdata The user data passed to push.
+ *  @return The number of datagrams received, 0 on timeout or interruption, -1 on error.
+ */
+int ts_udp_receiver_receive(TsUdpReceiver *receiver, int timeout_ms, TsUdpPushFunc push, void *userdata);
+
+/** Get the counters of a receiver.
+ *  @param[in] receiver The receiver.
+ *  @param[out] stats The counters.
+ */
+void ts_udp_receiver_get_stats(TsUdpReceiver *receiver, TsUdpStats *stats);